@@ -0,0 +1,101 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static const size_t ARENA_HUGE_PAGE = size_t(2) << 20;
+static const size_t ARENA_MAP_MIN   = size_t(32) << 20; // arenas this large are mapped
+
+/**
+ * Memory a worker loads blocks into, kept from one block to the next as long
+ * as it is large enough and at most a quarter larger than asked for.  Large arenas
+ * are mapped on their own and advised to be backed by transparent huge pages,
+ * which saves page faults and TLB misses on multi-GB blocks.
+ */
+class Arena {
+public:
+  Arena() : _data(nullptr), _capacity(0), _mapped(false) { }
+  ~Arena() { release(); }
+
+  size_t capacity() const { return _capacity; }
+
+  /// Return true if the arena can be reused for size bytes
+  bool fits(size_t size) const {
+    return _capacity >= size && _capacity - size <= std::max<size_t>(1, size) / 4;
+  }
+
+  /// Return room for size bytes, reusing the arena if it fits; its contents
+  ///    are not kept
+  char* reserve(size_t size) {
+    if(_data != nullptr && fits(size)) return _data;
+    release();
+    size = std::max<size_t>(1, size);
+#ifdef __linux__
+    if(size >= ARENA_MAP_MIN) {
+      size_t length = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+      void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(data == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      madvise(data, length, MADV_HUGEPAGE);
+#endif
+      _data = (char*)data;
+      _capacity = length;
+      _mapped = true;
+      return _data;
+    }
+#endif
+    _data = new char[size];
+    _capacity = size;
+    _mapped = false;
+    return _data;
+  }
+
+  void release() {
+    if(_data == nullptr) return;
+#ifdef __linux__
+    if(_mapped) {
+      munmap(_data, _capacity);
+    } else {
+      delete[] _data;
+    }
+#else
+    delete[] _data;
+#endif
+    _data = nullptr;
+    _capacity = 0;
+  }
+
+private:
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+
+  char*  _data;
+  size_t _capacity;
+  bool   _mapped;
+};
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Generator of synthetic BAM files for benchmarking fast-samtools-sort:
+//    reads of a fixed length placed uniformly over a set of equally long
+//    contigs, in random (or coordinate) order, with a fraction of them
+//    unmapped and a fraction piled up on a few hotspots
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include "bgzf.h"
+
+static size_t opt_reads = 1000000;
+static size_t opt_read_length = 100;
+static size_t opt_contigs = 24;
+static size_t opt_contig_length = 100000000;
+static double opt_unmapped = 0.05;   // fraction of the reads
+static size_t opt_hotspots = 0;
+static double opt_hotspot_reads = 0; // fraction of the mapped reads piled on the hotspots
+static size_t opt_hotspot_width = 50; // bp
+static bool opt_sorted = false;
+static size_t opt_compression = 6;
+static size_t opt_seed = 1;
+static std::string opt_outfname = "";
+
+struct Placement {
+  int32_t refid; // -1 if unmapped
+  int32_t pos;
+};
+
+// BAI bin of the 0-based interval [beg, end), as in the SAM specification
+static uint16_t reg2bin(int beg, int end) {
+  --end;
+  if(beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+  if(beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+  if(beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+  if(beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+  if(beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+  return 0;
+}
+
+template<typename T>
+static void append(std::vector<char>& rec, T v) {
+  rec.insert(rec.end(), (const char*)&v, (const char*)&v + sizeof(v));
+}
+
+// Encode read number id at the given placement as a raw BAM record
+static void make_record(std::vector<char>& rec, size_t id, const Placement& p, std::mt19937_64& rng) {
+  std::string name = "r" + std::to_string(id);
+  bool mapped = (p.refid >= 0);
+  rec.clear();
+  append<int32_t>(rec, 0); // block_size, set below
+  append<int32_t>(rec, p.refid);
+  append<int32_t>(rec, p.pos);
+  append<uint8_t>(rec, (uint8_t)(name.length() + 1));
+  append<uint8_t>(rec, mapped ? 60 : 0);
+  append<uint16_t>(rec, mapped ? reg2bin(p.pos, p.pos + (int)opt_read_length) : 4680);
+  append<uint16_t>(rec, mapped ? 1 : 0);
+  append<uint16_t>(rec, mapped ? ((id & 1) ? 16 : 0) : 4);
+  append<int32_t>(rec, (int32_t)opt_read_length);
+  append<int32_t>(rec, -1);
+  append<int32_t>(rec, -1);
+  append<int32_t>(rec, 0);
+  rec.insert(rec.end(), name.c_str(), name.c_str() + name.length() + 1);
+  if(mapped) append<uint32_t>(rec, (uint32_t)(opt_read_length << 4)); // <length>M
+  for(size_t i = 0; i < opt_read_length; i += 2) {
+    uint64_t r = rng();
+    uint8_t hi = (uint8_t)(1 << (r & 3));
+    uint8_t lo = (i + 1 < opt_read_length ? (uint8_t)(1 << ((r >> 2) & 3)) : 0);
+    rec.push_back((char)((hi << 4) | lo));
+  }
+  for(size_t i = 0; i < opt_read_length; i++) {
+    rec.push_back((char)(20 + rng() % 21));
+  }
+  int32_t block_size = (int32_t)(rec.size() - 4);
+  memcpy(&rec[0], &block_size, sizeof(block_size));
+}
+
+static void print_usage(std::ostream& out) {
+  out << "Usage: fast-samtools-sort-gen [options] -o out.bam" << std::endl
+      << "Options:" << std::endl
+      << "  -n INT              Number of reads (Default: 1000000)" << std::endl
+      << "  -r INT              Read length (Default: 100)" << std::endl
+      << "  -c INT              Number of contigs (Default: 24)" << std::endl
+      << "  -L INT              Length of each contig (Default: 100000000)" << std::endl
+      << "  -u FLOAT            Fraction of unmapped reads (Default: 0.05)" << std::endl
+      << "  --hotspots INT      Number of coverage hotspots (Default: 0)" << std::endl
+      << "  --hotspot-reads FLOAT  Fraction of the mapped reads on the hotspots (Default: 0)" << std::endl
+      << "  --hotspot-width INT Width of a hotspot in bp (Default: 50)" << std::endl
+      << "  --sorted            Write the reads in coordinate order, unmapped ones last" << std::endl
+      << "  -l INT              Compression level (Default: 6)" << std::endl
+      << "  -s INT              Random seed (Default: 1)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::set<std::string> uint_options {"-n", "-r", "-c", "-L", "--hotspots", "--hotspot-width", "-l", "-s"};
+  std::set<std::string> real_options {"-u", "--hotspot-reads"};
+  for(int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    bool is_uint = uint_options.count(option) > 0, is_real = real_options.count(option) > 0;
+    if((is_uint || is_real || option == "-o") && i + 1 >= argc) {
+      std::cerr << "Error: option, " << option << ", needs an argument." << std::endl;
+      return 1;
+    }
+    size_t uint_value = is_uint ? strtoull(argv[i + 1], nullptr, 10) : 0;
+    double real_value = is_real ? strtod(argv[i + 1], nullptr) : 0;
+    if(option == "-n") opt_reads = uint_value;
+    else if(option == "-r") opt_read_length = std::max<size_t>(1, uint_value);
+    else if(option == "-c") opt_contigs = std::max<size_t>(1, uint_value);
+    else if(option == "-L") opt_contig_length = std::max<size_t>(1, std::min<size_t>(uint_value, (size_t(1) << 29) - 1));
+    else if(option == "--hotspots") opt_hotspots = uint_value;
+    else if(option == "--hotspot-width") opt_hotspot_width = std::max<size_t>(1, uint_value);
+    else if(option == "-l") opt_compression = std::min<size_t>(9, uint_value);
+    else if(option == "-s") opt_seed = uint_value;
+    else if(option == "-u") opt_unmapped = std::min(1.0, std::max(0.0, real_value));
+    else if(option == "--hotspot-reads") opt_hotspot_reads = std::min(1.0, std::max(0.0, real_value));
+    else if(option == "-o") opt_outfname = argv[i + 1];
+    else if(option == "--sorted") opt_sorted = true;
+    else {
+      std::cerr << "Error: unrecognized option, " << option << std::endl << std::endl;
+      print_usage(std::cerr);
+      return 1;
+    }
+    if(is_uint || is_real || option == "-o") i++;
+  }
+  if(opt_outfname == "") {
+    print_usage(std::cerr);
+    return 1;
+  }
+
+  try {
+    std::mt19937_64 rng(opt_seed);
+    BamHeader header;
+    header.text = std::string("@HD\tVN:1.6\tSO:") + (opt_sorted ? "coordinate" : "unsorted") + "\n";
+    for(size_t i = 0; i < opt_contigs; i++) {
+      header.ref_names.push_back("chr" + std::to_string(i + 1));
+      header.ref_lens.push_back(opt_contig_length);
+      header.text += "@SQ\tSN:" + header.ref_names.back() + "\tLN:" + std::to_string(opt_contig_length) + "\n";
+    }
+    std::vector<Placement> hotspots(opt_hotspots);
+    for(size_t i = 0; i < hotspots.size(); i++) {
+      hotspots[i].refid = (int32_t)(rng() % opt_contigs);
+      hotspots[i].pos = (int32_t)(rng() % opt_contig_length);
+    }
+
+    // Placements are drawn in one go, so that sorted output can order them
+    std::vector<Placement> placements(opt_reads);
+    std::uniform_real_distribution<double> unit(0, 1);
+    for(size_t i = 0; i < opt_reads; i++) {
+      Placement& p = placements[i];
+      if(unit(rng) < opt_unmapped) {
+        p.refid = p.pos = -1;
+      } else if(!hotspots.empty() && unit(rng) < opt_hotspot_reads) {
+        const Placement& h = hotspots[rng() % hotspots.size()];
+        p.refid = h.refid;
+        p.pos = (int32_t)std::min<size_t>(h.pos + rng() % opt_hotspot_width, opt_contig_length - 1);
+      } else {
+        p.refid = (int32_t)(rng() % opt_contigs);
+        p.pos = (int32_t)(rng() % opt_contig_length);
+      }
+    }
+    if(opt_sorted) {
+      std::stable_sort(placements.begin(), placements.end(), [](const Placement& a, const Placement& b) {
+        if(a.refid != b.refid) return (uint32_t)a.refid < (uint32_t)b.refid; // unmapped (-1) last
+        return a.pos < b.pos;
+      });
+    }
+
+    BgzfWriter out((int)opt_compression);
+    if(!out.open(opt_outfname)) throw std::runtime_error("cannot open " + opt_outfname);
+    std::string header_bytes = bam_header_bytes(header);
+    out.write(header_bytes.data(), header_bytes.length());
+    out.flush();
+    std::vector<char> rec;
+    for(size_t i = 0; i < placements.size(); i++) {
+      make_record(rec, i, placements[i], rng);
+      out.write(rec.data(), rec.size());
+    }
+    out.close();
+  } catch(const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
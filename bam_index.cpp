@@ -0,0 +1,375 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdexcept>
+#include <algorithm>
+#include <sys/stat.h>
+#include "bgzf.h"
+#include "bam_index.h"
+
+std::string bam_index_find(const std::string& bam_fname) {
+  struct stat bam_st;
+  if(stat(bam_fname.c_str(), &bam_st) != 0) return "";
+  std::vector<std::string> candidates {bam_fname + ".bai", bam_fname + ".csi"};
+  if(bam_fname.length() > 4 && bam_fname.compare(bam_fname.length() - 4, 4, ".bam") == 0) {
+    candidates.push_back(bam_fname.substr(0, bam_fname.length() - 4) + ".bai");
+  }
+  for(size_t i = 0; i < candidates.size(); i++) {
+    struct stat st;
+    if(stat(candidates[i].c_str(), &st) == 0 && st.st_mtime >= bam_st.st_mtime) {
+      return candidates[i];
+    }
+  }
+  return "";
+}
+
+// Little-endian cursor over an index loaded into memory
+class IndexCursor {
+public:
+  IndexCursor(const std::vector<char>& data) : _data(data), _pos(0) { }
+
+  bool at_end() const { return _pos >= _data.size(); }
+
+  template<typename T>
+  T get() {
+    T v;
+    if(_pos + sizeof(T) > _data.size()) throw std::runtime_error("truncated BAM index");
+    memcpy(&v, _data.data() + _pos, sizeof(T));
+    _pos += sizeof(T);
+    return v;
+  }
+
+  void skip(size_t length) {
+    if(_pos + length > _data.size()) throw std::runtime_error("truncated BAM index");
+    _pos += length;
+  }
+
+private:
+  const std::vector<char>& _data;
+  size_t                   _pos;
+};
+
+// Windows without records of their own point at the next record to the left
+static void fill_windows(BamRefIndex& ref) {
+  for(size_t w = 0; w < ref.windows.size(); w++) {
+    if(ref.windows[w] == 0) {
+      ref.windows[w] = (w == 0 ? ref.ref_beg : ref.windows[w - 1]);
+    }
+  }
+}
+
+void bam_index_load(const std::string& fname, BamIndex& index) {
+  // CSI is BGZF compressed and BAI is not
+  std::vector<char> data;
+  {
+    FILE* fp = fopen(fname.c_str(), "rb");
+    if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+    unsigned char magic[2] = {0, 0};
+    bool compressed = (fread(magic, 1, 2, fp) == 2 && magic[0] == 31 && magic[1] == 139);
+    fclose(fp);
+    if(compressed) {
+      BgzfReader in;
+      if(!in.open(fname)) throw std::runtime_error("cannot open " + fname);
+      size_t count;
+      do {
+        data.resize(data.size() + BGZF_MAX_BLOCK_SIZE);
+        count = in.read(data.data() + data.size() - BGZF_MAX_BLOCK_SIZE, BGZF_MAX_BLOCK_SIZE);
+        data.resize(data.size() - BGZF_MAX_BLOCK_SIZE + count);
+      } while(count > 0);
+    } else {
+      fp = fopen(fname.c_str(), "rb");
+      char buffer[1 << 16];
+      size_t count;
+      while((count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        data.insert(data.end(), buffer, buffer + count);
+      }
+      fclose(fp);
+    }
+  }
+
+  IndexCursor cur(data);
+  char magic[4];
+  for(size_t i = 0; i < 4; i++) magic[i] = cur.get<char>();
+  bool csi = (memcmp(magic, "CSI\1", 4) == 0);
+  if(!csi && memcmp(magic, "BAI\1", 4) != 0) throw std::runtime_error(fname + " is not a BAI/CSI index");
+
+  int32_t depth = 5;
+  index.min_shift = 14;
+  if(csi) {
+    index.min_shift = cur.get<int32_t>();
+    depth = cur.get<int32_t>();
+    cur.skip(cur.get<int32_t>()); // aux
+  }
+  const uint32_t pseudo_bin = ((1u << ((depth + 1) * 3)) - 1) / 7 + 1;
+  const uint32_t finest_bin = ((1u << (depth * 3)) - 1) / 7;
+
+  index.refs.resize(cur.get<int32_t>());
+  for(size_t r = 0; r < index.refs.size(); r++) {
+    BamRefIndex& ref = index.refs[r];
+    int32_t n_bin = cur.get<int32_t>();
+    for(int32_t b = 0; b < n_bin; b++) {
+      uint32_t bin = cur.get<uint32_t>();
+      uint64_t loffset = csi ? cur.get<uint64_t>() : 0;
+      int32_t n_chunk = cur.get<int32_t>();
+      if(bin == pseudo_bin && n_chunk == 2) {
+        ref.ref_beg = cur.get<uint64_t>();
+        ref.ref_end = cur.get<uint64_t>();
+        ref.n_mapped = cur.get<uint64_t>();
+        ref.n_unmapped = cur.get<uint64_t>();
+        continue;
+      }
+      cur.skip(n_chunk * 2 * sizeof(uint64_t));
+      // CSI keeps the smallest offset per bin; its finest bins act as the linear index
+      if(csi && bin >= finest_bin && bin < pseudo_bin) {
+        size_t w = bin - finest_bin;
+        if(ref.windows.size() <= w) ref.windows.resize(w + 1, 0);
+        ref.windows[w] = loffset;
+      }
+    }
+    if(!csi) {
+      ref.windows.resize(cur.get<int32_t>());
+      for(size_t w = 0; w < ref.windows.size(); w++) {
+        ref.windows[w] = cur.get<uint64_t>();
+      }
+    }
+    fill_windows(ref);
+  }
+  index.has_no_coor = !cur.at_end();
+  if(index.has_no_coor) index.n_no_coor = cur.get<uint64_t>();
+}
+
+const uint64_t BamIndexBuilder::no_offset;
+const int      BamIndexBuilder::min_shift;
+
+BamIndexBuilder::BamIndexBuilder(int depth) : _depth(depth), _n_no_coor(0), _last_refid(-1), _last_bin(0) {
+}
+
+int BamIndexBuilder::depth_for(const std::vector<size_t>& ref_lens) {
+  uint64_t max_len = 0;
+  for(size_t i = 0; i < ref_lens.size(); i++) {
+    max_len = std::max<uint64_t>(max_len, ref_lens[i]);
+  }
+  // As samtools does, leave room past the end of the longest reference
+  max_len += 256;
+  int depth = 0;
+  for(uint64_t span = uint64_t(1) << min_shift; max_len > span; span <<= 3) depth++;
+  return std::max(depth, 5);
+}
+
+// The smallest bin that holds [beg, end), as htslib's hts_reg2bin
+uint32_t BamIndexBuilder::reg2bin(int64_t beg, int64_t end) const {
+  int shift = min_shift;
+  uint32_t first = ((1u << (_depth * 3)) - 1) / 7;
+  end--;
+  for(int level = _depth; level > 0; level--, shift += 3, first -= 1u << (level * 3)) {
+    if((beg >> shift) == (end >> shift)) return first + (uint32_t)(beg >> shift);
+  }
+  return 0;
+}
+
+void BamIndexBuilder::add_chunk(Chunks& chunks, uint64_t beg, uint64_t end) {
+  if(!chunks.empty() && chunks.back().second == beg) {
+    chunks.back().second = end;
+  } else {
+    chunks.push_back(std::make_pair(beg, end));
+  }
+}
+
+void BamIndexBuilder::push(const char* rec, uint64_t beg, uint64_t end) {
+  int32_t refid = bam_refid(rec);
+  _last_refid = refid;
+  if(refid < 0) {
+    _n_no_coor++;
+    return;
+  }
+  uint16_t flag, n_cigar;
+  memcpy(&flag, rec + 18, sizeof(flag));
+  memcpy(&n_cigar, rec + 16, sizeof(n_cigar));
+  bool mapped = !(flag & 4);
+
+  // The bases a record covers, as by htslib's bam_endpos: at least one
+  int64_t first = std::max<int32_t>(0, bam_pos(rec));
+  int64_t length = 0;
+  const char* cigar = rec + 36 + (unsigned char)rec[12];
+  if(mapped && cigar + n_cigar * 4 <= rec + bam_rec_size(rec)) {
+    for(size_t i = 0; i < n_cigar; i++) {
+      uint32_t op;
+      memcpy(&op, cigar + i * 4, sizeof(op));
+      // M, D, N, = and X take up reference bases
+      uint32_t type = op & 0xf;
+      if(type == 0 || type == 2 || type == 3 || type == 7 || type == 8) length += op >> 4;
+    }
+  }
+  int64_t last = first + std::max<int64_t>(1, length);
+
+  Ref& ref = _refs[refid];
+  if(ref.n_mapped + ref.n_unmapped == 0) ref.ref_beg = beg;
+  ref.ref_end = end;
+  if(mapped) {
+    ref.n_mapped++;
+    size_t first_window = first >> min_shift, last_window = (last - 1) >> min_shift;
+    if(ref.windows.empty()) ref.first_window = first_window;
+    if(first_window < ref.first_window) throw std::runtime_error("BAM index records pushed out of order");
+    if(ref.first_window + ref.windows.size() <= last_window) {
+      ref.windows.resize(last_window + 1 - ref.first_window, no_offset);
+    }
+    for(size_t w = first_window; w <= last_window; w++) {
+      uint64_t& offset = ref.windows[w - ref.first_window];
+      if(offset == no_offset) offset = beg;
+    }
+  } else {
+    ref.n_unmapped++;
+  }
+  _last_bin = reg2bin(first, last);
+  add_chunk(ref.bins[_last_bin], beg, end);
+}
+
+void BamIndexBuilder::block_flushed(uint64_t end, uint64_t next) {
+  if(end == next || _last_refid < 0) return;
+  Ref& ref = _refs[_last_refid];
+  if(ref.ref_end == end) ref.ref_end = next;
+  Chunks& chunks = ref.bins[_last_bin];
+  if(!chunks.empty() && chunks.back().second == end) chunks.back().second = next;
+}
+
+void BamIndexBuilder::append(const BamIndexBuilder& run, uint64_t coffset) {
+  const uint64_t shift = coffset << 16;
+  for(auto itr = run._refs.begin(); itr != run._refs.end(); itr++) {
+    const Ref& from = itr->second;
+    Ref& ref = _refs[itr->first];
+    if(ref.n_mapped + ref.n_unmapped == 0) ref.ref_beg = from.ref_beg + shift;
+    ref.ref_end = from.ref_end + shift;
+    ref.n_mapped += from.n_mapped;
+    ref.n_unmapped += from.n_unmapped;
+    // Earlier runs hold the smaller offsets of the windows they share
+    if(!from.windows.empty()) {
+      if(ref.windows.empty()) {
+        ref.first_window = from.first_window;
+      } else if(from.first_window < ref.first_window) {
+        ref.windows.insert(ref.windows.begin(), ref.first_window - from.first_window, no_offset);
+        ref.first_window = from.first_window;
+      }
+      size_t end = from.first_window + from.windows.size();
+      if(ref.first_window + ref.windows.size() < end) ref.windows.resize(end - ref.first_window, no_offset);
+      for(size_t w = 0; w < from.windows.size(); w++) {
+        uint64_t& offset = ref.windows[from.first_window + w - ref.first_window];
+        if(offset == no_offset && from.windows[w] != no_offset) offset = from.windows[w] + shift;
+      }
+    }
+    for(auto bin = from.bins.begin(); bin != from.bins.end(); bin++) {
+      Chunks& chunks = ref.bins[bin->first];
+      for(size_t i = 0; i < bin->second.size(); i++) {
+        add_chunk(chunks, bin->second[i].first + shift, bin->second[i].second + shift);
+      }
+    }
+  }
+  _n_no_coor += run._n_no_coor;
+}
+
+void BamIndexBuilder::save(const std::string& fname, size_t n_refs) const {
+  const bool is_csi = csi();
+  const uint32_t meta_bin = ((1u << ((_depth + 1) * 3)) - 1) / 7 + 1;
+  // Little-endian, as the host is assumed to be
+  std::string data;
+  auto put32 = [&data](uint32_t v) { data.append((const char*)&v, sizeof(v)); };
+  auto put64 = [&data](uint64_t v) { data.append((const char*)&v, sizeof(v)); };
+  data.append(is_csi ? "CSI\1" : "BAI\1", 4);
+  if(is_csi) {
+    put32(min_shift);
+    put32(_depth);
+    put32(0); // no aux data
+  }
+  put32((uint32_t)n_refs);
+  for(size_t r = 0; r < n_refs; r++) {
+    auto itr = _refs.find((int32_t)r);
+    if(itr == _refs.end()) {
+      put32(0);
+      if(!is_csi) put32(0);
+      continue;
+    }
+    const Ref& ref = itr->second;
+
+    // Windows without records of their own point at the record before them
+    std::vector<uint64_t> windows(ref.first_window + ref.windows.size(), ref.ref_beg);
+    for(size_t w = ref.first_window; w < windows.size(); w++) {
+      uint64_t offset = ref.windows[w - ref.first_window];
+      if(offset != no_offset) {
+        windows[w] = offset;
+      } else if(w > 0) {
+        windows[w] = windows[w - 1];
+      }
+    }
+
+    put32((uint32_t)ref.bins.size() + 1);
+    for(auto bin = ref.bins.begin(); bin != ref.bins.end(); bin++) {
+      // As htslib does, chunks that end in the BGZF block the next one starts
+      //    in are merged
+      Chunks chunks;
+      for(size_t i = 0; i < bin->second.size(); i++) {
+        const std::pair<uint64_t, uint64_t>& chunk = bin->second[i];
+        if(!chunks.empty() && (chunks.back().second >> 16) >= (chunk.first >> 16)) {
+          chunks.back().second = std::max(chunks.back().second, chunk.second);
+        } else {
+          chunks.push_back(chunk);
+        }
+      }
+      put32(bin->first);
+      if(is_csi) {
+        // The smallest offset of a bin is that of its first window
+        int level = 0;
+        for(uint32_t b = bin->first; b > 0; b = (b - 1) >> 3) level++;
+        size_t window = (bin->first - ((1u << (level * 3)) - 1) / 7) << ((_depth - level) * 3);
+        put64(window < windows.size() ? windows[window] : 0);
+      }
+      put32((uint32_t)chunks.size());
+      for(size_t i = 0; i < chunks.size(); i++) {
+        put64(chunks[i].first);
+        put64(chunks[i].second);
+      }
+    }
+    // The pseudo-bin holds the extent and record counts of the reference
+    put32(meta_bin);
+    if(is_csi) put64(0);
+    put32(2);
+    put64(ref.ref_beg);
+    put64(ref.ref_end);
+    put64(ref.n_mapped);
+    put64(ref.n_unmapped);
+    if(!is_csi) {
+      put32((uint32_t)windows.size());
+      for(size_t w = 0; w < windows.size(); w++) {
+        put64(windows[w]);
+      }
+    }
+  }
+  put64(_n_no_coor);
+
+  if(is_csi) {
+    BgzfWriter out;
+    if(!out.open(fname)) throw std::runtime_error("cannot open " + fname);
+    out.write(data.data(), data.length());
+    out.close();
+    return;
+  }
+  FILE* fp = fopen(fname.c_str(), "wb");
+  if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+  bool ok = fwrite(data.data(), 1, data.length(), fp) == data.length();
+  ok = (fclose(fp) == 0) && ok;
+  if(!ok) throw std::runtime_error("cannot write " + fname);
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BAM_INDEX_H_
+#define BAM_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The parts of a BAI/CSI index that are needed to plan blocks:
+//    per-reference record counts and the virtual offsets of genomic windows,
+//    and the building of a whole index for sorted output
+
+struct BamRefIndex {
+  // Smallest virtual offset of the records overlapping each window of
+  //    (1 << BamIndex::min_shift) bases; the BAI linear index
+  std::vector<uint64_t> windows;
+  uint64_t ref_beg = 0;   // virtual offsets spanned by the records of the reference
+  uint64_t ref_end = 0;
+  uint64_t n_mapped = 0;
+  uint64_t n_unmapped = 0;
+};
+
+struct BamIndex {
+  int                      min_shift = 14;
+  std::vector<BamRefIndex> refs;
+  bool                     has_no_coor = false;
+  uint64_t                 n_no_coor = 0; // unplaced, unmapped records
+};
+
+/// Return the .bai/.csi index of bam_fname that is not older than it,
+///    or an empty string
+std::string bam_index_find(const std::string& bam_fname);
+
+/// Load a BAI or CSI index, telling them apart by their magic
+void bam_index_load(const std::string& fname, BamIndex& index);
+
+/**
+ * Builder of the BAI/CSI index of a coordinate-sorted BAM file that is written
+ * as runs of BGZF blocks, such as the parts of a BgzfOrderedWriter.  Each run
+ * is indexed on its own, with virtual offsets relative to its start, and the
+ * runs are then appended in file order at the offsets they were written at.
+ * Bins and windows follow htslib, so that the index is valid for samtools.
+ */
+class BamIndexBuilder {
+public:
+  /// An index of depth levels of bins over windows of 1 << min_shift bases;
+  ///    BAI has depth 5 and min_shift 14
+  BamIndexBuilder(int depth = 5);
+
+  /// Depth that the bins need for references of these lengths: 5 fits BAI,
+  ///    more needs CSI
+  static int depth_for(const std::vector<size_t>& ref_lens);
+
+  int depth() const { return _depth; }
+  bool csi() const { return _depth != 5; }
+
+  /// Add a record written from virtual offset beg up to end, after the
+  ///    records pushed before it
+  void push(const char* rec, uint64_t beg, uint64_t end);
+  /// Tell that the block that offset end is in was flushed before it was
+  ///    full: a record ending there ends at next, the start of the following
+  ///    block, as readers see it
+  void block_flushed(uint64_t end, uint64_t next);
+  /// Count unplaced records that were written without being pushed
+  void add_no_coor(uint64_t count) { _n_no_coor += count; }
+  /// Append the index of a run of the same depth that starts at file offset
+  ///    coffset, after the runs appended before it
+  void append(const BamIndexBuilder& run, uint64_t coffset);
+
+  /// Write the index of a file with n_refs references: BAI, or BGZF
+  ///    compressed CSI if the depth needs it
+  void save(const std::string& fname, size_t n_refs) const;
+
+private:
+  typedef std::vector<std::pair<uint64_t, uint64_t> > Chunks;
+
+  struct Ref {
+    std::map<uint32_t, Chunks> bins;
+    // Smallest virtual offset of the mapped records overlapping each window
+    //    from first_window on, or no_offset
+    size_t                first_window = 0;
+    std::vector<uint64_t> windows;
+    uint64_t ref_beg = 0;
+    uint64_t ref_end = 0;
+    uint64_t n_mapped = 0;
+    uint64_t n_unmapped = 0;
+  };
+
+  static const uint64_t no_offset = ~uint64_t(0);
+  static const int      min_shift = 14;
+
+  static void add_chunk(Chunks& chunks, uint64_t beg, uint64_t end);
+  uint32_t reg2bin(int64_t beg, int64_t end) const;
+
+private:
+  int                    _depth;
+  std::map<int32_t, Ref> _refs;
+  uint64_t               _n_no_coor;
+  int32_t                _last_refid; // of the last record pushed
+  uint32_t               _last_bin;
+};
+
+#endif /* BAM_INDEX_H_ */
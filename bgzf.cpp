@@ -0,0 +1,480 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdexcept>
+#include <cassert>
+#include <algorithm>
+#include "bgzf.h"
+
+static const size_t BGZF_HEADER_SIZE = 12; // fixed gzip header up to XLEN
+static const size_t BGZF_FOOTER_SIZE = 8;  // CRC32 and ISIZE
+
+BgzfReader::BgzfReader() :
+  _fp(nullptr), _block_address(0), _next_block_address(0),
+  _cdata(BGZF_MAX_BLOCK_SIZE), _udata(BGZF_MAX_BLOCK_SIZE), _ulen(0), _upos(0) {
+  memset(&_zs, 0, sizeof(_zs));
+  if(inflateInit2(&_zs, -15) != Z_OK) throw std::runtime_error("inflateInit2() failed!");
+}
+
+BgzfReader::~BgzfReader() {
+  close();
+  inflateEnd(&_zs);
+}
+
+bool BgzfReader::open(const std::string& fname) {
+  close();
+  _fp = (fname == "-" ? stdin : fopen(fname.c_str(), "rb"));
+  _ulen = _upos = 0;
+  _block_address = _next_block_address = 0;
+  return _fp != nullptr;
+}
+
+void BgzfReader::close() {
+  if(_fp != nullptr) {
+    if(_fp != stdin) fclose(_fp);
+    _fp = nullptr;
+  }
+}
+
+// Read and inflate the next BGZF block; return false at the end of the file
+bool BgzfReader::read_block() {
+  unsigned char* header = (unsigned char*)_cdata.data();
+  size_t count = fread(header, 1, BGZF_HEADER_SIZE, _fp);
+  if(count == 0) return false;
+  if(count != BGZF_HEADER_SIZE || header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0) {
+    throw std::runtime_error("invalid BGZF block header");
+  }
+  size_t xlen = header[10] | (header[11] << 8);
+  if(BGZF_HEADER_SIZE + xlen > BGZF_MAX_BLOCK_SIZE ||
+     fread(header + BGZF_HEADER_SIZE, 1, xlen, _fp) != xlen) {
+    throw std::runtime_error("truncated BGZF block header");
+  }
+  // Find the BC subfield holding the total block size minus one
+  size_t block_size = 0;
+  for(size_t i = BGZF_HEADER_SIZE; i + 4 <= BGZF_HEADER_SIZE + xlen;) {
+    size_t slen = header[i + 2] | (header[i + 3] << 8);
+    if(header[i] == 'B' && header[i + 1] == 'C' && slen == 2 && i + 6 <= BGZF_HEADER_SIZE + xlen) {
+      block_size = (header[i + 4] | (header[i + 5] << 8)) + 1;
+    }
+    i += 4 + slen;
+  }
+  size_t remaining = block_size - BGZF_HEADER_SIZE - xlen;
+  if(block_size < BGZF_HEADER_SIZE + xlen + BGZF_FOOTER_SIZE ||
+     fread(header + BGZF_HEADER_SIZE + xlen, 1, remaining, _fp) != remaining) {
+    throw std::runtime_error("truncated BGZF block");
+  }
+  const unsigned char* footer = header + block_size - BGZF_FOOTER_SIZE;
+  uint32_t crc = footer[0] | (footer[1] << 8) | (footer[2] << 16) | ((uint32_t)footer[3] << 24);
+  size_t isize = footer[4] | (footer[5] << 8) | (footer[6] << 16) | ((uint32_t)footer[7] << 24);
+  if(isize > BGZF_MAX_BLOCK_SIZE) throw std::runtime_error("invalid BGZF block size");
+
+  inflateReset(&_zs);
+  _zs.next_in   = header + BGZF_HEADER_SIZE + xlen;
+  _zs.avail_in  = remaining - BGZF_FOOTER_SIZE;
+  _zs.next_out  = (Bytef*)_udata.data();
+  _zs.avail_out = _udata.size();
+  int ret = inflate(&_zs, Z_FINISH);
+  if(ret != Z_STREAM_END || _zs.total_out != isize) throw std::runtime_error("BGZF block inflate failed");
+  if(crc32(crc32(0L, Z_NULL, 0), (const Bytef*)_udata.data(), isize) != crc) {
+    throw std::runtime_error("BGZF block CRC mismatch");
+  }
+  _block_address = _next_block_address;
+  _next_block_address += block_size;
+  _ulen = isize;
+  _upos = 0;
+  return true;
+}
+
+size_t BgzfReader::read(void* data, size_t length) {
+  assert(_fp != nullptr);
+  size_t read_sofar = 0;
+  char* out = (char*)data;
+  while(read_sofar < length) {
+    if(_upos >= _ulen) {
+      if(!read_block()) break;
+      continue; // blocks may be empty, e.g. the EOF marker
+    }
+    size_t copy = std::min(length - read_sofar, _ulen - _upos);
+    memcpy(out + read_sofar, _udata.data() + _upos, copy);
+    _upos += copy;
+    read_sofar += copy;
+  }
+  return read_sofar;
+}
+
+// Empty block marking the end of a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+  31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+BgzfWriter::BgzfWriter(int level) :
+  _fp(nullptr), _buffer(nullptr), _udata(BGZF_BLOCK_SIZE), _ulen(0), _cdata(BGZF_MAX_BLOCK_SIZE) {
+  memset(&_zs, 0, sizeof(_zs));
+  if(deflateInit2(&_zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("deflateInit2() failed!");
+  }
+}
+
+BgzfWriter::~BgzfWriter() {
+  // Callers close() explicitly to see write errors
+  try {
+    close();
+  } catch(const std::runtime_error&) {
+  }
+  deflateEnd(&_zs);
+}
+
+bool BgzfWriter::open(const std::string& fname) {
+  close();
+  _fp = fopen(fname.c_str(), "wb");
+  _ulen = 0;
+  return _fp != nullptr;
+}
+
+void BgzfWriter::open(std::vector<char>& buffer) {
+  close();
+  _buffer = &buffer;
+  _ulen = 0;
+}
+
+void BgzfWriter::close() {
+  if(_buffer != nullptr) {
+    flush();
+    _buffer = nullptr;
+    return;
+  }
+  if(_fp == nullptr) return;
+  flush();
+  bool ok = fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), _fp) == sizeof(BGZF_EOF);
+  ok = (fclose(_fp) == 0) && ok;
+  _fp = nullptr;
+  if(!ok) throw std::runtime_error("failed to write BGZF file");
+}
+
+void BgzfWriter::write(const void* data, size_t length) {
+  assert(is_open());
+  const char* in = (const char*)data;
+  while(length > 0) {
+    size_t copy = std::min(length, BGZF_BLOCK_SIZE - _ulen);
+    memcpy(_udata.data() + _ulen, in, copy);
+    _ulen += copy;
+    in += copy;
+    length -= copy;
+    if(_ulen == BGZF_BLOCK_SIZE) flush();
+  }
+}
+
+void BgzfWriter::flush() {
+  if(_ulen == 0) return;
+  unsigned char* block = (unsigned char*)_cdata.data();
+  const size_t header_size = BGZF_HEADER_SIZE + 6; // with the BC subfield
+  deflateReset(&_zs);
+  _zs.next_in   = (Bytef*)_udata.data();
+  _zs.avail_in  = _ulen;
+  _zs.next_out  = block + header_size;
+  _zs.avail_out = BGZF_MAX_BLOCK_SIZE - header_size - BGZF_FOOTER_SIZE;
+  // BGZF_BLOCK_SIZE leaves room for deflate's worst-case expansion
+  if(deflate(&_zs, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("BGZF block deflate failed");
+  size_t block_size = header_size + _zs.total_out + BGZF_FOOTER_SIZE;
+
+  static const unsigned char header[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0};
+  memcpy(block, header, sizeof(header));
+  block[16] = (block_size - 1) & 0xff;
+  block[17] = (block_size - 1) >> 8;
+  uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*)_udata.data(), _ulen);
+  unsigned char* footer = block + block_size - BGZF_FOOTER_SIZE;
+  for(size_t i = 0; i < 4; i++) {
+    footer[i]     = (crc >> (8 * i)) & 0xff;
+    footer[i + 4] = (_ulen >> (8 * i)) & 0xff;
+  }
+  if(_buffer != nullptr) {
+    _buffer->insert(_buffer->end(), (const char*)block, (const char*)block + block_size);
+  } else if(fwrite(block, 1, block_size, _fp) != block_size) {
+    throw std::runtime_error("failed to write BGZF block");
+  }
+  _ulen = 0;
+}
+
+BgzfOrderedWriter::BgzfOrderedWriter(size_t max_pending) :
+  _fp(nullptr), _max_pending(max_pending), _pending_bytes(0), _next(0), _writing(false), _failed(false) {
+}
+
+BgzfOrderedWriter::~BgzfOrderedWriter() {
+  if(_fp != nullptr && _fp != stdout) fclose(_fp);
+}
+
+bool BgzfOrderedWriter::open(const std::string& fname, const std::function<std::string(size_t)>& spill_fname) {
+  _fp = (fname == "-" ? stdout : fopen(fname.c_str(), "wb"));
+  _spill_fname = spill_fname;
+  _next = 0;
+  _failed = false;
+  return _fp != nullptr;
+}
+
+void BgzfOrderedWriter::close() {
+  if(_fp == nullptr) return;
+  bool ok = !_failed && _pending.empty();
+  ok = (fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), _fp) == sizeof(BGZF_EOF)) && ok;
+  ok = (_fp == stdout ? fflush(_fp) : fclose(_fp)) == 0 && ok;
+  _fp = nullptr;
+  if(!ok) throw std::runtime_error("failed to write BGZF file");
+}
+
+bool BgzfOrderedWriter::write_part(size_t index, const std::vector<char>& part, bool spilled) {
+  if(!spilled) return part.empty() || fwrite(part.data(), 1, part.size(), _fp) == part.size();
+  std::string fname = _spill_fname(index);
+  FILE* fp = fopen(fname.c_str(), "rb");
+  if(fp == nullptr) return false;
+  char buffer[1 << 16];
+  size_t count;
+  bool ok = true;
+  while(ok && (count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    ok = (fwrite(buffer, 1, count, _fp) == count);
+  }
+  fclose(fp);
+  remove(fname.c_str());
+  return ok;
+}
+
+void BgzfOrderedWriter::put(size_t index, std::vector<char>& data) {
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  assert(index >= _next && _pending.find(index) == _pending.end());
+  if(index != _next && _pending_bytes + data.size() > _max_pending) {
+    std::string fname = _spill_fname(index);
+    FILE* fp = fopen(fname.c_str(), "wb");
+    bool ok = (fp != nullptr && (data.empty() || fwrite(data.data(), 1, data.size(), fp) == data.size()));
+    if(fp != nullptr) ok = (fclose(fp) == 0) && ok;
+    _failed = _failed || !ok;
+    std::vector<char>().swap(data);
+    _spilled.insert(index);
+  }
+  _pending_bytes += data.size();
+  _pending[index].swap(data);
+  std::vector<char>().swap(data);
+  if(_writing) return;
+
+  _writing = true;
+  while(!_pending.empty() && _pending.begin()->first == _next) {
+    std::vector<char> part;
+    part.swap(_pending.begin()->second);
+    _pending.erase(_pending.begin());
+    bool spilled = (_spilled.erase(_next) > 0);
+    _mutex.unlock();
+    bool ok = write_part(_next, part, spilled);
+    _mutex.lock();
+    _failed = _failed || !ok;
+    _pending_bytes -= part.size();
+    _next++;
+  }
+  _writing = false;
+}
+
+bool BgzfReader::seek(uint64_t voffset) {
+  assert(_fp != nullptr);
+  if(fseeko(_fp, voffset >> 16, SEEK_SET) != 0) return false;
+  _next_block_address = voffset >> 16;
+  _ulen = _upos = 0;
+  if(!read_block()) {
+    // Seeking to the end of the file is allowed
+    _block_address = _next_block_address;
+    return (voffset & 0xffff) == 0;
+  }
+  _upos = voffset & 0xffff;
+  return _upos <= _ulen;
+}
+
+bool BgzfReader::read_chunk(std::vector<char>& data, uint64_t& voffset) {
+  assert(_fp != nullptr);
+  while(_upos >= _ulen) {
+    if(!read_block()) return false;
+  }
+  voffset = tell();
+  data.insert(data.end(), _udata.data() + _upos, _udata.data() + _ulen);
+  _upos = _ulen;
+  return true;
+}
+
+uint64_t bgzf_find_block(const std::string& fname, uint64_t offset) {
+  FILE* fp = fopen(fname.c_str(), "rb");
+  if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+  fseeko(fp, 0, SEEK_END);
+  uint64_t file_size = ftello(fp);
+  // A block is at most 64 KB, so a window of twice that holds a whole block
+  //    header followed by the header of the block after it
+  std::vector<unsigned char> window(BGZF_MAX_BLOCK_SIZE * 2 + 18);
+  uint64_t found = file_size;
+  for(uint64_t base = offset; base < file_size && found == file_size; base += BGZF_MAX_BLOCK_SIZE) {
+    fseeko(fp, base, SEEK_SET);
+    size_t len = fread(window.data(), 1, window.size(), fp);
+    for(size_t i = 0; i < BGZF_MAX_BLOCK_SIZE && i + 18 <= len; i++) {
+      const unsigned char* h = &window[i];
+      if(h[0] != 31 || h[1] != 139 || h[2] != 8 || h[3] != 4 || h[10] != 6 || h[11] != 0 ||
+         h[12] != 'B' || h[13] != 'C' || h[14] != 2 || h[15] != 0) continue;
+      size_t block_size = (h[16] | (h[17] << 8)) + 1;
+      // The next block must start right after this one, unless this is the last
+      if(base + i + block_size == file_size ||
+         (i + block_size + 4 <= len && window[i + block_size] == 31 && window[i + block_size + 1] == 139 &&
+          window[i + block_size + 2] == 8 && window[i + block_size + 3] == 4)) {
+        found = base + i;
+        break;
+      }
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+uint64_t bgzf_data_end(const std::string& fname) {
+  FILE* fp = fopen(fname.c_str(), "rb");
+  if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+  fseeko(fp, 0, SEEK_END);
+  uint64_t file_size = ftello(fp);
+  unsigned char tail[sizeof(BGZF_EOF)];
+  bool eof = (file_size >= sizeof(tail) && fseeko(fp, file_size - sizeof(tail), SEEK_SET) == 0 &&
+              fread(tail, 1, sizeof(tail), fp) == sizeof(tail) && memcmp(tail, BGZF_EOF, sizeof(tail)) == 0);
+  fclose(fp);
+  return eof ? file_size - sizeof(tail) : file_size;
+}
+
+bool bgzf_is_bam(const std::string& fname) {
+  // Standard input can only be peeked at, a byte at a time
+  if(fname == "-") {
+    int c = getc(stdin);
+    if(c == EOF) return false;
+    ungetc(c, stdin);
+    return c == 31;
+  }
+  try {
+    BgzfReader in;
+    if(!in.open(fname)) return false;
+    char magic[4];
+    return in.read(magic, 4) == 4 && memcmp(magic, "BAM\1", 4) == 0;
+  } catch(const std::runtime_error&) {
+    return false;
+  }
+}
+
+static int32_t read_i32(BgzfReader& in) {
+  int32_t v;
+  if(in.read(&v, sizeof(v)) != sizeof(v)) throw std::runtime_error("truncated BAM header");
+  return v;
+}
+
+void bam_read_header(BgzfReader& in, BamHeader& header) {
+  char magic[4];
+  if(in.read(magic, 4) != 4 || memcmp(magic, "BAM\1", 4) != 0) {
+    throw std::runtime_error("not a BAM file");
+  }
+  int32_t l_text = read_i32(in);
+  if(l_text < 0) throw std::runtime_error("invalid BAM header");
+  header.text.resize(l_text);
+  if(in.read(&header.text[0], l_text) != (size_t)l_text) throw std::runtime_error("truncated BAM header");
+  int32_t n_ref = read_i32(in);
+  if(n_ref < 0) throw std::runtime_error("invalid BAM header");
+  header.ref_names.resize(n_ref);
+  header.ref_lens.resize(n_ref);
+  for(int32_t i = 0; i < n_ref; i++) {
+    int32_t l_name = read_i32(in);
+    if(l_name <= 0) throw std::runtime_error("invalid BAM reference name");
+    std::string& name = header.ref_names[i];
+    name.resize(l_name);
+    if(in.read(&name[0], l_name) != (size_t)l_name) throw std::runtime_error("truncated BAM header");
+    name.resize(l_name - 1); // drop NUL
+    header.ref_lens[i] = (uint32_t)read_i32(in);
+  }
+}
+
+std::string bam_header_bytes(const BamHeader& header) {
+  std::string bytes = "BAM\1";
+  auto append_i32 = [&bytes](int32_t v) { bytes.append((const char*)&v, sizeof(v)); };
+  append_i32((int32_t)header.text.length());
+  bytes += header.text;
+  append_i32((int32_t)header.ref_names.size());
+  for(size_t i = 0; i < header.ref_names.size(); i++) {
+    append_i32((int32_t)header.ref_names[i].length() + 1);
+    bytes.append(header.ref_names[i].c_str(), header.ref_names[i].length() + 1);
+    append_i32((int32_t)header.ref_lens[i]);
+  }
+  return bytes;
+}
+
+// Check that the records starting at offset p of data are consistent with the
+//    header up to the end of data
+static bool bam_chain_plausible(const std::vector<char>& data, size_t p, const BamHeader& header) {
+  size_t count = 0;
+  const int32_t n_ref = (int32_t)header.ref_lens.size();
+  while(p + 36 <= data.size()) {
+    const char* r = data.data() + p;
+    int32_t block_size = bam_get_i32(r);
+    int32_t refid = bam_get_i32(r + 4), pos = bam_get_i32(r + 8);
+    uint32_t l_read_name = (unsigned char)r[12];
+    uint32_t n_cigar = (unsigned char)r[16] | ((unsigned char)r[17] << 8);
+    int32_t l_seq = bam_get_i32(r + 20);
+    int32_t next_refid = bam_get_i32(r + 24), next_pos = bam_get_i32(r + 28);
+    if(block_size < 32 || refid < -1 || refid >= n_ref || next_refid < -1 || next_refid >= n_ref ||
+       pos < -1 || next_pos < -1 || l_read_name == 0 || l_seq < 0 ||
+       (refid >= 0 && (size_t)pos > header.ref_lens[refid]) ||
+       32 + l_read_name + 4 * (uint64_t)n_cigar + (l_seq + 1) / 2 + (uint64_t)l_seq > (uint64_t)block_size) {
+      return false;
+    }
+    if(p + 36 + l_read_name <= data.size()) {
+      if(r[36 + l_read_name - 1] != 0) return false;
+      for(size_t i = 0; i + 1 < l_read_name; i++) {
+        if(r[36 + i] < '!' || r[36 + i] > '~') return false;
+      }
+    }
+    p += (size_t)block_size + 4;
+    count++;
+  }
+  return count >= 3 || (count >= 1 && p >= data.size());
+}
+
+bool bam_sync(BgzfReader& in, const BamHeader& header, uint64_t limit, uint64_t& voffset, size_t look_ahead) {
+  // Decode the first block plus some look-ahead, remembering where blocks start
+  std::vector<char> data;
+  std::vector<std::pair<size_t, uint64_t> > chunks;
+  uint64_t chunk_voffset;
+  while(data.size() < look_ahead) {
+    size_t chunk_begin = data.size();
+    if(!in.read_chunk(data, chunk_voffset)) break;
+    chunks.push_back(std::make_pair(chunk_begin, chunk_voffset));
+  }
+  for(size_t c = 0; c < chunks.size(); c++) {
+    if((chunks[c].second >> 16) >= limit) return false;
+    size_t chunk_end = (c + 1 < chunks.size() ? chunks[c + 1].first : data.size());
+    for(size_t p = chunks[c].first; p < chunk_end; p++) {
+      if(bam_chain_plausible(data, p, header)) {
+        voffset = chunks[c].second + (p - chunks[c].first);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool bam_read_record(BgzfReader& in, std::vector<char>& rec) {
+  int32_t block_size;
+  size_t count = in.read(&block_size, sizeof(block_size));
+  if(count == 0) return false;
+  if(count != sizeof(block_size) || block_size < 32) throw std::runtime_error("invalid BAM record");
+  if(rec.size() < (size_t)block_size + 4) rec.resize((size_t)block_size + 4);
+  memcpy(rec.data(), &block_size, sizeof(block_size));
+  if(in.read(rec.data() + 4, block_size) != (size_t)block_size) throw std::runtime_error("truncated BAM record");
+  return true;
+}
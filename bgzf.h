@@ -0,0 +1,202 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
+#include <zlib.h>
+#include "tinythread.h"
+
+// Minimal BGZF/BAM support on top of zlib, so that BAM records can be
+//    read natively instead of being decoded to SAM text by samtools.
+//    BAM is little-endian; like samtools, we assume a little-endian host.
+
+static const size_t BGZF_MAX_BLOCK_SIZE = 1 << 16;
+static const size_t BGZF_BLOCK_SIZE = 0xff00; // uncompressed data per block, as in htslib
+
+/**
+ * Sequential reader of a BGZF compressed file (e.g. BAM).
+ */
+class BgzfReader {
+public:
+  BgzfReader();
+  ~BgzfReader();
+
+  /// fname "-" is the standard input, which is read but not closed
+  bool open(const std::string& fname);
+  void close();
+  bool is_open() const { return _fp != nullptr; }
+
+  /// Read up to length bytes of uncompressed data, return the number of bytes read
+  size_t read(void* data, size_t length);
+
+  /// Virtual offset (compressed block address << 16 | offset within block);
+  ///    the end of a block is reported as the start of the next one
+  uint64_t tell() const {
+    return _upos < _ulen ? ((_block_address << 16) | _upos) : (_next_block_address << 16);
+  }
+  /// Move to a virtual offset obtained from tell() or a BAM index
+  bool seek(uint64_t voffset);
+
+  /// Append the rest of the current block, or the next non-empty one, to data
+  ///    and set voffset to where it started; return false at the end of the file
+  bool read_chunk(std::vector<char>& data, uint64_t& voffset);
+
+private:
+  bool read_block();
+
+private:
+  FILE*             _fp;
+  uint64_t          _block_address;      // file offset of the current block
+  uint64_t          _next_block_address; // file offset of the next block
+  z_stream          _zs;
+  std::vector<char> _cdata;  // compressed block
+  std::vector<char> _udata;  // uncompressed block
+  size_t            _ulen;   // length of the uncompressed block
+  size_t            _upos;   // read position within the uncompressed block
+};
+
+/**
+ * Writer of a BGZF compressed file.  Data is compressed in blocks of up to
+ * BGZF_BLOCK_SIZE bytes by the calling thread, either into a file or into a
+ * memory buffer that is later handed to a BgzfOrderedWriter.
+ */
+class BgzfWriter {
+public:
+  BgzfWriter(int level = Z_DEFAULT_COMPRESSION);
+  ~BgzfWriter();
+
+  bool open(const std::string& fname);
+  /// Append compressed blocks to buffer; no EOF marker is written
+  void open(std::vector<char>& buffer);
+  /// Flush pending data and append the BGZF EOF marker
+  void close();
+  bool is_open() const { return _fp != nullptr || _buffer != nullptr; }
+
+  void write(const void* data, size_t length);
+  /// Compress pending data into a block of its own
+  void flush();
+
+  /// Virtual offset of the next byte written into a buffer, relative to its
+  ///    start; full blocks are flushed right away, so the offset within a
+  ///    block stays below BGZF_BLOCK_SIZE
+  uint64_t tell() const { return ((uint64_t)_buffer->size() << 16) | _ulen; }
+
+private:
+  FILE*              _fp;
+  std::vector<char>* _buffer;
+  z_stream           _zs;
+  std::vector<char> _udata;  // pending uncompressed data
+  size_t            _ulen;
+  std::vector<char> _cdata;  // compressed block
+};
+
+/**
+ * Writes parts of a BGZF file, each a run of compressed blocks, in the order of
+ * their indexes, whichever threads produce them and in whichever order.  The
+ * thread that hands over the next part writes it, along with any later parts
+ * that are already waiting; other threads only queue their part.  Parts that
+ * would take the queue past max_pending bytes wait in spill files instead.
+ */
+class BgzfOrderedWriter {
+public:
+  BgzfOrderedWriter(size_t max_pending);
+  ~BgzfOrderedWriter();
+
+  /// Spill files are named by spill_fname from the part index; fname "-" is
+  ///    the standard output
+  bool open(const std::string& fname, const std::function<std::string(size_t)>& spill_fname);
+  /// Check that no part is missing and append the BGZF EOF marker
+  void close();
+
+  /// Hand over part index; data is left empty
+  void put(size_t index, std::vector<char>& data);
+
+private:
+  bool write_part(size_t index, const std::vector<char>& part, bool spilled);
+
+private:
+  FILE*                                _fp;
+  std::function<std::string(size_t)>   _spill_fname;
+  size_t                               _max_pending;
+  size_t                               _pending_bytes;
+  size_t                               _next;     // index of the next part to write
+  bool                                 _writing;  // a thread is writing parts
+  bool                                 _failed;
+  std::map<size_t, std::vector<char> > _pending;
+  std::set<size_t>                     _spilled;  // pending parts kept in spill files
+  tthread::mutex                       _mutex;
+};
+
+/// Return the address of the first BGZF block starting at or after offset,
+///    or the file size if there is none
+uint64_t bgzf_find_block(const std::string& fname, uint64_t offset);
+
+/// Return the size of fname without its trailing BGZF EOF marker, if any
+uint64_t bgzf_data_end(const std::string& fname);
+
+/// Return true if fname starts with a BGZF block holding BAM magic.  The
+///    standard input, "-", is taken for BAM if it starts with gzip magic,
+///    and none of it is consumed.
+bool bgzf_is_bam(const std::string& fname);
+
+struct BamHeader {
+  std::string              text;
+  std::vector<std::string> ref_names;
+  std::vector<size_t>      ref_lens;
+};
+
+/// Read BAM magic, header text and reference list
+void bam_read_header(BgzfReader& in, BamHeader& header);
+
+/// Serialize a BAM header in its uncompressed on-disk form
+std::string bam_header_bytes(const BamHeader& header);
+
+/// Find the first plausible alignment record at or after the reader's position
+///    (which should be the start of a block), using the consistency of a chain
+///    of record headers over look_ahead bytes.  Return false if none starts
+///    before the block at limit.  Records have no sync marker, so callers
+///    must verify the result.
+bool bam_sync(BgzfReader& in, const BamHeader& header, uint64_t limit, uint64_t& voffset, size_t look_ahead = 1 << 20);
+
+/// Read the next alignment record, block_size included, into rec.
+///    Return false at the end of the file.
+bool bam_read_record(BgzfReader& in, std::vector<char>& rec);
+
+// Accessors into a raw alignment record (starting at its block_size field)
+inline int32_t bam_get_i32(const char* p) {
+  int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/// Size of the record including the 4-byte block_size field
+inline size_t bam_rec_size(const char* rec) { return (size_t)bam_get_i32(rec) + 4; }
+inline int32_t bam_refid(const char* rec)   { return bam_get_i32(rec + 4); }
+inline int32_t bam_pos(const char* rec)     { return bam_get_i32(rec + 8); }
+
+#endif /* BGZF_H_ */
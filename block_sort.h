@@ -0,0 +1,90 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCK_SORT_H_
+#define BLOCK_SORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "radix_sort.h"
+
+struct SamRecord {
+  size_t read_id;
+  size_t pos;
+  char* line;
+};
+
+struct SamRecord_cmp {
+  bool operator() (const SamRecord& a, const SamRecord& b) const {
+    if(a.pos != b.pos) return a.pos < b.pos;
+    return a.read_id < b.read_id; // Preserve reads
+  }
+};
+
+inline unsigned bit_width(uint64_t v) {
+  unsigned bits = 0;
+  for(; v > 0; v >>= 1) bits++;
+  return bits;
+}
+
+// Sort a block by (pos, read_id).  A block's positions span a narrow range, so
+//    the offset from its first position, packed with the read_id offset, makes
+//    a 64-bit key for a linear radix sort; records already in read_id order
+//    need the position alone, as the radix sort is stable.  std::sort remains
+//    for small blocks and for keys that do not fit.  Given a runner of tasks,
+//    large blocks are sorted with it on several threads.
+typedef std::function<void(size_t, const std::function<void(size_t)>&)> TaskRunner;
+static const size_t parallel_sort_min = size_t(1) << 16; // records
+
+inline void block_sort(std::vector<SamRecord>& samRecords, const TaskRunner& run = TaskRunner(), size_t num_chunks = 1) {
+  if(samRecords.size() < 256) {
+    std::sort(samRecords.begin(), samRecords.end(), SamRecord_cmp());
+    return;
+  }
+  size_t min_pos = samRecords[0].pos, max_pos = min_pos;
+  size_t min_id = samRecords[0].read_id, max_id = min_id;
+  bool id_ordered = true;
+  for(size_t i = 1; i < samRecords.size(); i++) {
+    const SamRecord& r = samRecords[i];
+    min_pos = std::min(min_pos, r.pos);
+    max_pos = std::max(max_pos, r.pos);
+    id_ordered = id_ordered && r.read_id > samRecords[i - 1].read_id;
+    min_id = std::min(min_id, r.read_id);
+    max_id = std::max(max_id, r.read_id);
+  }
+  unsigned pos_bits = bit_width(max_pos - min_pos);
+  unsigned id_bits = id_ordered ? 0 : bit_width(max_id - min_id);
+  if(pos_bits + id_bits > 63) {
+    std::sort(samRecords.begin(), samRecords.end(), SamRecord_cmp());
+    return;
+  }
+  auto key = [min_pos, min_id, id_bits](const SamRecord& r) {
+    return ((uint64_t)(r.pos - min_pos) << id_bits) | (id_bits > 0 ? r.read_id - min_id : 0);
+  };
+  if(run && num_chunks > 1 && samRecords.size() >= parallel_sort_min) {
+    radix_sort_parallel(samRecords, key, pos_bits + id_bits, num_chunks, run);
+  } else {
+    radix_sort(samRecords, key, pos_bits + id_bits);
+  }
+}
+
+#endif /* BLOCK_SORT_H_ */
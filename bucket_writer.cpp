@@ -0,0 +1,211 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+#include "tmp_file.h"
+#include "bucket_writer.h"
+
+#ifdef O_DIRECT
+static const int BUCKET_O_DIRECT = O_DIRECT;
+#else
+static const int BUCKET_O_DIRECT = 0;
+#endif
+
+static const size_t BUCKET_BUFFER_MAX = size_t(4) << 20;
+
+BucketWriter::BucketWriter(size_t num_buckets, const std::function<std::string(size_t)>& fname, size_t budget, bool direct) :
+  _fname(fname), _direct(direct),
+  _buffers(num_buckets, nullptr), _lengths(num_buckets, 0), _closed(num_buckets, 0),
+  _queued_bytes(0), _pending(num_buckets, 0), _stop(false),
+  _fds(num_buckets, -1), _created(num_buckets, 0), _lru_pos(num_buckets), _thread(nullptr) {
+  // Half of the budget for the buffers being filled, and half for the ones
+  //    waiting for the writer, of which there is always room for one
+  size_t buffer_size = std::min(BUCKET_BUFFER_MAX, budget / 2 / std::max<size_t>(1, num_buckets));
+  _buffer_size = std::max(TMP_FILE_ALIGN, buffer_size / TMP_FILE_ALIGN * TMP_FILE_ALIGN);
+  _max_queued = std::max(budget / 2, _buffer_size);
+  struct rlimit rl;
+  size_t fd_limit = 1024;
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) fd_limit = (size_t)rl.rlim_cur;
+  _max_open = std::max<size_t>(1, std::min(num_buckets, fd_limit / 2));
+  _thread = new tthread::thread(writer_main, this);
+}
+
+BucketWriter::~BucketWriter() {
+  {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _stop = true;
+    _cond.notify_all();
+  }
+  _thread->join();
+  delete _thread;
+  for(size_t i = 0; i < _fds.size(); i++) {
+    if(_fds[i] >= 0) ::close(_fds[i]);
+    free(_buffers[i]);
+  }
+  for(size_t i = 0; i < _queue.size(); i++) free(_queue[i].data);
+  for(size_t i = 0; i < _free.size(); i++) free(_free[i]);
+}
+
+char* BucketWriter::take_buffer() {
+  {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    if(!_free.empty()) {
+      char* buffer = _free.back();
+      _free.pop_back();
+      return buffer;
+    }
+  }
+  char* buffer = nullptr;
+  if(posix_memalign((void**)&buffer, TMP_FILE_ALIGN, _buffer_size) != 0) throw std::bad_alloc();
+  return buffer;
+}
+
+void BucketWriter::write(size_t bucket, const void* data, size_t length) {
+  const char* p = (const char*)data;
+  while(length > 0) {
+    if(_buffers[bucket] == nullptr) _buffers[bucket] = take_buffer();
+    size_t count = std::min(length, _buffer_size - _lengths[bucket]);
+    memcpy(_buffers[bucket] + _lengths[bucket], p, count);
+    _lengths[bucket] += count;
+    p += count;
+    length -= count;
+    if(_lengths[bucket] == _buffer_size) submit(bucket, false);
+  }
+}
+
+void BucketWriter::submit(size_t bucket, bool last) {
+  Chunk chunk = { bucket, _buffers[bucket], _lengths[bucket], last };
+  _buffers[bucket] = nullptr;
+  _lengths[bucket] = 0;
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  while(_queued_bytes + _buffer_size > _max_queued && !_queue.empty() && _error.empty()) {
+    _cond.wait(_mutex);
+  }
+  _queue.push_back(chunk);
+  _queued_bytes += _buffer_size;
+  _pending[bucket]++;
+  _cond.notify_all();
+}
+
+void BucketWriter::close(size_t bucket) {
+  if(_closed[bucket]) return;
+  _closed[bucket] = 1;
+  submit(bucket, true);
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  while(_pending[bucket] > 0) _cond.wait(_mutex);
+  if(!_error.empty()) throw std::runtime_error(_error);
+}
+
+void BucketWriter::close() {
+  for(size_t i = 0; i < _buffers.size(); i++) {
+    if(!_closed[i]) {
+      _closed[i] = 1;
+      submit(i, true);
+    }
+  }
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  while(!_queue.empty() || std::any_of(_pending.begin(), _pending.end(), [](size_t n) { return n > 0; })) {
+    _cond.wait(_mutex);
+  }
+  if(!_error.empty()) throw std::runtime_error(_error);
+}
+
+// File of a bucket, opened or reopened for appending, within the limit of
+//    open files
+int BucketWriter::file(size_t bucket) {
+  if(_fds[bucket] >= 0) {
+    _lru.splice(_lru.begin(), _lru, _lru_pos[bucket]);
+    return _fds[bucket];
+  }
+  std::string fname = _fname(bucket);
+  int flags = O_WRONLY | O_CREAT | (_created[bucket] ? O_APPEND : O_TRUNC);
+  while(true) {
+    if(_lru.size() >= _max_open) close_file(_lru.back());
+    int fd = ::open(fname.c_str(), flags | (_direct ? BUCKET_O_DIRECT : 0), 0644);
+    // File systems without direct I/O refuse it
+    if(fd < 0 && _direct && errno == EINVAL) fd = ::open(fname.c_str(), flags, 0644);
+    if(fd < 0 && (errno == EMFILE || errno == ENFILE) && !_lru.empty()) {
+      // Other threads hold descriptors too; make do with fewer
+      _max_open = std::max<size_t>(1, _lru.size() - 1);
+      continue;
+    }
+    if(fd < 0) return -1;
+    _fds[bucket] = fd;
+    _created[bucket] = 1;
+    _lru.push_front(bucket);
+    _lru_pos[bucket] = _lru.begin();
+    return fd;
+  }
+}
+
+void BucketWriter::close_file(size_t bucket) {
+  ::close(_fds[bucket]);
+  _fds[bucket] = -1;
+  _lru.erase(_lru_pos[bucket]);
+}
+
+bool BucketWriter::write_chunk(const Chunk& chunk) {
+  int fd = file(chunk.bucket);
+  if(fd < 0) return false;
+  bool ok = true;
+  // Only the last chunk of a bucket can be shorter than a buffer
+  if(_direct && chunk.length % TMP_FILE_ALIGN != 0) {
+    int flags = fcntl(fd, F_GETFL);
+    ok = (flags >= 0 && ((flags & BUCKET_O_DIRECT) == 0 || fcntl(fd, F_SETFL, flags & ~BUCKET_O_DIRECT) == 0));
+  }
+  for(size_t done = 0; ok && done < chunk.length; ) {
+    ssize_t count = ::write(fd, chunk.data + done, chunk.length - done);
+    if(count < 0 && errno == EINTR) continue;
+    ok = (count > 0);
+    if(ok) done += count;
+  }
+  if(chunk.last) {
+    ok = (::close(fd) == 0) && ok;
+    _fds[chunk.bucket] = -1;
+    _lru.erase(_lru_pos[chunk.bucket]);
+  }
+  return ok;
+}
+
+void BucketWriter::writer_main(void* vp) {
+  BucketWriter& w = *(BucketWriter*)vp;
+  tthread::lock_guard<tthread::mutex> lock(w._mutex);
+  while(true) {
+    while(w._queue.empty() && !w._stop) w._cond.wait(w._mutex);
+    if(w._queue.empty()) break;
+    Chunk chunk = w._queue.front();
+    w._queue.pop_front();
+    w._mutex.unlock();
+    bool ok = w.write_chunk(chunk);
+    w._mutex.lock();
+    if(!ok && w._error.empty()) w._error = "cannot write " + w._fname(chunk.bucket);
+    if(chunk.data != nullptr) w._free.push_back(chunk.data);
+    w._queued_bytes -= w._buffer_size;
+    w._pending[chunk.bucket]--;
+    w._cond.notify_all();
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BUCKET_WRITER_H_
+#define BUCKET_WRITER_H_
+
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+#include "tinythread.h"
+
+/**
+ * Writer of the many temporary files that a pass routes records into, one per
+ * bucket.  Each bucket fills a buffer of its own, and full buffers are handed
+ * to a writer thread that appends them to the bucket's file while the callers
+ * go on; the buffers of all buckets, filling or waiting to be written, take
+ * at most budget bytes, and writing waits for the writer thread beyond that.
+ * Buffers are TMP_FILE_ALIGN bytes at least, so more than budget / 2 /
+ * TMP_FILE_ALIGN buckets take a buffer of that size each instead, smaller
+ * buffers meaning smaller writes.
+ * The writer keeps at most a file per bucket open, and no more than half of
+ * the descriptors that ulimit -n allows: it closes the file it wrote least
+ * recently to open another, and reopens it to append when needed.
+ */
+class BucketWriter {
+public:
+  /// fname names the file of each bucket; with direct, files are written
+  ///    with O_DIRECT where the file system supports it
+  BucketWriter(size_t num_buckets, const std::function<std::string(size_t)>& fname, size_t budget, bool direct);
+  ~BucketWriter();
+
+  /// Append to a bucket.  Writes to the same bucket must not overlap, but
+  ///    different buckets can be written by different threads.
+  void write(size_t bucket, const void* data, size_t length);
+  /// Write out the rest of a bucket and close its file, which is complete
+  ///    once this returns; throw if any write failed
+  void close(size_t bucket);
+  /// Close the buckets that are still open
+  void close();
+
+private:
+  struct Chunk {
+    size_t bucket;
+    char*  data;   // nullptr for an empty last chunk
+    size_t length;
+    bool   last;
+  };
+
+  char* take_buffer();
+  void submit(size_t bucket, bool last);
+  int file(size_t bucket);
+  void close_file(size_t bucket);
+  bool write_chunk(const Chunk& chunk);
+  static void writer_main(void* vp);
+
+private:
+  std::function<std::string(size_t)> _fname;
+  size_t                              _buffer_size;
+  size_t                              _max_queued;  // bytes of the chunks waiting for the writer
+  size_t                              _max_open;
+  bool                                _direct;
+
+  // Buffer being filled by each bucket, which its callers own
+  std::vector<char*>                  _buffers;
+  std::vector<size_t>                 _lengths;
+  std::vector<char>                   _closed;
+
+  // Shared with the writer thread, under _mutex
+  std::deque<Chunk>                   _queue;
+  size_t                              _queued_bytes;
+  std::vector<size_t>                 _pending;     // chunks of each bucket not yet written
+  std::vector<char*>                  _free;        // written buffers, to be reused
+  std::string                         _error;
+  bool                                _stop;
+  tthread::mutex                      _mutex;
+  tthread::condition_variable         _cond;
+
+  // Owned by the writer thread
+  std::vector<int>                    _fds;
+  std::vector<char>                   _created;
+  std::list<size_t>                   _lru;         // buckets with an open file, most recent first
+  std::vector<std::list<size_t>::iterator> _lru_pos;
+  tthread::thread*                    _thread;
+
+  BucketWriter(const BucketWriter&);
+  BucketWriter& operator=(const BucketWriter&);
+};
+
+#endif /* BUCKET_WRITER_H_ */
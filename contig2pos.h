@@ -0,0 +1,113 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTIG2POS_H_
+#define CONTIG2POS_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Contig to position table, looked up for every SAM line: a flat open
+//    addressing hash table of contig names, with callers keeping the slot of
+//    their last contig, as consecutive lines usually share it
+class Contig2Pos {
+public:
+  Contig2Pos() : _slots(16, nullptr) { }
+
+  void add(const char* str, size_t pos) {
+    size_t len = strlen(str);
+    assert(find_slot(str, len) == _slots.size());
+    _entries.push_back(Entry());
+    _entries.back().name.assign(str, len);
+    _entries.back().pos = pos;
+    if(_entries.size() * 2 > _slots.size()) {
+      rehash(_slots.size() * 2);
+    } else {
+      insert(&_entries.back());
+    }
+  }
+
+  /// Position of the contig named by the len bytes at str; last holds the
+  ///    caller's last hit and is tried first
+  size_t find(const char* str, size_t len, size_t& last) const {
+    if(last < _slots.size() && _slots[last] != nullptr && _slots[last]->matches(str, len)) return _slots[last]->pos;
+    last = find_slot(str, len);
+    if(last == _slots.size()) throw std::runtime_error("unknown reference " + std::string(str, len));
+    return _slots[last]->pos;
+  }
+
+  size_t operator[](const char* str) const {
+    size_t last = _slots.size();
+    return find(str, strlen(str), last);
+  }
+
+private:
+  struct Entry {
+    std::string name;
+    size_t      pos;
+
+    bool matches(const char* str, size_t len) const {
+      return name.length() == len && memcmp(name.data(), str, len) == 0;
+    }
+  };
+
+  // FNV-1a
+  static size_t hash(const char* str, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++) {
+      h = (h ^ (unsigned char)str[i]) * 1099511628211ULL;
+    }
+    return (size_t)h;
+  }
+
+  // Return the slot of the contig, or _slots.size() if there is none
+  size_t find_slot(const char* str, size_t len) const {
+    size_t mask = _slots.size() - 1;
+    for(size_t i = hash(str, len) & mask; _slots[i] != nullptr; i = (i + 1) & mask) {
+      if(_slots[i]->matches(str, len)) return i;
+    }
+    return _slots.size();
+  }
+
+  void insert(const Entry* entry) {
+    size_t mask = _slots.size() - 1;
+    size_t i = hash(entry->name.data(), entry->name.length()) & mask;
+    while(_slots[i] != nullptr) i = (i + 1) & mask;
+    _slots[i] = entry;
+  }
+
+  void rehash(size_t num_slots) {
+    _slots.assign(num_slots, nullptr);
+    for(auto itr = _entries.begin(); itr != _entries.end(); itr++) {
+      insert(&*itr);
+    }
+  }
+
+private:
+  std::deque<Entry>         _entries; // stable addresses for _slots
+  std::vector<const Entry*> _slots;
+};
+
+#endif /* CONTIG2POS_H_ */
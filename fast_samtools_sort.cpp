@@ -19,6 +19,7 @@
 
 #include <iostream>
 #include <string.h>
+#include <errno.h>
 #include <iomanip>
 #include <stdexcept>
 #include <fstream>
@@ -30,7 +31,32 @@
 #include <algorithm>
 #include <memory>
 #include <chrono>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "tinythread.h"
+#include "bgzf.h"
+#include "bam_index.h"
+#include "block_sort.h"
+#include "sort_key.h"
+#include "range_partition.h"
+#include "contig2pos.h"
+#include "sam_scan.h"
+#include "arena.h"
+#include "tmp_file.h"
+#include "bucket_writer.h"
+#include "markdup.h"
+#include "stats.h"
 
 // Program options
 static std::string opt_infname = "";
@@ -42,25 +68,91 @@ static std::string opt_outfname = "";
 static bool opt_verbose = false;
 static bool opt_sambamba = false;
 static bool opt_sam = false; // CB Edit SAM
+static bool opt_samtools_view = false; // decode BAM through "samtools view" instead of natively
+static bool opt_single_pass = false; // bucket BAM input in one pass, by splitters sampled from the sort keys
+static bool opt_use_index = true; // plan blocks from a .bai/.csi index of the input when there is one
+static int opt_tmp_compression = -1; // zlib level of native temporary blocks; -1 leaves them uncompressed
+static size_t opt_table_interval = 1 << 10; // granularity of the position histogram (table) in bp
+static bool opt_pin_threads = false; // pin workers to CPUs, spread over the NUMA nodes
+static std::string opt_stats_json = ""; // file to write the counters of the run into
+static SortSpec opt_sort = { SORT_COORDINATE, {0, 0}, false }; // -n and -t TAG
+static bool opt_write_index = false; // index the output as it is written, into out_fname.bai or .csi
+static std::vector<std::string> opt_tmpdirs; // directories of the temporary files; next to a named input by default
+static bool opt_tmpdir_by_space = false; // spread temporary files over the directories by their free space
+static bool opt_direct_io = false; // write temporary blocks with O_DIRECT
+static bool opt_markdup = false; // mark duplicates in the sorted blocks before they are compressed
+
+// Temporary files are named after one prefix per directory, followed by their
+//    kind and number; the number picks the directory from tmp_slots, an
+//    interleaving of the directories in proportion to their weights
+static std::vector<std::string> tmp_prefixes;
+static std::vector<size_t> tmp_slots;
+
+static inline std::string tmp_fname(const std::string& kind, size_t n) {
+	return tmp_prefixes[tmp_slots[n % tmp_slots.size()]] + kind + std::to_string(n);
+}
+
+// Rename a temporary file, copying it over when the two names are on
+//    different file systems
+static void tmp_rename(const std::string& from, const std::string& to) {
+	if(rename(from.c_str(), to.c_str()) == 0) return;
+	if(errno != EXDEV) throw std::runtime_error("cannot rename " + from + " to " + to);
+	{
+		std::ifstream in(from, std::ios::binary);
+		std::ofstream out(to, std::ios::binary);
+		if(in && in.peek() != EOF) out << in.rdbuf();
+		out.close();
+		if(!in || out.fail()) throw std::runtime_error("cannot copy " + from + " to " + to);
+	}
+	std::remove(from.c_str());
+}
+
+// The output and its index are written under this name and renamed once
+//    complete, so a failed sort leaves an earlier file of the name as it was
+static inline std::string part_fname(const std::string& fname) {
+	return fname + ".part." + std::to_string(getpid());
+}
+
+// Remove the temporary files left by a failed sort: every file in the
+//    directories of the prefixes that is named after one of them
+static void remove_tmp_files() {
+	for(size_t i = 0; i < tmp_prefixes.size(); i++) {
+		size_t slash = tmp_prefixes[i].rfind('/');
+		std::string dir = (slash == std::string::npos ? "." : tmp_prefixes[i].substr(0, slash + 1));
+		std::string base = (slash == std::string::npos ? tmp_prefixes[i] : tmp_prefixes[i].substr(slash + 1));
+		DIR* d = opendir(dir.c_str());
+		if(d == nullptr) continue;
+		while(struct dirent* entry = readdir(d)) {
+			if(strncmp(entry->d_name, base.c_str(), base.size()) == 0 && strlen(entry->d_name) > base.size()) {
+				remove(((slash == std::string::npos ? "" : dir) + entry->d_name).c_str());
+			}
+		}
+		closedir(d);
+	}
+}
+
+static RunStats run_stats;
 
 /**
  * Use std::chrono to keep track of elapsed time between creation and
  * destruction. If verbose is true, Timer will print a message showing
- * elapsed time to the given output stream upon destruction.
+ * elapsed time to the given output stream upon destruction; if total is
+ * given, the elapsed seconds are added to it.
  */
 class Timer {
 public:
-  Timer(std::ostream& out = std::cerr, const std::string& msg = "", bool verbose = true) :
-    _t(std::chrono::system_clock::now()), _out(out), _msg(msg), _verbose(verbose) { }
+  Timer(std::ostream& out = std::cerr, const std::string& msg = "", bool verbose = true, double* total = nullptr) :
+    _t(std::chrono::system_clock::now()), _out(out), _msg(msg), _verbose(verbose), _total(total) { }
   
   /// Optionally print message
   ~Timer() {
     if(_verbose) write(_out);
+    if(_total != nullptr) *_total += elapsed() / 1000.0;
   }
   
   /// Return elapsed time since Timer object was created
   double elapsed() const {
-    double milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - _t).count();
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::system_clock::now() - _t).count();
     return milliseconds;
   }
   
@@ -83,343 +175,2599 @@ private:
   std::ostream&  _out;
   std::string    _msg;
   bool           _verbose;
-};
-
-struct SamRecord {
-  size_t read_id;
-  size_t pos;
-  char* line;
+  double*        _total;
 };
 
 struct fileLines {
 	size_t numLines = 0;
+	size_t numBytes = 0; // records as loaded into a worker's arena
 	bool bypass = 0;
+	// Aligned blocks hold the records with positions in [begin, end).  Blocks
+	//    planned from a BAM index are read straight from the input, starting
+	//    at virtual offset voffset.
+	bool region = 0;
+	uint64_t voffset = 0;
+	size_t begin = 0, end = 0;
+	// Copy blocks are a run of unmapped records at the end of the input that
+	//    is passed through as it is, from virtual offset voffset up to the
+	//    BGZF block at file offset end.  They hold about copyLines records,
+	//    which are not loaded, and exactly as many as the run in total.
+	bool copy = 0;
+	size_t copyLines = 0;
+};
+
+struct table_records {
+	size_t num_lines;
+	size_t num_char;
 };
 
-struct table_records {
-	size_t num_lines;
-	size_t num_char;
-};
+// Besides its records, sorting a block takes the record index, the radix
+//    sort's scratch copies of it and of its keys, and the compressed output.
+//    Key orders take prefix keys and their merge copies instead of the radix
+//    keys, and a sorted copy of the index.  --markdup adds the duplicate
+//    keys of the records.
+static size_t record_overhead = 2 * sizeof(SamRecord) + 2 * sizeof(uint64_t);
+static const size_t keyed_record_overhead = 2 * sizeof(SamRecord) + 2 * sizeof(KeyedRecord);
+// Blocks are not made smaller than this to spread them over the threads
+static const size_t min_block_footprint = size_t(1) << 20;
+
+// Estimated peak memory of sorting a block of lines records taking bytes
+static inline size_t block_footprint(size_t bytes, size_t lines) {
+	return bytes + bytes / (opt_compression == 0 ? 1 : 4) + lines * record_overhead;
+}
+
+static tthread::mutex thread_mutex;
+
+/**
+ * Memory shared by the blocks being sorted.  A worker takes a block's share
+ * before loading it and gives it back once the block is written, so that the
+ * resident blocks never add up to more than the budget.  A block larger than
+ * the whole budget waits until it can have all of it.
+ */
+class MemoryBudget {
+public:
+  MemoryBudget(size_t total) : _total(total), _used(0) { }
+
+  /// Wait for size bytes, or the whole budget if size exceeds it; return the
+  ///    amount taken
+  size_t acquire(size_t size) {
+    size = std::min(size, _total);
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    while(_used + size > _total) _cond.wait(_mutex);
+    _used += size;
+    return size;
+  }
+
+  /// Take size bytes if they are free right away
+  bool try_acquire(size_t size) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    if(_used + size > _total) return false;
+    _used += size;
+    return true;
+  }
+
+  void release(size_t size) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _used -= size;
+    _cond.notify_all();
+  }
+
+private:
+  size_t                      _total;
+  size_t                      _used;
+  tthread::mutex              _mutex;
+  tthread::condition_variable _cond;
+};
+
+/**
+ * Share of a MemoryBudget, taken on construction and given back by release(),
+ * or on destruction if a block fails before it is done with it.
+ */
+class BudgetShare {
+public:
+  BudgetShare(MemoryBudget& budget, size_t size) : _budget(budget), _size(budget.acquire(size)) { }
+  ~BudgetShare() { release(); }
+
+  void release() {
+    if(_size > 0) _budget.release(_size);
+    _size = 0;
+  }
+
+private:
+  MemoryBudget& _budget;
+  size_t        _size;
+
+  BudgetShare(const BudgetShare&);
+  BudgetShare& operator=(const BudgetShare&);
+};
+
+/**
+ * Independent tasks of one block, such as compressing chunks of its sorted
+ * records, that idle workers can help with.  Tasks are claimed with an atomic
+ * counter, so the owner and its helpers never wait on each other; helpers
+ * first take task_memory from the budget, and leave the tasks to the owner
+ * when it is not free.
+ */
+class TaskJob {
+public:
+  TaskJob(size_t num_tasks, size_t task_memory, const std::function<void(size_t)>& run) :
+    _num_tasks(num_tasks), _task_memory(task_memory), _run(run), _next(0), _done(0), _helpers(0) { }
+
+  bool exhausted() const { return _next.load() >= _num_tasks; }
+
+  /// Run tasks until none is left to claim; helpers pass the memory budget.
+  ///    Return true if any task was run.
+  bool help(MemoryBudget* memory) {
+    bool ran = false;
+    while(true) {
+      size_t reserved = 0;
+      if(memory != nullptr && _task_memory > 0) {
+        if(!memory->try_acquire(_task_memory)) return ran;
+        reserved = _task_memory;
+      }
+      size_t task = _next.fetch_add(1);
+      if(task >= _num_tasks) {
+        if(reserved > 0) memory->release(reserved);
+        return ran;
+      }
+      try {
+        _run(task);
+      } catch(...) {
+        tthread::lock_guard<tthread::mutex> lock(_mutex);
+        if(!_error) _error = std::current_exception();
+      }
+      if(reserved > 0) memory->release(reserved);
+      ran = true;
+      if(_done.fetch_add(1) + 1 == _num_tasks) {
+        tthread::lock_guard<tthread::mutex> lock(_mutex);
+        _cond.notify_all();
+      }
+    }
+  }
+
+  /// Wait for the tasks claimed by helpers, and rethrow an error of any task
+  void wait() {
+    {
+      tthread::lock_guard<tthread::mutex> lock(_mutex);
+      while(_done.load() < _num_tasks) _cond.wait(_mutex);
+    }
+    if(_error) std::rethrow_exception(_error);
+  }
+
+private:
+  friend class BlockQueue;
+
+  size_t                      _num_tasks;
+  size_t                      _task_memory;
+  std::function<void(size_t)> _run;
+  std::atomic<size_t>         _next;
+  std::atomic<size_t>         _done;
+  size_t                      _helpers; // workers inside help(), guarded by the queue
+  std::exception_ptr          _error;
+  tthread::mutex              _mutex;
+  tthread::condition_variable _cond;
+};
+
+/**
+ * Blocks that are ready to be sorted.  Blocks can be announced while the input
+ * is still being split, as soon as their files are complete.  The largest
+ * ready block is handed out first, among the blocks within a window after the
+ * lowest one not handed out yet, so that the ordered output does not have to
+ * hold on to most of the sorted blocks.  Workers without a block help with the
+ * jobs of the others until every block is finished, or until the queue is
+ * stopped, as it is by the first worker that fails.
+ */
+class BlockQueue {
+public:
+  BlockQueue() : _num_block(0), _lowest(0), _finished(0), _window(1), _idle(0), _stopped(false) { }
+
+  /// sizes gives the footprint of each block
+  void open(const std::vector<size_t>& sizes, size_t window) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _num_block = sizes.size();
+    _sizes = sizes;
+    _popped.assign(_num_block, false);
+    _window = std::max<size_t>(1, window);
+    _cond.notify_all();
+  }
+
+  void push(size_t block) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _ready.insert(block);
+    _cond.notify_one();
+  }
+
+  /// Return the next block to sort, waiting for one and helping with jobs
+  ///    meanwhile, or num_block once all blocks are finished
+  size_t pop(MemoryBudget* memory) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _idle++;
+    while(true) {
+      if(_stopped) {
+        _idle--;
+        return _num_block;
+      }
+      bool helped = false;
+      for(size_t i = 0; i < _jobs.size() && !helped; i++) {
+        TaskJob* job = _jobs[i];
+        if(job->exhausted()) continue;
+        job->_helpers++;
+        _mutex.unlock();
+        helped = job->help(memory);
+        _mutex.lock();
+        if(--job->_helpers == 0) _cond.notify_all();
+      }
+      if(helped) continue;
+      if(!_ready.empty()) {
+        std::set<size_t>::iterator best = _ready.begin();
+        if(*best < _lowest + _window) {
+          for(std::set<size_t>::iterator itr = best; itr != _ready.end() && *itr < _lowest + _window; itr++) {
+            if(_sizes[*itr] > _sizes[*best]) best = itr;
+          }
+        }
+        size_t block = *best;
+        _ready.erase(best);
+        _popped[block] = true;
+        while(_lowest < _num_block && _popped[_lowest]) _lowest++;
+        _idle--;
+        return block;
+      }
+      if(_finished == _num_block) {
+        _idle--;
+        return _num_block;
+      }
+      _cond.wait(_mutex);
+    }
+  }
+
+  /// Return true if a block is ready to be handed out
+  bool has_ready() {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    return !_ready.empty();
+  }
+
+  /// Number of workers without a block, which can help with a job
+  size_t idle() {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    return _idle;
+  }
+
+  /// A worker is done with a block
+  void finish() {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _finished++;
+    if(_finished == _num_block) _cond.notify_all(); // release the idle workers
+  }
+
+  /// Let idle workers help with job, until retire returns
+  void post(TaskJob* job) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _jobs.push_back(job);
+    _cond.notify_all();
+  }
+
+  void retire(TaskJob* job) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    _jobs.erase(std::find(_jobs.begin(), _jobs.end(), job));
+    while(job->_helpers > 0) _cond.wait(_mutex);
+  }
+
+  /// Hand out no more blocks, keeping the first error given if any
+  void stop(std::exception_ptr error = std::exception_ptr()) {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    if(!_error) _error = error;
+    _stopped = true;
+    _cond.notify_all();
+  }
+
+  std::exception_ptr error() {
+    tthread::lock_guard<tthread::mutex> lock(_mutex);
+    return _error;
+  }
+
+private:
+  std::set<size_t>            _ready;
+  std::vector<size_t>         _sizes;
+  std::vector<bool>           _popped;
+  std::vector<TaskJob*>       _jobs;
+  size_t                      _num_block;
+  size_t                      _lowest;   // lowest block not handed out yet
+  size_t                      _finished;
+  size_t                      _window;
+  size_t                      _idle;     // workers inside pop()
+  bool                        _stopped;
+  std::exception_ptr          _error;
+  tthread::mutex              _mutex;
+  tthread::condition_variable _cond;
+};
+
+// With --write-index, the index of a block's part of the output, with offsets
+//    relative to the start of the part, and the compressed size of the part
+struct PartIndex {
+  PartIndex(int depth) : index(depth), size(0) { }
+
+  BamIndexBuilder index;
+  uint64_t size;
+};
+
+struct ThreadParam {
+  std::string fname_base;
+  BlockQueue* queue;
+  MemoryBudget* memory;
+  size_t num_block;
+  Contig2Pos* contig2pos;
+  std::vector<std::string>* headers;
+  std::vector<fileLines>* file_lines;
+  BamHeader* bam_header;           // nullptr unless the input is decoded natively
+  std::vector<size_t>* ref_offsets; // refID to linear genome position
+  BgzfOrderedWriter* output;        // takes block i as part i + 1, after the header
+  std::vector<PartIndex>* part_indexes; // index of each block's part, or nullptr
+  const DupMarker* markdup;         // nullptr unless duplicates are marked
+  const DupZones* dup_zones;        // sets that may cross the boundaries of blocks
+
+  size_t thread_id;
+  size_t num_threads;
+  int cpu;                          // CPU the worker is pinned to, or -1
+};
+
+// CPUs of the NUMA nodes that this process may run on, taken from each node
+//    in turn, so that consecutive workers pinned to them spread over the
+//    sockets.  Empty if CPU affinity is not supported.
+static std::vector<int> worker_cpus() {
+	std::vector<int> cpus;
+#ifdef __linux__
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return cpus;
+	// Node CPU lists read "0-7,16-23"
+	std::vector<std::vector<int> > nodes;
+	if(DIR* dir = opendir("/sys/devices/system/node")) {
+		while(struct dirent* entry = readdir(dir)) {
+			if(strncmp(entry->d_name, "node", 4) != 0 || !isdigit(entry->d_name[4])) continue;
+			std::ifstream f(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+			std::string list;
+			if(!std::getline(f, list)) continue;
+			nodes.push_back(std::vector<int>());
+			for(const char* p = list.c_str(); isdigit(*p); ) {
+				char* end = nullptr;
+				int first = (int)strtol(p, &end, 10), last = first;
+				if(*end == '-') last = (int)strtol(end + 1, &end, 10);
+				for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+					if(CPU_ISSET(cpu, &allowed)) nodes.back().push_back(cpu);
+				}
+				p = (*end == ',' ? end + 1 : end);
+			}
+		}
+		closedir(dir);
+	}
+	if(nodes.empty()) {
+		nodes.push_back(std::vector<int>());
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu, &allowed)) nodes.back().push_back(cpu);
+		}
+	}
+	size_t node_cpus = 0;
+	for(size_t n = 0; n < nodes.size(); n++) {
+		node_cpus = std::max(node_cpus, nodes[n].size());
+	}
+	for(size_t i = 0; i < node_cpus; i++) {
+		for(size_t n = 0; n < nodes.size(); n++) {
+			if(i < nodes[n].size()) cpus.push_back(nodes[n][i]);
+		}
+	}
+#endif
+	return cpus;
+}
+
+// Pin the calling thread to cpu
+static bool pin_thread(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+// Sort a block's records, on as many threads as there are idle workers
+//    besides this one
+static void sortRecords(const ThreadParam& threadParam, std::vector<SamRecord>& samRecords) {
+	size_t num_chunks = 1;
+	if(samRecords.size() >= parallel_sort_min) num_chunks += threadParam.queue->idle();
+	TaskRunner run = [&threadParam](size_t num_tasks, const std::function<void(size_t)>& task) {
+		TaskJob job(num_tasks, 0, task);
+		threadParam.queue->post(&job);
+		job.help(nullptr);
+		threadParam.queue->retire(&job);
+		job.wait();
+	};
+	if(opt_sort.order != SORT_COORDINATE) {
+		block_sort_by_key(samRecords, opt_sort, run, num_chunks);
+	} else {
+		block_sort(samRecords, run, num_chunks);
+	}
+}
+
+// Allocate the position histogram once all contig lengths are known
+static void table_init(std::vector<table_records>& table, size_t& table_size, size_t size_sofar) {
+	table_size = (size_sofar + opt_table_interval - 1) / opt_table_interval + 1;
+	table.resize(table_size);
+	table.reserve(table_size + 10); // Added 10 here to keep from reallocating memory if the table grows due to unaligned reads
+	for(size_t i = 0; i < table.size(); i++) {
+		table[i].num_char = 0;
+		table[i].num_lines = 0;
+	}
+}
+
+// Pass 1: account for a record of the given size; unaligned records fill
+//    bypass entries appended after the last interval
+static inline void table_count(std::vector<table_records>& table, bool unaligned, size_t pos, size_t size) {
+	if(unaligned) {
+		if(block_footprint(table[table.size() - 1].num_char + size, 0) > opt_memory_per_thread) {
+			table_records tbl;
+			tbl.num_char = 0;
+			tbl.num_lines = 0;
+			table.push_back(tbl);
+		}
+		table[table.size() - 1].num_char += size;
+		table[table.size() - 1].num_lines++;
+	} else {
+		table[pos / opt_table_interval].num_char += size;
+		table[pos / opt_table_interval].num_lines++;
+	}
+}
+
+// Pass 2: return the block a record belongs to; after planning, num_char of
+//    an interval holds its block number
+static inline size_t table_block(std::vector<table_records>& table,
+	size_t table_size,
+	size_t aligned_file_num,
+	size_t& unalign_itr,
+	bool unaligned,
+	size_t pos) {
+	if(unaligned) {
+		if(table[table_size - 1 + unalign_itr].num_lines == 0) {
+			unalign_itr++;
+		}
+		table[table_size - 1 + unalign_itr].num_lines--;
+		return aligned_file_num + unalign_itr;
+	}
+	return table[pos / opt_table_interval].num_char;
+}
+
+// Pack the intervals [begin, end) of the histogram into blocks whose sorting
+//    footprint fits in opt_memory_per_thread, replacing each interval's
+//    num_char by the number of the block it goes to.  Blocks are balanced: the
+//    intervals are spread evenly over as many blocks as the budget needs, and
+//    over one block per thread when there is enough to share.
+static void table_plan(std::vector<table_records>& table, size_t begin, size_t end, std::vector<fileLines>& blocks) {
+	size_t total = 0;
+	for(size_t itr = begin; itr < end; itr++) {
+		total += block_footprint(table[itr].num_char, table[itr].num_lines);
+	}
+	size_t num_blocks = std::max(total / opt_memory_per_thread + 1, std::min(opt_threads, total / min_block_footprint));
+	size_t target = total / num_blocks + 1;
+
+	fileLines block;
+	size_t block_size = 0;
+	for(size_t itr = begin; itr < end; itr++) {
+		size_t size = block_footprint(table[itr].num_char, table[itr].num_lines);
+		if(block_size > 0 && (block_size >= target || block_size + size > opt_memory_per_thread)) {
+			blocks.push_back(block);
+			block = fileLines();
+			block_size = 0;
+		}
+		if(block_size == 0) block.begin = itr * opt_table_interval;
+		block.end = (itr + 1) * opt_table_interval;
+		block_size += size;
+		block.numLines += table[itr].num_lines;
+		block.numBytes += table[itr].num_char;
+		table[itr].num_char = blocks.size();
+	}
+	blocks.push_back(block);
+}
+
+// Records in a key sample, which stays small next to the memory budget
+static const size_t key_sample_max = size_t(1) << 16;
+
+static inline size_t key_sample_size() {
+	return std::min(key_sample_max, std::max<size_t>(1, opt_memory / 4 / 128));
+}
+
+// CB todo clean code
+
+void fieldSplitter(int &pass,
+	std::vector<table_records> *table,
+	size_t *table_size,
+	std::vector<std::string> &headers,
+	Contig2Pos &contig2pos,
+	std::string &cmd,
+	size_t *aligned_file_num,
+	BucketWriter* vec_pipes = nullptr){
+
+	size_t size_sofar = 0;
+	size_t unalign_itr = 0;
+	size_t last_contig = std::numeric_limits<size_t>::max();
+
+	std::shared_ptr<FILE> pipe(popen(cmd.c_str(), "r"), pclose);
+	if(!pipe) throw std::runtime_error("popen() failed!");
+	SamLineReader reader(pipe.get());
+	const char* line;
+	size_t length;
+	while((line = reader.next(length)) != nullptr) {
+		// Is the current line header?
+		bool header = (line[0] == '@');
+		if(header && pass == 2) continue;
+		if(!header) {
+			if(pass == 1 && table->size() == 0) {
+				table_init(*table, *table_size, size_sofar);
+			}
+			// RNAME and POS follow the 2nd and 3rd tabs
+			const char* tabs[SAM_SCAN_TABS];
+			if(sam_scan_line(line, line + length, tabs, length) < SAM_SCAN_TABS) continue;
+			const char* contig_name = tabs[1] + 1;
+			bool unaligned = (contig_name[0] == '*');
+			size_t pos = unaligned ? 0 : contig2pos.find(contig_name, tabs[2] - contig_name, last_contig) + sam_parse_pos(tabs[2] + 1);
+			// The line takes its length in its block, and a newline if it
+			//    has none, as pass 2 writes it
+			if(pass == 1) {
+				table_count(*table, unaligned, pos, length + (line[length - 1] != '\n'));
+			} else {
+				size_t block = table_block(*table, *table_size, *aligned_file_num, unalign_itr, unaligned, pos);
+				vec_pipes->write(block, line, length);
+				if(line[length - 1] != '\n') vec_pipes->write(block, "\n", 1);
+			}
+			continue;
+		}
+
+		// Header lines are few; split a copy of them into fields
+		headers.push_back(std::string(line, length));
+		std::string buffer = headers.back();
+		// Is the current line sequence info?
+		bool sequence = false;
+		int field_num = 0;
+		char* pch_next = nullptr;
+		char* pch = strtok_r(&buffer[0], "\t", &pch_next);
+		char* contig_name = nullptr;
+		while(pch != nullptr) {
+			if(field_num == 0) {
+				sequence = (strcmp(pch, "@SQ") == 0);
+			}
+			if(sequence) {
+				if(field_num == 1) { // e.g. SN:14
+					if(strlen(pch) <= 3) {
+						throw std::runtime_error("");
+					}
+					contig_name = pch + 3;
+					contig2pos.add(contig_name, size_sofar);
+				} else if(field_num == 2) { // e.g. LN:107043718
+					if(strlen(pch) <= 3) {
+						throw std::runtime_error("");
+					}
+					char* end;
+					size_t contig_len = strtol(pch + 3, &end, 10);
+					size_sofar += contig_len;
+					break;
+				}
+			}
+			pch = strtok_r(pch_next, "\t", &pch_next);
+			field_num++;
+		}
+	}
+	// Input without alignments still needs a table
+	if(pass == 1 && table->size() == 0) {
+		table_init(*table, *table_size, size_sofar);
+	}
+};
+
+// Read a whole block file into the arena with as few reads as the kernel
+//    allows; return its size
+static size_t load_block_file(const std::string& fname, char* arena, size_t capacity) {
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) throw std::runtime_error("cannot open " + fname);
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size > capacity) {
+		close(fd);
+		throw std::runtime_error(fname + " does not fit in the memory of a thread");
+	}
+	size_t length = 0;
+	while(length < (size_t)st.st_size) {
+		ssize_t count = pread(fd, arena + length, st.st_size - length, length);
+		if(count <= 0) {
+			close(fd);
+			throw std::runtime_error("cannot read " + fname);
+		}
+		length += count;
+	}
+	close(fd);
+	return length;
+}
+
+// Length of a text record up to and including its newline
+static inline size_t text_line_length(const char* line) {
+	const char* end = line;
+	while(*end != '\n') end++;
+	return end - line + 1;
+}
+
+// Counterpart of bamBlockLoad for SAM text blocks: lines are indexed where
+//    they were loaded, and keep their newline as terminator
+static void textBlockLoad(const std::string& fname,
+	Contig2Pos& contig2pos,
+	std::vector<SamRecord>& samRecords,
+	char* sam,
+	size_t sam_size) {
+	size_t length = load_block_file(fname, sam, sam_size);
+	size_t last_contig = std::numeric_limits<size_t>::max();
+	for(char* line = sam; line < sam + length; ) {
+		// RNAME and POS follow the 2nd and 3rd tabs
+		const char* tabs[SAM_SCAN_TABS];
+		size_t line_length;
+		if(sam_scan_line(line, sam + length, tabs, line_length) < SAM_SCAN_TABS || line[line_length - 1] != '\n') {
+			throw std::runtime_error("invalid SAM record in " + fname);
+		}
+		const char* contig_name = tabs[1] + 1;
+		SamRecord samRecord;
+		samRecord.read_id = samRecords.size();
+		if(contig_name[0] == '*') {
+			samRecord.pos = std::numeric_limits<size_t>::max();
+		} else {
+			samRecord.pos = contig2pos.find(contig_name, tabs[2] - contig_name, last_contig) + sam_parse_pos(tabs[2] + 1);
+		}
+		samRecord.line = line;
+		samRecords.push_back(samRecord);
+		line += line_length;
+	}
+}
+
+// Linear genome position of an aligned BAM record, 1-based like SAM's POS
+static inline size_t bam_linear_pos(const char* rec, const std::vector<size_t>& ref_offsets) {
+	return ref_offsets[bam_refid(rec)] + bam_pos(rec) + 1;
+}
+
+// Offsets of the references on the linear genome; return the genome length
+static size_t bam_ref_offsets(const BamHeader& header, std::vector<size_t>& ref_offsets) {
+	size_t size_sofar = 0;
+	ref_offsets.resize(header.ref_lens.size());
+	for(size_t i = 0; i < header.ref_lens.size(); i++) {
+		ref_offsets[i] = size_sofar;
+		size_sofar += header.ref_lens[i];
+	}
+	return size_sofar;
+}
+
+// Native block files hold each raw BAM record, which carries its own length
+//    and sort key (refID, pos), behind its 64-bit ordinal in the input; the
+//    ordinal keeps the sort stable when several readers fill a block.  With
+//    --tmp-compression, block files are BGZF compressed, as fast compression
+//    shrinks temporary disk traffic at little CPU cost.
+
+// Bytes a record takes in a native block file, and in the arena once loaded
+static inline size_t block_record_size(const char* rec) {
+	return sizeof(uint64_t) + bam_rec_size(rec);
+}
+
+// Write buffer of each of num_writers block files open at once: they share a
+//    sixteenth of the memory budget, within bounds
+static const size_t tmp_buffer_min = size_t(64) << 10;
+static const size_t tmp_buffer_max = size_t(4) << 20;
+
+static inline size_t tmp_buffer_size(size_t num_writers) {
+	return std::min(tmp_buffer_max, std::max(tmp_buffer_min, opt_memory / 16 / std::max<size_t>(1, num_writers)));
+}
+
+class BlockFileWriter {
+public:
+	bool open(const std::string& fname, size_t buffer_size) {
+		if(opt_tmp_compression >= 0) {
+			_bgzf.reset(new BgzfWriter(opt_tmp_compression));
+			return _bgzf->open(fname);
+		}
+		return _out.open(fname, buffer_size, opt_direct_io);
+	}
+
+	void write(uint64_t ordinal, const char* rec) {
+		if(_bgzf) {
+			_bgzf->write(&ordinal, sizeof(ordinal));
+			_bgzf->write(rec, bam_rec_size(rec));
+		} else {
+			_out.write(&ordinal, sizeof(ordinal));
+			_out.write(rec, bam_rec_size(rec));
+		}
+	}
+
+	void close() {
+		if(_bgzf) {
+			_bgzf->close();
+			_bgzf.reset();
+		} else if(_out.is_open()) {
+			if(!_out.close()) throw std::runtime_error("failed to write a block file");
+		}
+	}
+
+private:
+	TmpFileWriter               _out;
+	std::unique_ptr<BgzfWriter> _bgzf;
+};
+
+// Staging buffer of each compressed block file being routed into: at most a
+//    BGZF block, and a share of half of the memory budget, whose other half
+//    goes to the write buffers
+static const size_t bgzf_stage_min = TMP_FILE_ALIGN;
+
+// The block files of a kind that a pass routes records into, numbered from 0,
+//    "" being that of the blocks the workers sort.  They all go through a
+//    BucketWriter, whose buffers share a sixteenth of the memory budget, with
+//    the staging buffers if any, and which holds few files open at once.  BGZF compressed ones
+//    (--tmp-compression) are staged by block and deflated into it a BGZF
+//    block at a time, with one of a few deflate streams shared by the
+//    writing threads.  Writes to the same block must not overlap.
+class BlockFileBuckets {
+public:
+	BlockFileBuckets(size_t num_blocks, const std::string& kind = "") :
+		BlockFileBuckets(num_blocks, [kind](size_t block) { return tmp_fname(kind, block); }, opt_memory / 16) { }
+
+	/// Files named by fname, whose buffers share budget bytes
+	BlockFileBuckets(size_t num_blocks, const std::function<std::string(size_t)>& fname, size_t budget) :
+		_out(num_blocks, fname, opt_tmp_compression >= 0 ? budget / 2 : budget, opt_direct_io),
+		_stage_size(0) {
+		if(opt_tmp_compression >= 0) {
+			_stages.resize(num_blocks);
+			_stage_size = std::min(BGZF_BLOCK_SIZE, std::max(bgzf_stage_min, budget / 2 / std::max<size_t>(1, num_blocks)));
+		}
+	}
+
+	void write(size_t block, uint64_t ordinal, const char* rec) {
+		if(_stages.empty()) {
+			_out.write(block, &ordinal, sizeof(ordinal));
+			_out.write(block, rec, bam_rec_size(rec));
+		} else {
+			stage(block, &ordinal, sizeof(ordinal));
+			stage(block, rec, bam_rec_size(rec));
+		}
+	}
+
+	/// Complete the file of a block, so that it can be sorted
+	void close(size_t block) {
+		if(!_stages.empty()) deflate(block);
+		_out.close(block);
+	}
+
+	void close() {
+		for(size_t i = 0; i < _stages.size(); i++) deflate(i);
+		_out.close();
+	}
+
+private:
+	struct Deflater {
+		Deflater() : zip(opt_tmp_compression) { }
+		BgzfWriter        zip;
+		std::vector<char> data;
+	};
+
+	void stage(size_t block, const void* data, size_t length) {
+		std::vector<char>& staged = _stages[block];
+		const char* p = (const char*)data;
+		while(length > 0) {
+			if(staged.capacity() < _stage_size) staged.reserve(_stage_size);
+			size_t count = std::min(length, _stage_size - staged.size());
+			staged.insert(staged.end(), p, p + count);
+			p += count;
+			length -= count;
+			if(staged.size() == _stage_size) deflate(block);
+		}
+	}
+
+	void deflate(size_t block) {
+		std::vector<char>& staged = _stages[block];
+		if(staged.empty()) return;
+		std::unique_ptr<Deflater> deflater;
+		{
+			tthread::lock_guard<tthread::mutex> lock(_mutex);
+			if(!_deflaters.empty()) {
+				deflater = std::move(_deflaters.back());
+				_deflaters.pop_back();
+			}
+		}
+		if(!deflater) deflater.reset(new Deflater());
+		deflater->data.clear();
+		deflater->zip.open(deflater->data);
+		deflater->zip.write(staged.data(), staged.size());
+		deflater->zip.close();
+		staged.clear();
+		_out.write(block, deflater->data.data(), deflater->data.size());
+		tthread::lock_guard<tthread::mutex> lock(_mutex);
+		_deflaters.push_back(std::move(deflater));
+	}
+
+private:
+	BucketWriter                           _out;
+	std::vector<std::vector<char> >        _stages;
+	size_t                                 _stage_size;
+	std::vector<std::unique_ptr<Deflater> > _deflaters; // idle, under _mutex
+	tthread::mutex                         _mutex;
+
+	BlockFileBuckets(const BlockFileBuckets&);
+	BlockFileBuckets& operator=(const BlockFileBuckets&);
+};
+
+class BlockFileReader {
+public:
+	bool open(const std::string& fname) {
+		if(opt_tmp_compression >= 0) return _bgzf.open(fname);
+		_fp.reset(fopen(fname.c_str(), "rb"), fclose);
+		return _fp != nullptr;
+	}
+
+	/// Read up to length bytes, return the number of bytes read
+	size_t read(void* data, size_t length) {
+		return _fp ? fread(data, 1, length, _fp.get()) : _bgzf.read(data, length);
+	}
+
+	/// Read the next record into rec
+	bool read_record(uint64_t& ordinal, std::vector<char>& rec) {
+		int32_t block_size;
+		size_t count = read(&ordinal, sizeof(ordinal));
+		if(count == 0) return false;
+		if(count != sizeof(ordinal) || read(&block_size, sizeof(block_size)) != sizeof(block_size)) {
+			throw std::runtime_error("truncated block file");
+		}
+		if(rec.size() < (size_t)block_size + 4) rec.resize((size_t)block_size + 4);
+		memcpy(rec.data(), &block_size, sizeof(block_size));
+		if(read(rec.data() + 4, block_size) != (size_t)block_size) {
+			throw std::runtime_error("truncated block file");
+		}
+		return true;
+	}
+
+private:
+	std::shared_ptr<FILE> _fp;
+	BgzfReader            _bgzf;
+};
+
+// Read a whole native block file into the arena; return its size
+static size_t load_native_block_file(const std::string& fname, char* arena, size_t capacity) {
+	if(opt_tmp_compression < 0) return load_block_file(fname, arena, capacity);
+	BlockFileReader in;
+	if(!in.open(fname)) throw std::runtime_error("cannot open " + fname);
+	size_t length = 0, count;
+	while(length < capacity && (count = in.read(arena + length, capacity - length)) > 0) {
+		length += count;
+	}
+	char extra;
+	if(length == capacity && in.read(&extra, 1) > 0) {
+		throw std::runtime_error(fname + " does not fit in the memory of a thread");
+	}
+	return length;
+}
+
+// Load a block file written by the planning passes into the arena at sam and
+//    index its records in place, after their ordinals
+static void bamBlockLoad(const std::string& fname,
+	const std::vector<size_t>& ref_offsets,
+	std::vector<SamRecord>& samRecords,
+	char* sam,
+	size_t sam_size) {
+	size_t length = load_native_block_file(fname, sam, sam_size);
+	for(size_t i = 0; i < length; ) {
+		if(i + sizeof(uint64_t) + 4 > length || i + block_record_size(sam + i + sizeof(uint64_t)) > length) {
+			throw std::runtime_error("truncated block file " + fname);
+		}
+		SamRecord samRecord;
+		memcpy(&samRecord.read_id, sam + i, sizeof(uint64_t));
+		samRecord.line = sam + i + sizeof(uint64_t);
+		if(bam_refid(samRecord.line) < 0) {
+			samRecord.pos = std::numeric_limits<size_t>::max();
+		} else {
+			samRecord.pos = bam_linear_pos(samRecord.line, ref_offsets);
+		}
+		i += block_record_size(samRecord.line);
+		samRecords.push_back(samRecord);
+	}
+}
+
+// One reader of the native planning passes.  A reader decodes the records that
+//    start in its range of the input: from virtual offset start up to the BGZF
+//    block at address limit.
+struct ReaderParam {
+	int pass;
+	std::string fname;
+	const BamHeader* header;
+	const std::vector<size_t>* ref_offsets;
+	bool sync;             // find the first record at the block start first
+	uint64_t start;
+	uint64_t limit;
+	uint64_t stop;         // virtual offset of the first record after the range
+	size_t num_records;
+	std::exception_ptr error; // of a reader that failed, rethrown once all are joined
+
+	// Pass 1: thread-local histogram of aligned records, and number of records
+	//    of each of the reader's bypass blocks
+	std::vector<table_records> table;
+	std::vector<size_t> bypass_lines;
+	std::vector<size_t> bypass_bytes;
+	// Where the last aligned record of the range ends, and the unmapped
+	//    records after it
+	bool has_aligned;
+	uint64_t aligned_end;
+	size_t tail_lines;
+	size_t tail_bytes;
+
+	// Pass 2: planned histogram, block files, records each block still waits
+	//    for, and where the reader's records and bypass blocks are numbered from.
+	//    Blocks go to the queue as soon as they are complete.
+	const std::vector<table_records>* plan;
+	BlockFileBuckets* vec_pipes;
+	tthread::mutex* pipe_mutexes;
+	size_t* remaining;
+	BlockQueue* queue;
+	uint64_t ordinal;
+	size_t bypass_base;
+	uint64_t tail_start;   // records from here on are copied as they are
+	const std::function<void(size_t)>* complete; // takes an aligned block once it is complete
+
+	// With --markdup, pass 1 measures the reach of the records, and pass 2
+	//    offers them to the sets near the boundaries of the blocks
+	const DupMarker* markdup;
+	int64_t dup_reach;
+	DupZones* dup_zones;
+
+	// Key orders: pass 1 keeps a reservoir sample of up to sample_max of the
+	//    reader's records, and pass 2 routes records by the partition of the
+	//    samples of all readers, counting the records of each block
+	size_t sample_max;
+	KeyReservoir reservoir;
+	const RangePartition* partition;
+	std::vector<table_records> bucket_sizes;
+};
+
+static void reader_range(ReaderParam& param, BgzfReader& in) {
+	const std::vector<size_t>& ref_offsets = *param.ref_offsets;
+	if(!in.seek(param.start)) throw std::runtime_error("cannot read " + param.fname);
+	param.num_records = 0;
+	std::vector<char> rec;
+	BlockFileWriter bypass;
+	size_t bypass_size = 0;
+	size_t bypass_num = 0;
+	param.bypass_lines.clear();
+	param.bypass_bytes.clear();
+	param.has_aligned = false;
+	param.aligned_end = param.start;
+	param.tail_lines = param.tail_bytes = 0;
+	param.dup_reach = 0;
+	uint64_t ordinal = param.ordinal;
+	std::string key;
+	param.reservoir.reset(param.sample_max, param.start);
+	while(true) {
+		param.stop = in.tell();
+		if((param.stop >> 16) >= param.limit || param.stop >= param.tail_start || !bam_read_record(in, rec)) break;
+		const char* r = rec.data();
+		int32_t refid = bam_refid(r);
+		if(refid >= (int32_t)ref_offsets.size()) throw std::runtime_error("invalid refID in " + param.fname);
+		size_t size = block_record_size(r);
+		param.num_records++;
+		if(opt_sort.order != SORT_COORDINATE) {
+			if(param.pass == 1) {
+				KeySample* sample = param.reservoir.offer();
+				if(sample != nullptr) {
+					bam_sort_key(r, opt_sort, sample->key);
+					sample->ordinal = ordinal;
+					sample->footprint = block_footprint(size, 1);
+				}
+			} else {
+				bam_sort_key(r, opt_sort, key);
+				key_append_ordinal(key, ordinal);
+				size_t block = param.partition->block(key);
+				param.bucket_sizes[block].num_char += size;
+				param.bucket_sizes[block].num_lines++;
+				tthread::lock_guard<tthread::mutex> lock(param.pipe_mutexes[block]);
+				param.vec_pipes->write(block, ordinal, r);
+			}
+			ordinal++;
+			continue;
+		}
+		if(refid < 0) {
+			param.tail_lines++;
+			param.tail_bytes += size;
+		} else {
+			param.has_aligned = true;
+			param.aligned_end = in.tell();
+			param.tail_lines = param.tail_bytes = 0;
+		}
+		if(refid < 0) {
+			// Both passes cut bypass blocks at the same records
+			bool next_bypass = (bypass_num == 0 || block_footprint(bypass_size + size, 0) > opt_memory_per_thread);
+			if(param.pass == 2) {
+				if(next_bypass) {
+					if(bypass_num > 0) {
+						bypass.close();
+						param.queue->push(param.bypass_base + bypass_num - 1);
+					}
+					std::string fname = tmp_fname("", param.bypass_base + bypass_num);
+					if(!bypass.open(fname, tmp_buffer_size(opt_threads))) throw std::runtime_error("cannot open " + fname);
+				}
+				bypass.write(ordinal, r);
+			} else {
+				if(next_bypass) {
+					param.bypass_lines.push_back(0);
+					param.bypass_bytes.push_back(0);
+				}
+				param.bypass_lines.back()++;
+				param.bypass_bytes.back() += size;
+			}
+			if(next_bypass) {
+				bypass_num++;
+				bypass_size = 0;
+			}
+			bypass_size += size;
+		} else if(param.pass == 1) {
+			table_records& tbl = param.table[bam_linear_pos(r, ref_offsets) / opt_table_interval];
+			tbl.num_char += size;
+			tbl.num_lines++;
+			if(param.markdup != nullptr) param.dup_reach = std::max(param.dup_reach, DupMarker::reach(r));
+		} else {
+			size_t block = (*param.plan)[bam_linear_pos(r, ref_offsets) / opt_table_interval].num_char;
+			if(param.dup_zones != nullptr) param.markdup->offer(r, *param.dup_zones);
+			tthread::lock_guard<tthread::mutex> lock(param.pipe_mutexes[block]);
+			param.vec_pipes->write(block, ordinal, r);
+			if(--param.remaining[block] == 0) {
+				param.vec_pipes->close(block);
+				(*param.complete)(block);
+			}
+		}
+		ordinal++;
+	}
+	if(param.pass == 2 && bypass_num > 0) {
+		bypass.close();
+		param.queue->push(param.bypass_base + bypass_num - 1);
+	}
+}
+
+static void reader_read(ReaderParam& param) {
+	BgzfReader in;
+	if(!in.open(param.fname)) throw std::runtime_error("cannot open " + param.fname);
+	if(!param.sync) {
+		reader_range(param, in);
+		return;
+	}
+	// A range that lost sync reads garbage until it fails or is found out
+	//    by the check against the previous range
+	try {
+		if(!in.seek(param.start) || !bam_sync(in, *param.header, param.limit, param.start)) {
+			throw std::runtime_error("no record found");
+		}
+		reader_range(param, in);
+	} catch(const std::exception&) {
+		param.start = param.stop = std::numeric_limits<uint64_t>::max();
+		param.num_records = 0;
+	}
+}
+
+static void reader_worker(void* vp) {
+	ReaderParam& param = *(ReaderParam*)vp;
+	param.error = std::exception_ptr();
+	try {
+		reader_read(param);
+	} catch(...) {
+		param.error = std::current_exception();
+	}
+}
+
+// Plan copy blocks for the given number of unmapped records from virtual
+//    offset tail_start to the end of the input, split at BGZF blocks into one
+//    piece per thread, or more if they would not fit in a thread's share of
+//    the memory
+static void plan_copy_blocks(const std::string& in_fname, uint64_t tail_start, size_t records, std::vector<fileLines>& blocks) {
+	uint64_t data_end = bgzf_data_end(in_fname);
+	uint64_t bytes = data_end - std::min(data_end, tail_start >> 16);
+	size_t num_pieces = std::max<size_t>(1, std::min<uint64_t>(opt_threads, bytes / min_block_footprint));
+	num_pieces = std::max<size_t>(num_pieces, bytes / std::max<size_t>(1, opt_memory_per_thread / 2) + 1);
+	std::vector<uint64_t> starts(1, tail_start);
+	for(size_t k = 1; k < num_pieces; k++) {
+		uint64_t block = bgzf_find_block(in_fname, (tail_start >> 16) + bytes * k / num_pieces);
+		if(block > (starts.back() >> 16) && block < data_end) starts.push_back(block << 16);
+	}
+	size_t records_sofar = 0;
+	for(size_t k = 0; k < starts.size(); k++) {
+		fileLines block;
+		block.copy = 1;
+		block.voffset = starts[k];
+		block.end = (k + 1 < starts.size() ? (starts[k + 1] >> 16) : data_end);
+		// A piece starting within a block recompresses the rest of that block
+		block.numBytes = block.end - std::min<uint64_t>(block.end, starts[k] >> 16) + BGZF_MAX_BLOCK_SIZE;
+		// Records are spread over the pieces by their compressed bytes
+		size_t records_end = (k + 1 < starts.size() ? (size_t)((double)records * (block.end - (tail_start >> 16)) / std::max<uint64_t>(1, bytes)) : records);
+		block.copyLines = std::max(records_sofar, records_end) - records_sofar;
+		records_sofar += block.copyLines;
+		blocks.push_back(block);
+	}
+}
+
+// Pass a copy block through: the rest of the BGZF block it starts in is
+//    recompressed into out, and the whole blocks after it are appended to
+//    compressed, which out writes into, without being decompressed
+static void copyRawBlocks(const std::string& fname, const fileLines& block, BgzfWriter& out, std::vector<char>& compressed) {
+	uint64_t offset = block.voffset >> 16;
+	if((block.voffset & 0xffff) != 0) {
+		BgzfReader in;
+		std::vector<char> data;
+		uint64_t voffset;
+		if(!in.open(fname) || !in.seek(block.voffset) || !in.read_chunk(data, voffset)) {
+			throw std::runtime_error("cannot read " + fname);
+		}
+		out.write(data.data(), data.size());
+		offset = in.tell() >> 16;
+	}
+	out.close();
+	if(offset >= block.end) return;
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) throw std::runtime_error("cannot open " + fname);
+	size_t length = compressed.size();
+	compressed.resize(length + (block.end - offset));
+	while(offset < block.end) {
+		ssize_t count = pread(fd, compressed.data() + length, block.end - offset, offset);
+		if(count <= 0) {
+			close(fd);
+			throw std::runtime_error("cannot read " + fname);
+		}
+		length += count;
+		offset += count;
+	}
+	close(fd);
+}
+
+// Pass 2 of the planning passes in a key order: the key space is partitioned
+//    by the samples of pass 1, weighted by how many records of its range each
+//    one stands for, and readers route every record, unmapped ones included,
+//    to the block its key falls in.  Block sizes are only known once all
+//    records are routed, so blocks are all queued after the pass.
+static void bamKeyRoute(const std::string& in_fname,
+	std::vector<ReaderParam>& readers,
+	const std::function<void()>& run_readers,
+	std::vector<fileLines>& arrFileLines) {
+	std::vector<KeySample> sample;
+	uint64_t ordinal = 0;
+	for(size_t k = 0; k < readers.size(); k++) {
+		ReaderParam& reader = readers[k];
+		std::vector<KeySample>& samples = reader.reservoir.samples();
+		for(size_t i = 0; i < samples.size(); i++) {
+			sample.push_back(samples[i]);
+			sample.back().ordinal += ordinal;
+			sample.back().weight = (double)reader.num_records / samples.size();
+		}
+		std::vector<KeySample>().swap(samples);
+		reader.ordinal = ordinal;
+		ordinal += reader.num_records;
+	}
+	// Blocks are only filled to 3/4 of the budget, as the sample gives estimates
+	RangePartition partition;
+	partition.plan(sample, opt_memory_per_thread / 4 * 3, opt_threads, min_block_footprint);
+	std::vector<KeySample>().swap(sample);
+	const size_t num_blocks = partition.num_blocks();
+	if(opt_verbose) {
+		std::cerr << "\t\tPartitioned the keys into " << num_blocks << " blocks" << std::endl;
+	}
+
+	Timer t(std::cerr, "\t2nd pass) Reading BAM file with " + std::to_string(readers.size()) + " readers: " + in_fname, opt_verbose);
+	RunStats::Phase phase(run_stats, "2nd pass");
+	BlockFileBuckets vec_pipes(num_blocks);
+	std::vector<tthread::mutex> pipe_mutexes(num_blocks);
+	table_records empty;
+	empty.num_char = 0;
+	empty.num_lines = 0;
+	for(size_t k = 0; k < readers.size(); k++) {
+		ReaderParam& reader = readers[k];
+		reader.pass = 2;
+		reader.sync = false;
+		reader.partition = &partition;
+		reader.vec_pipes = &vec_pipes;
+		reader.pipe_mutexes = pipe_mutexes.data();
+		reader.bucket_sizes.assign(num_blocks, empty);
+	}
+	run_readers();
+	vec_pipes.close();
+	arrFileLines.resize(num_blocks);
+	for(size_t i = 0; i < num_blocks; i++) {
+		for(size_t k = 0; k < readers.size(); k++) {
+			arrFileLines[i].numLines += readers[k].bucket_sizes[i].num_lines;
+			arrFileLines[i].numBytes += readers[k].bucket_sizes[i].num_char;
+		}
+	}
+}
+
+// The two planning passes over native BAM input, each run by several readers
+//    on disjoint BGZF-aligned ranges of the input.  Records carry no sync
+//    marker, so readers find their first record heuristically; after pass 1,
+//    each range's start is checked against where the previous range stopped,
+//    and a range that got it wrong is read again from the right place.  Pass 1
+//    merges the thread-local histograms and plans the blocks, aligned ones
+//    followed by each reader's bypass blocks in order.  Once planned is called,
+//    pass 2 routes records into the block files and queues each block as soon
+//    as it holds all its records, so that sorting overlaps the pass.
+static void bamParallelPasses(const std::string& in_fname,
+	BamHeader& header,
+	std::vector<size_t>& ref_offsets,
+	std::vector<fileLines>& arrFileLines,
+	BlockQueue& queue,
+	DupMarker* markdup,
+	DupZones& dup_zones,
+	const std::function<void()>& planned) {
+	uint64_t first_record = 0;
+	{
+		BgzfReader in;
+		if(!in.open(in_fname)) throw std::runtime_error("cannot open " + in_fname);
+		bam_read_header(in, header);
+		first_record = in.tell();
+	}
+	std::vector<table_records> table;
+	size_t table_size = 0;
+	table_init(table, table_size, bam_ref_offsets(header, ref_offsets));
+	if(markdup != nullptr) markdup->init(header, ref_offsets);
+
+	// Each reader gets at least 1 MB of input, and the thread-local histograms
+	//    may take up to half of the memory
+	struct stat st;
+	uint64_t file_size = (stat(in_fname.c_str(), &st) == 0 ? st.st_size : 0);
+	size_t num_readers = std::min<size_t>(opt_threads, std::max<uint64_t>(1, file_size >> 20));
+	num_readers = std::min<size_t>(num_readers, std::max<size_t>(1, opt_memory / 2 / (table.size() * sizeof(table_records))));
+	std::vector<uint64_t> starts(1, first_record);
+	for(size_t k = 1; k < num_readers; k++) {
+		uint64_t block = bgzf_find_block(in_fname, file_size * k / num_readers);
+		if(block > (starts.back() >> 16) && block < file_size) starts.push_back(block << 16);
+	}
+	std::vector<ReaderParam> readers(starts.size());
+	for(size_t k = 0; k < readers.size(); k++) {
+		ReaderParam& reader = readers[k];
+		reader.pass = 1;
+		reader.fname = in_fname;
+		reader.header = &header;
+		reader.ref_offsets = &ref_offsets;
+		reader.sync = (k > 0);
+		reader.start = starts[k];
+		reader.limit = (k + 1 < starts.size() ? (starts[k + 1] >> 16) : std::numeric_limits<uint64_t>::max());
+		reader.ordinal = 0;
+		reader.tail_start = std::numeric_limits<uint64_t>::max();
+		reader.sample_max = std::max<size_t>(1, key_sample_size() / starts.size());
+		reader.markdup = markdup;
+		reader.dup_zones = nullptr;
+		if(opt_sort.order == SORT_COORDINATE) reader.table.resize(table.size(), table[0]);
+	}
+	auto run_readers = [&readers]() {
+		std::vector<tthread::thread*> threads(readers.size() - 1);
+		for(size_t k = 1; k < readers.size(); k++) {
+			threads[k - 1] = new tthread::thread(reader_worker, (void*)&readers[k]);
+		}
+		reader_worker((void*)&readers[0]);
+		for(size_t k = 0; k < threads.size(); k++) {
+			threads[k]->join();
+			delete threads[k];
+		}
+		for(size_t k = 0; k < readers.size(); k++) {
+			if(readers[k].error) std::rethrow_exception(readers[k].error);
+		}
+	};
+
+	// First pass
+	{
+		Timer t(std::cerr, "\t1st pass) Reading BAM file with " + std::to_string(readers.size()) + " readers: " + in_fname, opt_verbose);
+		RunStats::Phase phase(run_stats, "1st pass");
+		run_readers();
+		for(size_t k = 1; k < readers.size(); k++) {
+			ReaderParam& reader = readers[k];
+			if(reader.start != readers[k - 1].stop) {
+				if(opt_verbose) {
+					std::cerr << "\t\tReader #" << k << " lost sync; reading its range again" << std::endl;
+				}
+				reader.sync = false;
+				reader.start = readers[k - 1].stop;
+				if(opt_sort.order == SORT_COORDINATE) reader.table.assign(table.size(), table[0]);
+				reader_worker((void*)&reader);
+			}
+		}
+		for(size_t k = 0; k < readers.size() && opt_sort.order == SORT_COORDINATE; k++) {
+			for(size_t i = 0; i < table.size(); i++) {
+				table[i].num_char += readers[k].table[i].num_char;
+				table[i].num_lines += readers[k].table[i].num_lines;
+			}
+			std::vector<table_records>().swap(readers[k].table);
+			if(markdup != nullptr) markdup->set_reach(std::max(markdup->reach(), readers[k].dup_reach));
+		}
+	}
+
+	if(opt_sort.order != SORT_COORDINATE) {
+		bamKeyRoute(in_fname, readers, run_readers, arrFileLines);
+		planned();
+		for(size_t i = 0; i < arrFileLines.size(); i++) {
+			queue.push(i);
+		}
+		return;
+	}
+
+	// Unmapped records after the last aligned one are left out of the bypass
+	//    blocks and copied as they are
+	size_t last_aligned = readers.size();
+	for(size_t k = 0; k < readers.size(); k++) {
+		if(readers[k].has_aligned) last_aligned = k;
+	}
+	uint64_t tail_start = (last_aligned < readers.size() ? readers[last_aligned].aligned_end : first_record);
+	bool copy_tail = false;
+	size_t tail_records = 0;
+	for(size_t k = (last_aligned < readers.size() ? last_aligned : 0); k < readers.size(); k++) {
+		ReaderParam& reader = readers[k];
+		copy_tail = copy_tail || reader.tail_lines > 0;
+		tail_records += reader.tail_lines;
+		while(reader.tail_lines > 0) {
+			if(reader.bypass_lines.back() <= reader.tail_lines) {
+				reader.tail_lines -= reader.bypass_lines.back();
+				reader.tail_bytes -= reader.bypass_bytes.back();
+				reader.bypass_lines.pop_back();
+				reader.bypass_bytes.pop_back();
+			} else {
+				reader.bypass_lines.back() -= reader.tail_lines;
+				reader.bypass_bytes.back() -= reader.tail_bytes;
+				reader.tail_lines = 0;
+			}
+		}
+		reader.tail_start = tail_start;
+	}
+
+	// Determine number of files and lines per file
+	table_plan(table, 0, table.size(), arrFileLines);
+	size_t aligned_file_num = arrFileLines.size();
+	for(size_t k = 0; k < readers.size(); k++) {
+		readers[k].bypass_base = arrFileLines.size();
+		for(size_t j = 0; j < readers[k].bypass_lines.size(); j++) {
+			arrFileLines.push_back(fileLines());
+			arrFileLines.back().numLines = readers[k].bypass_lines[j];
+			arrFileLines.back().numBytes = readers[k].bypass_bytes[j];
+			arrFileLines.back().bypass = 1;
+		}
+	}
+	size_t copy_base = arrFileLines.size();
+	if(copy_tail) plan_copy_blocks(in_fname, tail_start, tail_records, arrFileLines);
+	planned();
+	for(size_t i = copy_base; i < arrFileLines.size(); i++) {
+		queue.push(i);
+	}
+
+	// Aligned blocks are sorted as soon as they are complete.  With --markdup,
+	//    the sets near the boundaries between blocks are gathered on the way,
+	//    and a block also waits for the blocks within twice the reach of it,
+	//    which may hold records of its sets.
+	std::function<void(size_t)> complete = [&queue](size_t block) { queue.push(block); };
+	std::vector<std::pair<size_t, size_t> > dup_window(aligned_file_num);
+	std::vector<size_t> dup_waiting(aligned_file_num);
+	tthread::mutex dup_mutex;
+	if(markdup != nullptr) {
+		std::vector<int64_t> boundaries;
+		for(size_t i = 1; i < aligned_file_num; i++) {
+			boundaries.push_back((int64_t)arrFileLines[i].begin);
+		}
+		dup_zones.plan(markdup->reach(), boundaries);
+		size_t margin = 2 * (size_t)markdup->reach() + 2;
+		for(size_t i = 0; i < aligned_file_num; i++) {
+			size_t lo = i, hi = i;
+			while(lo > 0 && arrFileLines[lo - 1].end + margin > arrFileLines[i].begin) lo--;
+			while(hi + 1 < aligned_file_num && arrFileLines[hi + 1].begin < arrFileLines[i].end + margin) hi++;
+			dup_window[i] = std::make_pair(lo, hi);
+			dup_waiting[i] = hi - lo + 1;
+		}
+		complete = [&](size_t block) {
+			tthread::lock_guard<tthread::mutex> lock(dup_mutex);
+			for(size_t i = dup_window[block].first; i <= dup_window[block].second; i++) {
+				if(--dup_waiting[i] == 0) queue.push(i);
+			}
+		};
+	}
+
+	// Second pass
+	{
+		Timer t(std::cerr, "\t2nd pass) Reading BAM file with " + std::to_string(readers.size()) + " readers: " + in_fname, opt_verbose);
+		RunStats::Phase phase(run_stats, "2nd pass");
+		BlockFileBuckets vec_pipes(aligned_file_num);
+		std::vector<tthread::mutex> pipe_mutexes(aligned_file_num);
+		std::vector<size_t> remaining(aligned_file_num);
+		for(size_t i = 0; i < aligned_file_num; i++) {
+			remaining[i] = arrFileLines[i].numLines;
+			if(remaining[i] == 0) {
+				vec_pipes.close(i);
+				complete(i);
+			}
+		}
+		uint64_t ordinal = 0;
+		for(size_t k = 0; k < readers.size(); k++) {
+			ReaderParam& reader = readers[k];
+			reader.pass = 2;
+			reader.sync = false;
+			reader.plan = &table;
+			reader.vec_pipes = &vec_pipes;
+			reader.pipe_mutexes = pipe_mutexes.data();
+			reader.remaining = remaining.data();
+			reader.queue = &queue;
+			reader.complete = &complete;
+			reader.dup_zones = (markdup != nullptr ? &dup_zones : nullptr);
+			reader.ordinal = ordinal;
+			ordinal += reader.num_records;
+		}
+		run_readers();
+		for(size_t i = 0; i < aligned_file_num; i++) {
+			if(remaining[i] != 0) throw std::runtime_error(in_fname + " changed while it was read");
+		}
+		vec_pipes.close();
+	}
+}
+
+// Probes of the single pass take at most one per probe_spacing compressed
+//    bytes, up to probe_max, and check their sync over probe_look_ahead bytes,
+//    so that probing costs a small fraction of reading the input
+static const size_t probe_max = 1024;
+static const uint64_t probe_spacing = uint64_t(1) << 20;
+static const size_t probe_look_ahead = size_t(1) << 17;
+
+// Bucket BAM input in a single pass, in any sort order.  The partition of the
+//    keys comes from a sample: a decoded prefix of the input is sampled as a
+//    whole, and the rest of it at probes spread over its compressed bytes,
+//    each reading a few records from the first BGZF block after its point,
+//    so that the sample follows the input whatever its order.  Records are
+//    then spilled into the blocks on the fly; in coordinate order, keys are
+//    linear positions and unaligned reads go to bypass blocks.  A block that
+//    still outgrows the memory budget is split by the worker as usual.
+//    The input may be the standard input, "-", as it is read only once.  A
+//    stream cannot be probed, so its keys are partitioned as if it were twice
+//    what has been read, and partitioned again from a sample of all that has
+//    been read whenever its records outgrow the partition: the buckets so far
+//    are routed over into the new ones, which costs at most one more write of
+//    the stream in all as the partitions grow twice as large each time.
+//    Block files are left in key order, followed by the bypass blocks.
+static void bamSinglePass(const std::string& in_fname,
+	BamHeader& header,
+	std::vector<size_t>& ref_offsets,
+	std::vector<fileLines>& arrFileLines) {
+	BgzfReader in;
+	if(!in.open(in_fname)) throw std::runtime_error("cannot open " + in_fname);
+	bam_read_header(in, header);
+	bam_ref_offsets(header, ref_offsets);
+	const bool keyed = (opt_sort.order != SORT_COORDINATE);
+	// Records that are partitioned by key, and their keys
+	auto partitioned = [&](const char* r) {
+		int32_t refid = bam_refid(r);
+		if(refid >= (int32_t)ref_offsets.size()) throw std::runtime_error("invalid refID in " + in_fname);
+		return keyed || refid >= 0;
+	};
+	auto sort_key = [&](const char* r, std::string& key) {
+		if(keyed) {
+			bam_sort_key(r, opt_sort, key);
+		} else {
+			key.clear();
+			key_append_ordinal(key, bam_linear_pos(r, ref_offsets));
+		}
+	};
+
+	// Decode a prefix, sampling its records
+	const size_t prefix_max = std::min<size_t>(opt_memory_per_thread, size_t(64) << 20);
+	const size_t sample_size = key_sample_size();
+	std::vector<char> prefix, rec;
+	KeyReservoir reservoir;
+	reservoir.reset(sample_size, 0);
+	uint64_t ordinal = 0;
+	bool eof = false;
+	while(prefix.size() < prefix_max) {
+		if(!bam_read_record(in, rec)) {
+			eof = true;
+			break;
+		}
+		if(partitioned(rec.data())) {
+			KeySample* sample = reservoir.offer();
+			if(sample != nullptr) {
+				sort_key(rec.data(), sample->key);
+				sample->ordinal = ordinal;
+				sample->footprint = block_footprint(block_record_size(rec.data()), 1);
+			}
+		}
+		prefix.insert(prefix.end(), rec.data(), rec.data() + bam_rec_size(rec.data()));
+		ordinal++;
+	}
+	// The sample of a stream goes on over all of it
+	std::vector<KeySample> sample(reservoir.samples());
+	for(size_t i = 0; i < sample.size(); i++) {
+		sample[i].weight = (double)reservoir.seen() / sample.size();
+	}
+	const bool stream = (!eof && in_fname == "-");
+	auto scale_sample = [&](double footprint) {
+		double sofar = 0;
+		for(size_t i = 0; i < sample.size(); i++) {
+			sofar += sample[i].weight * sample[i].footprint;
+		}
+		double scale = std::max(1.0, footprint / std::max(1.0, sofar));
+		for(size_t i = 0; i < sample.size(); i++) {
+			sample[i].weight *= scale;
+		}
+	};
+
+	// Sample the rest at probes, whose records stand for the partitioned
+	//    records extrapolated from the prefix to the whole input
+	uint64_t prefix_compressed = in.tell() >> 16;
+	uint64_t data_end = (in_fname == "-" ? 0 : bgzf_data_end(in_fname));
+	if(stream) {
+		double prefix_footprint = 0;
+		for(size_t i = 0; i < sample.size(); i++) {
+			prefix_footprint += sample[i].weight * sample[i].footprint;
+		}
+		scale_sample(2 * prefix_footprint);
+	} else if(!eof && prefix_compressed > 0 && prefix_compressed < data_end) {
+		double records_per_byte = (double)ordinal / prefix_compressed;
+		double rest_records = (double)reservoir.seen() / prefix_compressed * (data_end - prefix_compressed);
+		size_t num_probes = std::max<size_t>(1, std::min<uint64_t>(probe_max, (data_end - prefix_compressed) / probe_spacing));
+		size_t per_probe = sample_size / num_probes + 1;
+		size_t first_probe = sample.size();
+		BgzfReader probe;
+		if(!probe.open(in_fname)) throw std::runtime_error("cannot open " + in_fname);
+		for(size_t k = 0; k < num_probes; k++) {
+			uint64_t block = bgzf_find_block(in_fname, prefix_compressed + (data_end - prefix_compressed) * k / num_probes);
+			if(block >= data_end) break;
+			// A probe that loses sync only costs its samples
+			try {
+				uint64_t voffset;
+				if(!probe.seek(block << 16) || !bam_sync(probe, header, data_end, voffset, probe_look_ahead) || !probe.seek(voffset)) continue;
+				uint64_t probe_ordinal = (uint64_t)(records_per_byte * block);
+				for(size_t i = 0; i < per_probe && bam_read_record(probe, rec); i++) {
+					if(!partitioned(rec.data())) continue;
+					sample.push_back(KeySample());
+					sort_key(rec.data(), sample.back().key);
+					sample.back().ordinal = probe_ordinal + i;
+					sample.back().footprint = block_footprint(block_record_size(rec.data()), 1);
+				}
+			} catch(const std::exception&) {
+				continue;
+			}
+		}
+		for(size_t i = first_probe; i < sample.size(); i++) {
+			sample[i].weight = rest_records / (sample.size() - first_probe);
+		}
+	}
+	// Aim at filling blocks to 3/4 of the budget so that few need splitting
+	RangePartition partition;
+	double planned_footprint = 0, routed_footprint = 0;
+	auto plan = [&]() {
+		planned_footprint = 0;
+		for(size_t i = 0; i < sample.size(); i++) {
+			planned_footprint += sample[i].weight * sample[i].footprint;
+		}
+		partition.plan(sample, opt_memory_per_thread / 4 * 3, opt_threads, min_block_footprint);
+		std::vector<KeySample>().swap(sample);
+		if(opt_verbose) {
+			std::cerr << "\t\tPartitioned the keys into " << partition.num_blocks() << " blocks" << std::endl;
+		}
+	};
+	plan();
+
+	// Buckets are blocks 0 to num_buckets - 1, and the bypass blocks follow
+	//    them, so that block files are written under their final names.  The
+	//    buckets of a stream partitioned over again are of kind "r<n>." until
+	//    its end, and the bypass blocks keep the numbers they started with.
+	size_t num_buckets = partition.num_blocks();
+	const size_t first_unaligned = num_buckets;
+	std::string bucket_kind = "";
+	size_t num_partitions = 1;
+	std::unique_ptr<BlockFileBuckets> buckets(new BlockFileBuckets(num_buckets, bucket_kind));
+	std::vector<fileLines> bucket_blocks;
+	auto reset_blocks = [&]() {
+		bucket_blocks.assign(num_buckets, fileLines());
+		for(size_t i = 0; i < num_buckets; i++) {
+			bucket_blocks[i].begin = std::numeric_limits<size_t>::max();
+		}
+	};
+	reset_blocks();
+	BlockFileWriter unaligned;
+	std::vector<fileLines> unaligned_blocks;
+	size_t unaligned_size = 0;
+	std::string key;
+	auto bucket_write = [&](const char* r, uint64_t ordinal) {
+		sort_key(r, key);
+		key_append_ordinal(key, ordinal);
+		size_t bucket = partition.block(key);
+		buckets->write(bucket, ordinal, r);
+		fileLines& block = bucket_blocks[bucket];
+		block.numLines++;
+		block.numBytes += block_record_size(r);
+		// Workers split oversized coordinate blocks over the positions
+		//    their records span
+		if(!keyed) {
+			size_t pos = bam_linear_pos(r, ref_offsets);
+			block.begin = std::min(block.begin, pos);
+			block.end = std::max(block.end, pos + 1);
+		}
+	};
+	auto repartition = [&]() {
+		sample = reservoir.samples();
+		for(size_t i = 0; i < sample.size(); i++) {
+			sample[i].weight = (double)reservoir.seen() / sample.size();
+		}
+		scale_sample(2 * routed_footprint);
+		plan();
+		buckets->close();
+		buckets.reset();
+		size_t old_buckets = num_buckets;
+		std::string old_kind = bucket_kind;
+		num_buckets = partition.num_blocks();
+		bucket_kind = "r" + std::to_string(num_partitions++) + ".";
+		buckets.reset(new BlockFileBuckets(num_buckets, bucket_kind));
+		reset_blocks();
+		std::vector<char> old_rec;
+		for(size_t i = 0; i < old_buckets; i++) {
+			std::string fname = tmp_fname(old_kind, i);
+			BlockFileReader old;
+			if(!old.open(fname)) throw std::runtime_error("cannot open " + fname);
+			uint64_t old_ordinal;
+			while(old.read_record(old_ordinal, old_rec)) {
+				bucket_write(old_rec.data(), old_ordinal);
+			}
+			std::remove(fname.c_str());
+		}
+	};
+	ordinal = 0;
+	auto route = [&](const char* r) {
+		size_t size = block_record_size(r);
+		if(!partitioned(r)) {
+			if(unaligned_blocks.empty() || block_footprint(unaligned_size + size, 0) > opt_memory_per_thread) {
+				unaligned.close();
+				std::string fname = tmp_fname("", first_unaligned + unaligned_blocks.size());
+				if(!unaligned.open(fname, tmp_buffer_size(1))) throw std::runtime_error("cannot open " + fname);
+				unaligned_blocks.push_back(fileLines());
+				unaligned_blocks.back().bypass = 1;
+				unaligned_size = 0;
+			}
+			unaligned.write(ordinal, r);
+			unaligned_size += size;
+			unaligned_blocks.back().numLines++;
+			unaligned_blocks.back().numBytes += size;
+		} else {
+			bucket_write(r, ordinal);
+			routed_footprint += block_footprint(size, 1);
+		}
+		ordinal++;
+	};
+	for(size_t i = 0; i < prefix.size(); i += bam_rec_size(&prefix[i])) {
+		route(&prefix[i]);
+	}
+	std::vector<char>().swap(prefix);
+	while(!eof && bam_read_record(in, rec)) {
+		if(stream && partitioned(rec.data())) {
+			KeySample* slot = reservoir.offer();
+			if(slot != nullptr) {
+				sort_key(rec.data(), slot->key);
+				slot->ordinal = ordinal;
+				slot->footprint = block_footprint(block_record_size(rec.data()), 1);
+			}
+		}
+		route(rec.data());
+		if(stream && routed_footprint > planned_footprint) repartition();
+	}
+	unaligned.close();
+	buckets->close();
+
+	// Files of the last partition of a stream go under their final names,
+	//    after the bypass blocks move out of the way
+	if(num_buckets != first_unaligned) {
+		for(size_t k = 0; k < unaligned_blocks.size(); k++) {
+			size_t i = (num_buckets > first_unaligned ? unaligned_blocks.size() - 1 - k : k);
+			tmp_rename(tmp_fname("", first_unaligned + i), tmp_fname("", num_buckets + i));
+		}
+	}
+	if(bucket_kind != "") {
+		for(size_t i = 0; i < num_buckets; i++) {
+			tmp_rename(tmp_fname(bucket_kind, i), tmp_fname("", i));
+		}
+	}
+
+	// Buckets that came out empty, whose splitters were estimated from probes,
+	//    are left as empty blocks
+	for(size_t i = 0; i < num_buckets; i++) {
+		if(bucket_blocks[i].numLines == 0) bucket_blocks[i].begin = 0;
+		arrFileLines.push_back(bucket_blocks[i]);
+	}
+	arrFileLines.insert(arrFileLines.end(), unaligned_blocks.begin(), unaligned_blocks.end());
+}
+
+// Plan blocks from the .bai/.csi index of a coordinate-sorted BAM file instead
+//    of a histogram pass.  Block sizes are estimated from the distance between
+//    the virtual offsets of the index windows, and each block becomes a region
+//    of the input that a worker reads on its own with random access.  Return
+//    false if there is no usable index.
+static bool bamIndexPlan(const std::string& in_fname,
+	BamHeader& header,
+	std::vector<size_t>& ref_offsets,
+	std::vector<fileLines>& arrFileLines) {
+	std::string index_fname = bam_index_find(in_fname);
+	if(index_fname == "") return false;
+	BamIndex index;
+	bam_index_load(index_fname, index);
+
+	BgzfReader in;
+	if(!in.open(in_fname)) throw std::runtime_error("cannot open " + in_fname);
+	bam_read_header(in, header);
+	if(index.refs.size() != header.ref_lens.size()) {
+		std::cerr << "Warning: " << index_fname << " does not match " << in_fname << "; ignoring it." << std::endl;
+		return false;
+	}
+	uint64_t first_record = in.tell();
+	size_t size_sofar = bam_ref_offsets(header, ref_offsets);
+
+	// Estimate the compression ratio from a decoded prefix
+	std::vector<char> prefix(size_t(4) << 20);
+	size_t prefix_len = in.read(prefix.data(), prefix.size());
+	double ratio = std::max<double>(1.0, (double)prefix_len / std::max<uint64_t>(1, (in.tell() >> 16) - (first_record >> 16)));
+	auto uncompressed = [ratio](uint64_t voffset) { return (double)(voffset >> 16) * ratio + (voffset & 0xffff); };
+
+	// Spread the estimated bytes of each window over its intervals, with a
+	//    safety margin as the estimate is coarse
+	std::vector<table_records> table;
+	size_t table_size = 0;
+	table_init(table, table_size, size_sofar);
+	const size_t window = size_t(1) << index.min_shift;
+	uint64_t tail = first_record; // where unplaced unmapped records start
+	for(size_t r = 0; r < index.refs.size(); r++) {
+		const BamRefIndex& ref = index.refs[r];
+		if(ref.n_mapped + ref.n_unmapped == 0) continue;
+		tail = std::max(tail, ref.ref_end);
+		double ref_bytes = std::max(1.0, uncompressed(ref.ref_end) - uncompressed(ref.ref_beg));
+		for(size_t w = 0; w < ref.windows.size(); w++) {
+			uint64_t next = (w + 1 < ref.windows.size() ? ref.windows[w + 1] : ref.ref_end);
+			double bytes = std::max(0.0, uncompressed(next) - uncompressed(ref.windows[w]));
+			size_t lines = (size_t)((ref.n_mapped + ref.n_unmapped) * bytes / ref_bytes);
+			size_t begin = ref_offsets[r] + w * window + 1;
+			size_t end = std::min(ref_offsets[r] + std::min((w + 1) * window, header.ref_lens[r]) + 1, size_sofar + 1);
+			size_t num_intervals = (end - 1) / opt_table_interval - begin / opt_table_interval + 1;
+			for(size_t i = begin / opt_table_interval; i <= (end - 1) / opt_table_interval; i++) {
+				table[i].num_char += (size_t)(bytes / num_intervals * 4 / 3);
+				table[i].num_lines += lines / num_intervals;
+			}
+		}
+	}
+	std::vector<fileLines> blocks;
+	table_plan(table, 0, table_size - 1, blocks);
+
+	// Turn blocks into regions: the first window overlapping a block's first
+	//    position gives a virtual offset no later than its first record
+	std::vector<size_t> block_begin(blocks.size(), std::numeric_limits<size_t>::max()), block_end(blocks.size(), 0);
+	for(size_t i = 0; i < table_size - 1; i++) {
+		size_t b = table[i].num_char;
+		block_begin[b] = std::min(block_begin[b], i * opt_table_interval);
+		block_end[b] = std::max(block_end[b], (i + 1) * opt_table_interval);
+	}
+	for(size_t b = 0; b < blocks.size(); b++) {
+		fileLines& block = blocks[b];
+		block.region = 1;
+		block.begin = block_begin[b];
+		block.end = block_end[b];
+		block.voffset = tail;
+		for(size_t r = 0; r < index.refs.size(); r++) {
+			if(ref_offsets[r] + header.ref_lens[r] + 1 <= block.begin) continue;
+			size_t pos = (block.begin > ref_offsets[r] + 1 ? block.begin - ref_offsets[r] - 1 : 0);
+			const BamRefIndex& ref = index.refs[r];
+			if((pos >> index.min_shift) < ref.windows.size()) {
+				block.voffset = ref.windows[pos >> index.min_shift];
+				break;
+			}
+		}
+		arrFileLines.push_back(block);
+	}
+	// Unplaced unmapped records come last in a sorted file and are copied
+	if(!index.has_no_coor || index.n_no_coor > 0) {
+		plan_copy_blocks(in_fname, tail, index.n_no_coor, arrFileLines);
+	}
+	if(opt_verbose) {
+		std::cerr << "\t\tPlanned " << arrFileLines.size() << " blocks from " << index_fname << std::endl;
+	}
+	return true;
+}
+
+// Load the records of an index-planned region into the arena, until the region
+//    ends or the arena is full.  A record that does not fit is kept in pending
+//    for the next call.  Return true if the region has more records.
+static bool bamRegionLoad(BgzfReader& in,
+	const fileLines& block,
+	const std::vector<size_t>& ref_offsets,
+	std::vector<SamRecord>& samRecords,
+	char* sam,
+	size_t sam_size,
+	std::vector<char>& pending) {
+	samRecords.clear();
+	char* sam_cur = sam;
+	while(true) {
+		char* rec = sam_cur;
+		if(!pending.empty()) {
+			if(pending.size() > sam_size) throw std::runtime_error("BAM record larger than the memory per thread");
+			memcpy(rec, pending.data(), pending.size());
+			pending.clear();
+		} else {
+			int32_t block_size;
+			if(in.read(&block_size, sizeof(block_size)) != sizeof(block_size)) return false;
+			size_t size = (size_t)block_size + 4;
+			if(sam_cur + size > sam + sam_size) {
+				pending.resize(size);
+				rec = pending.data();
+			}
+			memcpy(rec, &block_size, sizeof(block_size));
+			if(in.read(rec + 4, block_size) != (size_t)block_size) throw std::runtime_error("truncated BAM record");
+			if(bam_refid(rec) < 0) {
+				pending.clear();
+				return false;
+			}
+			size_t pos = bam_linear_pos(rec, ref_offsets);
+			if(pos < block.begin) {
+				pending.clear();
+				continue;
+			}
+			if(pos >= block.end) {
+				pending.clear();
+				return false;
+			}
+			if(rec != sam_cur) return true; // the arena is full
+		}
+		SamRecord samRecord;
+		samRecord.read_id = samRecords.size();
+		samRecord.pos = bam_linear_pos(rec, ref_offsets);
+		samRecord.line = rec;
+		sam_cur += bam_rec_size(rec);
+		samRecords.push_back(samRecord);
+	}
+}
+
+// Write a sorted record into out, adding it to index, if there is one, at the
+//    virtual offsets it takes within out's buffer
+static inline void write_record(BgzfWriter& out, const char* rec, BamIndexBuilder* index) {
+	if(index == nullptr) {
+		out.write(rec, bam_rec_size(rec));
+		return;
+	}
+	uint64_t beg = out.tell();
+	out.write(rec, bam_rec_size(rec));
+	index->push(rec, beg, out.tell());
+}
+
+// Close out, which writes into buffer, or only flush it.  The last record added
+//    to index, if it ended in the block that is flushed, ends at the start of
+//    the next one.
+static void finish_block(BgzfWriter& out, const std::vector<char>& buffer, BamIndexBuilder* index, bool close) {
+	uint64_t end = out.tell();
+	if(close) {
+		out.close();
+	} else {
+		out.flush();
+	}
+	if(index != nullptr) index->block_flushed(end, (uint64_t)buffer.size() << 16);
+}
 
-struct SamRecord_cmp {
-  bool operator() (const SamRecord& a, const SamRecord& b) const {
-    if(a.pos != b.pos) return a.pos < b.pos;
-    return a.read_id < b.read_id; // Preserve reads
-  }
-};
+// Sort an index-planned region read straight from the input into out.
+//    The input is coordinate-sorted, so a region larger than the arena can be
+//    sorted and written in pieces, as long as the pieces stay in order.
+static void sortRegionBlock(const ThreadParam& threadParam,
+	const fileLines& block,
+	char* sam,
+	size_t sam_size,
+	std::vector<SamRecord>& samRecords,
+	BgzfWriter& out,
+	BamIndexBuilder* index,
+	BlockStats& stats) {
+	BgzfReader in;
+	if(!in.open(threadParam.fname_base) || !in.seek(block.voffset)) {
+		throw std::runtime_error("cannot read " + threadParam.fname_base);
+	}
+	std::vector<char> pending;
+	size_t last_pos = 0;
+	bool more = true;
+	while(more) {
+		{
+			Timer t(std::cerr, "", false, &stats.load);
+			more = bamRegionLoad(in, block, *threadParam.ref_offsets, samRecords, sam, sam_size, pending);
+		}
+		{
+			Timer t(std::cerr, "", false, &stats.sort);
+			sortRecords(threadParam, samRecords);
+		}
+		if(!samRecords.empty() && samRecords.front().pos < last_pos) {
+			throw std::runtime_error(threadParam.fname_base + " is not coordinate-sorted as its index implies");
+		}
+		Timer t(std::cerr, "", false, &stats.encode);
+		for(size_t i = 0; i < samRecords.size(); i++) {
+			write_record(out, samRecords[i].line, index);
+		}
+		stats.records += samRecords.size();
+		if(!samRecords.empty()) last_pos = samRecords.back().pos;
+	}
+}
 
-// Contig to position table that does use char* instead of std::string as key,
-//    thus avoiding numerous memory allocations/deallocations
-class Contig2Pos {
-public:
-  ~Contig2Pos() {
-    for(auto itr = _map.begin(); itr != _map.end(); itr++) {
-      assert(itr->first != nullptr);
-      delete []itr->first;
-    }
-  }
-  
-  void add(const char* str, size_t pos) {
-    assert(_map.find(str) == _map.end());
-    char* str_copy = new char[strlen(str) + 1];
-    strcpy(str_copy, str);
-    _map[str_copy] = pos;
-  }
+// Bins a split block's histogram starts with at least, and the records a bin
+//    stands for on average
+static const size_t pos_bins_min = 1024;
+static const size_t pos_bin_lines = 16;
 
-  size_t operator[](const char* str) {
-    assert(_map.find(str) != _map.end());
-    return _map[str];
-  }
+// Split a block too large for a thread's share of the memory, typically a
+//    pileup within a single histogram interval, into piece files that are
+//    sorted one after the other.  Pieces are cut down to single-position
+//    resolution where it takes, and the records of a position too large on
+//    its own are split by read order into pieces of equal record counts, so
+//    that the sorted pieces follow each other in (pos, read_id) order.  Text
+//    blocks keep their records in read order, which stands in for the
+//    ordinals.
+//    Given a marker, the sets of duplicates near the boundaries between
+//    pieces are gathered into piece_zones.
+static void splitLargeBlock(const std::string& fname,
+	const fileLines& block,
+	bool native,
+	const Contig2Pos& contig2pos,
+	const std::vector<size_t>& ref_offsets,
+	std::vector<fileLines>& pieces,
+	std::vector<std::string>& piece_fnames,
+	const DupMarker* markdup,
+	DupZones& piece_zones) {
+	auto scan = [&](const std::function<void(uint64_t, size_t, const char*, size_t)>& visit) {
+		uint64_t ordinal = 0;
+		if(native) {
+			BlockFileReader in;
+			if(!in.open(fname)) throw std::runtime_error("cannot open " + fname);
+			std::vector<char> rec;
+			while(in.read_record(ordinal, rec)) {
+				visit(ordinal, bam_linear_pos(rec.data(), ref_offsets), rec.data(), block_record_size(rec.data()));
+			}
+			return;
+		}
+		FILE* fp = fopen(fname.c_str(), "rb");
+		if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+		std::shared_ptr<FILE> in(fp, fclose);
+		SamLineReader reader(fp);
+		size_t last_contig = std::numeric_limits<size_t>::max();
+		const char* line;
+		size_t length;
+		while((line = reader.next(length)) != nullptr) {
+			const char* tabs[SAM_SCAN_TABS];
+			size_t line_length;
+			if(sam_scan_line(line, line + length, tabs, line_length) < SAM_SCAN_TABS) {
+				throw std::runtime_error("invalid SAM record in " + fname);
+			}
+			const char* contig_name = tabs[1] + 1;
+			size_t pos = contig2pos.find(contig_name, tabs[2] - contig_name, last_contig) + sam_parse_pos(tabs[2] + 1);
+			visit(ordinal++, pos, line, length);
+		}
+	};
 
-  struct Contig2PosCmp {
-    bool operator()(const char* str1, const char* str2) const {
-      return strcmp(str1, str2) < 0;
-    }
-  };
-	   
-private:
-  std::map<const char*, size_t, Contig2PosCmp> _map;
-};
+	// Histogram of the block's positions, coarse at first: a bin is refined
+	//    only while it holds more than a thread's share and more than one
+	//    position, so that it takes memory by the records, not by the span
+	struct PosBin {
+		size_t begin;
+		table_records records;
+	};
+	std::vector<PosBin> bins;
+	auto add_bins = [&](size_t begin, size_t end, size_t lines, std::vector<PosBin>& out) {
+		size_t count = std::min(end - begin, std::max(pos_bins_min, lines / pos_bin_lines));
+		size_t width = (end - begin + count - 1) / count;
+		for(size_t pos = begin; pos < end; pos += width) out.push_back(PosBin{pos, {0, 0}});
+	};
+	auto bin_of = [&](size_t pos) {
+		return (size_t)(std::upper_bound(bins.begin(), bins.end(), pos,
+			[](size_t p, const PosBin& bin) { return p < bin.begin; }) - bins.begin()) - 1;
+	};
+	auto bin_footprint = [&](size_t b) { return block_footprint(bins[b].records.num_char, bins[b].records.num_lines); };
+	add_bins(block.begin, block.end, block.numLines, bins);
+	std::vector<char> counting(bins.size(), 1);
+	for(bool refined = true; refined; ) {
+		scan([&](uint64_t, size_t pos, const char*, size_t size) {
+			if(pos < block.begin || pos >= block.end) throw std::runtime_error("record out of the range of " + fname);
+			size_t b = bin_of(pos);
+			if(!counting[b]) return;
+			bins[b].records.num_char += size;
+			bins[b].records.num_lines++;
+		});
+		std::vector<PosBin> next_bins;
+		std::vector<char> next_counting;
+		refined = false;
+		for(size_t b = 0; b < bins.size(); b++) {
+			size_t end = b + 1 < bins.size() ? bins[b + 1].begin : block.end;
+			if(counting[b] && end - bins[b].begin > 1 && bin_footprint(b) > opt_memory_per_thread) {
+				add_bins(bins[b].begin, end, bins[b].records.num_lines, next_bins);
+				next_counting.resize(next_bins.size(), 1);
+				refined = true;
+			} else {
+				next_bins.push_back(bins[b]);
+				next_counting.push_back(0);
+			}
+		}
+		bins.swap(next_bins);
+		counting.swap(next_counting);
+	}
 
-static tthread::mutex thread_mutex;
+	// Consecutive positions share a piece as long as it fits; a position too
+	//    large on its own gets several pieces, cut at read order ordinals
+	std::vector<size_t> bin_piece(bins.size());
+	std::map<size_t, std::vector<uint64_t> > hot_ordinals;
+	size_t num_pieces = 0, piece_size = 0;
+	for(size_t b = 0; b < bins.size(); b++) {
+		size_t size = bin_footprint(b);
+		if(size > opt_memory_per_thread) {
+			hot_ordinals[b].reserve(bins[b].records.num_lines);
+			bin_piece[b] = num_pieces;
+			num_pieces += size / opt_memory_per_thread + 1;
+			piece_size = opt_memory_per_thread; // nothing joins the last of them
+			continue;
+		}
+		if(num_pieces == 0 || piece_size + size > opt_memory_per_thread) {
+			num_pieces++;
+			piece_size = 0;
+		}
+		piece_size += size;
+		bin_piece[b] = num_pieces - 1;
+	}
+	std::map<size_t, std::vector<uint64_t> > hot_cuts;
+	if(!hot_ordinals.empty()) {
+		scan([&](uint64_t ordinal, size_t pos, const char*, size_t) {
+			auto itr = hot_ordinals.find(bin_of(pos));
+			if(itr != hot_ordinals.end()) itr->second.push_back(ordinal);
+		});
+		for(auto itr = hot_ordinals.begin(); itr != hot_ordinals.end(); itr++) {
+			std::vector<uint64_t>& ordinals = itr->second;
+			std::sort(ordinals.begin(), ordinals.end());
+			size_t bin = itr->first;
+			size_t num_cuts = bin_footprint(bin) / opt_memory_per_thread;
+			std::vector<uint64_t>& cuts = hot_cuts[bin];
+			for(size_t j = 1; j <= num_cuts; j++) {
+				cuts.push_back(ordinals[ordinals.size() * j / (num_cuts + 1)]);
+			}
+			std::vector<uint64_t>().swap(ordinals);
+		}
+	}
+	if(markdup != nullptr) {
+		std::vector<int64_t> boundaries;
+		for(size_t b = 0; b < bins.size(); b++) {
+			if((b > 0 && bin_piece[b] != bin_piece[b - 1]) || hot_cuts.count(b) > 0) boundaries.push_back((int64_t)bins[b].begin);
+		}
+		piece_zones.plan(markdup->reach(), boundaries);
+	}
 
-struct ThreadParam {
-  std::string fname_base;
-  size_t* next_block;
-  size_t num_block;
-  Contig2Pos* contig2pos;
-  std::vector<std::string>* headers;
-  std::vector<fileLines>* file_lines;
+	size_t first_piece = pieces.size();
+	pieces.resize(first_piece + num_pieces);
+	std::unique_ptr<BlockFileBuckets> native_pipes;
+	if(native) {
+		native_pipes.reset(new BlockFileBuckets(num_pieces, [&fname](size_t i) { return fname + "." + std::to_string(i); }, opt_memory_per_thread / 16));
+	}
+	std::vector<std::ofstream> text_pipes(native ? 0 : num_pieces);
+	for(size_t i = 0; i < num_pieces; i++) {
+		piece_fnames.push_back(fname + "." + std::to_string(i));
+		if(native) continue;
+		text_pipes[i].open(piece_fnames.back(), std::ios::binary);
+		if(!text_pipes[i].good()) throw std::runtime_error("cannot open " + piece_fnames.back());
+	}
+	scan([&](uint64_t ordinal, size_t pos, const char* rec, size_t size) {
+		size_t bin = bin_of(pos);
+		size_t piece = bin_piece[bin];
+		auto itr = hot_cuts.find(bin);
+		if(itr != hot_cuts.end()) {
+			piece += std::upper_bound(itr->second.begin(), itr->second.end(), ordinal) - itr->second.begin();
+		}
+		if(native) {
+			if(markdup != nullptr) markdup->offer(rec, piece_zones);
+			native_pipes->write(piece, ordinal, rec);
+		} else {
+			text_pipes[piece].write(rec, size);
+		}
+		pieces[first_piece + piece].numLines++;
+		pieces[first_piece + piece].numBytes += size;
+	});
+	if(native) native_pipes->close();
+	for(size_t i = 0; i < text_pipes.size(); i++) {
+		text_pipes[i].close();
+		if(text_pipes[i].fail()) throw std::runtime_error("cannot write " + piece_fnames[first_piece + i]);
+	}
+}
 
-  size_t thread_id;
-  size_t num_threads;
-};
+// Split a native block of a key order that does not fit in a thread's share of
+//    the budget by splitters sampled from its own keys, as the single pass
+//    partitions the input, into pieces that follow each other in key order
+static void splitKeyedBlock(const std::string& fname,
+	std::vector<fileLines>& pieces,
+	std::vector<std::string>& piece_fnames) {
+	BlockFileReader in;
+	uint64_t ordinal;
+	std::vector<char> rec;
+	KeyReservoir reservoir;
+	reservoir.reset(key_sample_size(), 0);
+	if(!in.open(fname)) throw std::runtime_error("cannot open " + fname);
+	while(in.read_record(ordinal, rec)) {
+		KeySample* sample = reservoir.offer();
+		if(sample != nullptr) {
+			bam_sort_key(rec.data(), opt_sort, sample->key);
+			sample->ordinal = ordinal;
+			sample->footprint = block_footprint(block_record_size(rec.data()), 1);
+		}
+	}
+	std::vector<KeySample> sample;
+	sample.swap(reservoir.samples());
+	for(size_t i = 0; i < sample.size(); i++) {
+		sample[i].weight = (double)reservoir.seen() / sample.size();
+	}
+	RangePartition partition;
+	partition.plan(sample, opt_memory_per_thread / 4 * 3, 1, min_block_footprint);
+	std::vector<KeySample>().swap(sample);
 
-// CB todo clean code
+	size_t first_piece = pieces.size();
+	size_t num_pieces = partition.num_blocks();
+	pieces.resize(first_piece + num_pieces);
+	BlockFileBuckets pipes(num_pieces, [&fname](size_t i) { return fname + "." + std::to_string(i); }, opt_memory_per_thread / 16);
+	for(size_t i = 0; i < num_pieces; i++) {
+		piece_fnames.push_back(fname + "." + std::to_string(i));
+	}
+	if(!in.open(fname)) throw std::runtime_error("cannot open " + fname);
+	std::string key;
+	while(in.read_record(ordinal, rec)) {
+		bam_sort_key(rec.data(), opt_sort, key);
+		key_append_ordinal(key, ordinal);
+		size_t piece = partition.block(key);
+		pipes.write(piece, ordinal, rec.data());
+		pieces[first_piece + piece].numLines++;
+		pieces[first_piece + piece].numBytes += block_record_size(rec.data());
+	}
+	pipes.close();
+}
 
-void fieldSplitter(int &pass,
-	std::vector<table_records> *table,
-	size_t *table_size,
-	std::vector<std::string> &headers,
-	Contig2Pos &contig2pos,
-	std::string &cmd,
-	size_t *aligned_file_num,
-	std::ofstream* vec_pipes = nullptr,
-	std::vector<SamRecord>* samRecords = nullptr,
-	char* sam_cur = nullptr){
+// Set the SO (and SS, unless empty) fields of the @HD line of a SAM header
+//    text, adding the line if there is none
+static std::string header_set_order(const std::string& text, const std::string& so, const std::string& ss) {
+	std::string fields = "\tSO:" + so + (ss.empty() ? "" : "\tSS:" + ss);
+	if(text.compare(0, 4, "@HD\t") != 0) return "@HD\tVN:1.6" + fields + "\n" + text;
+	size_t end = text.find('\n');
+	if(end == std::string::npos) end = text.length();
+	std::string line;
+	for(size_t i = 3; i < end; ) {
+		size_t next = text.find('\t', i + 1);
+		if(next == std::string::npos || next > end) next = end;
+		if(text.compare(i, 4, "\tSO:") != 0 && text.compare(i, 4, "\tSS:") != 0) line += text.substr(i, next - i);
+		i = next;
+	}
+	return "@HD" + line + fields + text.substr(end);
+}
 
-	char buffer[2048];
-	char line[2048];
-	size_t size_sofar = 0;
-	size_t unalign_itr = 0;
-	const size_t interval = 1 << 10;
+// Command that converts a SAM stream into the BAM file fname
+static std::string block_writer_cmd(const std::string& fname) {
+	std::string cmd = (opt_sambamba ? "sambamba" : "samtools");
+	cmd += " view ";
+	if(opt_sambamba) {
+		cmd += " -f bam -S /dev/stdin -o " + fname;
+	} else {
+		cmd += " -bS - > " + fname;
+	}
+	return cmd;
+}
 
-	std::shared_ptr<FILE> pipe(popen(cmd.c_str(), "r"), pclose);
-	if(!pipe) throw std::runtime_error("popen() failed!");
-	while(!feof(pipe.get())) {
-		buffer[0] = 0;
-		if(fgets(buffer, sizeof(buffer), pipe.get()) == nullptr) break;
-		if(strlen(buffer) == 0) continue;
+// Uncompressed bytes of output per chunk that a worker can compress for another
+static const size_t encode_chunk = size_t(4) << 20;
 
-		if (pass == 2){
-			if(buffer[0] == '@') continue;
-			strcpy(line, buffer);
-		} else if (pass == 3){
-			strcpy(sam_cur, buffer);
+// Compress the sorted records of one output part into buffers of their own,
+//    as a job cut into chunks so that idle workers can help, and append them
+//    to compressed in order.  Given an index, each chunk is indexed on its own
+//    and appended to it where the chunk lands in compressed.
+static void encodeParallel(const ThreadParam& threadParam,
+	size_t num_chunks,
+	const std::function<void(size_t, BgzfWriter&, BamIndexBuilder*)>& encode_chunk_at,
+	size_t task_memory,
+	std::vector<char>& compressed,
+	BamIndexBuilder* index) {
+	std::vector<std::vector<char> > parts(num_chunks);
+	std::vector<BamIndexBuilder> indexes(index != nullptr ? num_chunks : 0, BamIndexBuilder(index != nullptr ? index->depth() : 5));
+	TaskJob job(num_chunks, task_memory, [&](size_t chunk) {
+		BgzfWriter writer((int)opt_compression);
+		writer.open(parts[chunk]);
+		encode_chunk_at(chunk, writer, index != nullptr ? &indexes[chunk] : nullptr);
+		finish_block(writer, parts[chunk], index != nullptr ? &indexes[chunk] : nullptr, true);
+	});
+	threadParam.queue->post(&job);
+	job.help(nullptr);
+	threadParam.queue->retire(&job);
+	job.wait();
+	for(size_t i = 0; i < parts.size(); i++) {
+		if(index != nullptr) {
+			index->append(indexes[i], compressed.size());
+			indexes[i] = BamIndexBuilder(index->depth());
 		}
+		compressed.insert(compressed.end(), parts[i].begin(), parts[i].end());
+		std::vector<char>().swap(parts[i]);
+	}
+}
 
-		// Is the current line header?
-		bool header = (buffer[0] == '@');
-		// Is the current line sequence info?
-		bool sequence = false;
-		if(header && pass == 1) {
-			headers.push_back(buffer);
-		} else if (pass == 1){
-			strcpy(line, buffer);
-			if(table->size() == 0) {
-				*table_size = (size_sofar + interval - 1) / interval + 1;
-				table->resize(*table_size);
-				table->reserve(*table_size + 10); // Added 10 here to keep from reallocating memory if the table grows due to unaligned reads
-				for(size_t i = 0; i < table->size(); i++) {
-					(*table)[i].num_char = 0;
-	  				(*table)[i].num_lines = 0;
-					}
-				};
-	 		}
-
-		// Split and parse fields
-		int field_num = 0;
-		char* pch_next = nullptr;
-		char* pch = strtok_r(buffer, "\t", &pch_next);
-		char* contig_name = nullptr;
-		while(pch != nullptr) {
-			if(header && pass == 1) {
-				if(field_num == 0) {
-					sequence = (strcmp(pch, "@SQ") == 0);
-				}
-				if(sequence) {
-					if(field_num == 1) { // e.g. SN:14
-						if(strlen(pch) <= 3) {
-							throw std::runtime_error("");
-						}
-					contig_name = pch + 3;
-					contig2pos.add(contig_name, size_sofar);
-					} else if(field_num == 2) { // e.g. LN:107043718
-						if(strlen(pch) <= 3) {
-							throw std::runtime_error("");
-						}
-						char* end;
-						size_t contig_len = strtol(pch + 3, &end, 10);
-						size_sofar += contig_len;
-						break;
-					}
-				}
-			} else {
-				if(field_num == 2) { // chromosome or contig
-					contig_name = pch;
-				} else if(field_num == 3 && pass == 1) { // position
-					if(contig_name[0] == '*') {
-						if(((*table)[table->size() - 1].num_char + (strlen(line) + 1)) > opt_memory_per_thread){
-							table_records tbl;
-							tbl.num_char = 0;
-							tbl.num_lines = 0;
-							table->push_back(tbl);
-						}
-						(*table)[table->size() - 1].num_char += (strlen(line) + 1);
-						(*table)[table->size() - 1].num_lines++;
-					} else {
-						size_t pos = contig2pos[contig_name] + strtol(pch, nullptr, 10);
-						(*table)[(pos / interval)].num_char += (strlen(line) + 1);
-						(*table)[(pos / interval)].num_lines++;
-					}
-					break;
-				} else if(field_num == 3 && pass == 2) { // position
-					if(contig_name[0] == '*') {
-						if((*table)[*table_size - 1 + unalign_itr].num_lines == 0){
-							unalign_itr++;
-						}
-						vec_pipes[*aligned_file_num + unalign_itr] << line;
-						(*table)[*table_size - 1 + unalign_itr].num_lines--;
-					} else {
-						size_t pos = contig2pos[contig_name] + strtol(pch, nullptr, 10);
-						vec_pipes[(*table)[(pos / interval)].num_char] << line;
-					}
-					break;
-				} else if(field_num == 3 && pass == 3) { // position
-					SamRecord samRecord;
-					samRecord.read_id = samRecords->size();
-					if(contig_name[0] == '*') {
-						samRecord.pos = std::numeric_limits<size_t>::max();
-					} else {
-						samRecord.pos = contig2pos[contig_name] + strtol(pch, nullptr, 10);
-					}
-					samRecord.line = sam_cur;
-					sam_cur += (strlen(sam_cur) + 1);
-					samRecords->push_back(samRecord);
-					break;
-				}
-			}
-			pch = strtok_r(pch_next, "\t", &pch_next);
-			field_num++;
+// Compress sorted records into out, which writes into compressed.  A block
+//    with several chunks of output is compressed by encodeParallel.
+static void encodeRecords(const ThreadParam& threadParam,
+	const std::vector<SamRecord>& samRecords,
+	BgzfWriter& out,
+	std::vector<char>& compressed,
+	BamIndexBuilder* index) {
+	size_t total = 0;
+	for(size_t i = 0; i < samRecords.size(); i++) {
+		total += bam_rec_size(samRecords[i].line);
+	}
+	size_t num_chunks = total / encode_chunk;
+	if(num_chunks < 2) {
+		for(size_t i = 0; i < samRecords.size(); i++) {
+			write_record(out, samRecords[i].line, index);
 		}
+		return;
 	}
-};
+	// Chunks of about equal sizes, cut between records
+	std::vector<size_t> starts(1, 0);
+	size_t sofar = 0;
+	for(size_t i = 0; i < samRecords.size(); i++) {
+		if(starts.size() < num_chunks && sofar >= total / num_chunks * starts.size()) starts.push_back(i);
+		sofar += bam_rec_size(samRecords[i].line);
+	}
+	starts.push_back(samRecords.size());
+	finish_block(out, compressed, index, false);
+	encodeParallel(threadParam, starts.size() - 1, [&](size_t chunk, BgzfWriter& writer, BamIndexBuilder* chunk_index) {
+		for(size_t i = starts[chunk]; i < starts[chunk + 1]; i++) {
+			write_record(writer, samRecords[i].line, chunk_index);
+		}
+	}, 0, compressed, index);
+}
 
-void thread_worker(void* vp) {
-  const ThreadParam& threadParam = *(ThreadParam*)vp;
+// Empty a record vector kept across blocks for lines records, dropping its
+//    memory when it is more than twice as large
+static void recycle_records(std::vector<SamRecord>& samRecords, size_t lines) {
+	samRecords.clear();
+	if(samRecords.capacity() / 2 > lines) std::vector<SamRecord>().swap(samRecords);
+	samRecords.reserve(lines);
+}
+
+static void sort_blocks(const ThreadParam& threadParam) {
   Contig2Pos& contig2pos = *threadParam.contig2pos;
   std::vector<std::string>& headers = *threadParam.headers;
   size_t thread_id = threadParam.thread_id;
   std::vector<fileLines>& arrFileLines = *threadParam.file_lines;
-    
-  char* sam = new char[opt_memory_per_thread];
-  
-  while(*threadParam.next_block < threadParam.num_block) {
-    //
-    size_t cur_block = threadParam.num_block;
+  BamHeader* bam_header = threadParam.bam_header;
+  bool native = (bam_header != nullptr);
+
+  // A pinned worker stays on its node, where the arenas and record indexes it
+  //    allocates are first touched and so placed
+  if(threadParam.cpu >= 0 && !pin_thread(threadParam.cpu) && opt_verbose) {
     thread_mutex.lock();
-    cur_block = *threadParam.next_block;
-    *threadParam.next_block += 1;
+    std::cerr << "Thread #" << thread_id << " could not be pinned to CPU " << threadParam.cpu << "." << std::endl;
+    thread_mutex.unlock();
+  }
+
+  // The arena and the record vector are reused from one block to the next,
+  //    but not kept while the worker waits for blocks, outside the budget
+  Arena arena;
+  std::vector<SamRecord> samRecords;
+  while(true) {
+    if(!threadParam.queue->has_ready()) {
+      arena.release();
+      std::vector<SamRecord>().swap(samRecords);
+    }
+    double wait_start = RunStats::now();
+    size_t cur_block = threadParam.queue->pop(threadParam.memory);
+    if(cur_block >= threadParam.num_block) {
+      run_stats.add_wait(thread_id, RunStats::now() - wait_start);
+      break;
+    }
+    BlockStats stats;
+    stats.block = cur_block;
+    stats.thread = thread_id;
+    stats.wait = RunStats::now() - wait_start;
 
     if(opt_verbose) {
+      thread_mutex.lock();
       std::cerr << "Thread #" << thread_id << " is processing block #" << cur_block << "." << std::endl;
+      thread_mutex.unlock();
     }
-    
-    thread_mutex.unlock();
-    if(cur_block >= threadParam.num_block) break;
 
-    std::string in_fname = threadParam.fname_base + ".tmp." + std::to_string(cur_block);
-    std::string cmd = "cat " + in_fname;
+    std::string in_fname = tmp_fname("", cur_block);
+    std::string out_fname = tmp_fname("sorted.", cur_block);
+    std::string cmd;
+    // Native blocks are compressed in memory and handed to the output writer
+    std::vector<char> compressed;
+    BgzfWriter out((int)opt_compression);
+    if(native) out.open(compressed);
+    BamIndexBuilder* index = (threadParam.part_indexes != nullptr ? &(*threadParam.part_indexes)[cur_block].index : nullptr);
 
-    // CB todo get bucket sort going here
-    if(!arrFileLines[cur_block].bypass){
-    	std::vector<SamRecord> samRecords;
-    	samRecords.reserve(arrFileLines[cur_block].numLines);
-    	{
-    		Timer t(std::cerr, "\tThread #0 reading SAM", opt_verbose && thread_id == 0);
-
-    		// Read SAM file
-    	    int pass = 3;
-    	    fieldSplitter(pass,
-    	    		nullptr,
-    	    		nullptr,
-    	    		headers,
-    	    		contig2pos,
-    	    		cmd,
-    	    		nullptr,
-    	    		nullptr,
-    	    		&samRecords,
-    	    		sam);
-    	}
+    // The block's arena is sized to its records and, with the rest of its
+    //    footprint, held against the memory budget until the block is written.
+    //    Regions are read in pieces, which take half of a thread's share, and
+    //    so are blocks larger than a thread's share: aligned blocks by
+    //    position, and blocks of key orders by keys sampled from them.
+    const fileLines& block = arrFileLines[cur_block];
+    bool split = (!block.region && !block.bypass &&
+    		block_footprint(block.numBytes, block.numLines) > opt_memory_per_thread);
+    size_t sam_size = (block.region ? opt_memory_per_thread / 2 : (split || block.copy ? 0 : block.numBytes));
+    size_t footprint = block_footprint(block.numBytes, block.numLines);
+    if(block.region) {
+    	footprint = opt_memory_per_thread;
+    } else if(split) {
+    	footprint = opt_memory_per_thread + (block_footprint(block.numBytes, 0) - block.numBytes);
+    }
+    // An arena kept from an earlier block may be larger than this one needs
+    if(!arena.fits(sam_size)) arena.release();
+    if(arena.capacity() > sam_size) footprint += arena.capacity() - sam_size;
+    BudgetShare reserved(*threadParam.memory, footprint);
+    char* sam = arena.reserve(sam_size);
 
-    	remove(in_fname.c_str()); // Remove the input file
+    // Hand native output over to the writer, and give the block's memory back
+    auto hand_over = [&]() {
+    	if(native) {
+    		stats.bytes_out = compressed.size();
+    		if(threadParam.part_indexes != nullptr) (*threadParam.part_indexes)[cur_block].size = compressed.size();
+    		Timer t(std::cerr, "", false, &stats.write);
+    		threadParam.output->put(cur_block + 1, compressed);
+    	}
+    	reserved.release();
+    	run_stats.add_block(stats);
+    	threadParam.queue->finish();
+    };
+    stats.kind = (block.copy ? "copy" : (block.region ? "region" : (block.bypass ? "unaligned" :
+    		(opt_sort.order != SORT_COORDINATE ? "keyed" : "aligned"))));
+    stats.records = (block.copy ? block.copyLines : block.numLines);
+    stats.bytes_in = block.numBytes;
 
-    	if(opt_verbose && thread_id == 0) {
-    		#if 0
-    		std::cout << "Number of sam records: " << samRecords.size() << std::endl;
-    		// Show the first 10 entries
-    		for(size_t i = 0; i < std::min<size_t>(10, samRecords.size()); i++) {
-    			const SamRecord& samRecord = samRecords[i];
-    			std::cout << "ReadID: " << samRecord.read_id << " Pos: " << samRecord.pos << "\t" << samRecord.line;
-    		}
-    		#endif
-    		}
-    	// Sort
+    if(block.copy) {
+    	Timer t(std::cerr, "\tCopying unmapped reads: ", opt_verbose && thread_id == 0, &stats.encode);
+    	copyRawBlocks(threadParam.fname_base, block, out, compressed);
+    	if(index != nullptr) index->add_no_coor(block.copyLines);
+    	stats.bytes_in = block.end - (block.voffset >> 16);
+    	hand_over();
+    	continue;
+    }
+    if(block.region) {
+    	Timer t(std::cerr, "\tThread #0 sorting region", opt_verbose && thread_id == 0);
+    	recycle_records(samRecords, block.numLines);
+    	stats.records = 0;
+    	sortRegionBlock(threadParam, block, sam, sam_size, samRecords, out, index, stats);
     	{
-    		Timer t(std::cerr, "\tThread #0 sorting", opt_verbose && thread_id == 0);
-    		std::sort(samRecords.begin(), samRecords.end(), SamRecord_cmp());
+    		Timer t(std::cerr, "", false, &stats.encode);
+    		finish_block(out, compressed, index, true);
     	}
-    	if(opt_verbose && thread_id == 0) {
-    		#if 0
-    		// Show the first 10 entries
-    		std::cout << std::endl << std::endl;
-    		std::cout << "After sorting:" << std::endl;
-    		for(size_t i = 0; i < std::min<size_t>(10, samRecords.size()); i++) {
-    			const SamRecord& samRecord = samRecords[i];
-    			std::cout << "ReadID: " << samRecord.read_id << " Pos: " << samRecord.pos << "\t" << samRecord.line;
+    	hand_over();
+    	continue;
+    }
+
+    // CB todo get bucket sort going here
+    if(!arrFileLines[cur_block].bypass){
+    	std::vector<fileLines> pieces(1, block);
+    	std::vector<std::string> piece_fnames(1, in_fname);
+    	DupZones piece_zones;
+    	const DupZones* mark_zones = nullptr;
+    	if(split) {
+    		Timer t(std::cerr, "\tThread #0 splitting a large block", opt_verbose && thread_id == 0, &stats.load);
+    		pieces.clear();
+    		piece_fnames.clear();
+    		if(opt_sort.order == SORT_COORDINATE) {
+    			splitLargeBlock(in_fname, block, native, contig2pos, *threadParam.ref_offsets, pieces, piece_fnames, threadParam.markdup, piece_zones);
+    			mark_zones = &piece_zones;
+    		} else {
+    			splitKeyedBlock(in_fname, pieces, piece_fnames);
     		}
-    		#endif
+    		remove(in_fname.c_str());
+    		stats.pieces = pieces.size();
+    		if(opt_verbose) {
+    			thread_mutex.lock();
+    			std::cerr << "\t\tBlock #" << cur_block << " is sorted in " << pieces.size() << " pieces." << std::endl;
+    			thread_mutex.unlock();
     		}
-    	// Write BAM file aligned
-    	{
-    		Timer t(std::cerr, "\tThread #0 writing into BAM", opt_verbose && thread_id == 0);
-    		cmd = (opt_sambamba ? "sambamba" : "samtools");
-    		cmd += " view ";
-    		if(opt_sambamba) {
-    			cmd += " -f bam -S /dev/stdin -o ";
-    		} else {
-    			cmd += " -bS - > ";
+    	}
+    	// Native pieces are independent parts of the output, sorted as a job,
+    	//    whose time is counted as sorting
+    	if(native && pieces.size() > 1) {
+    		Timer t(std::cerr, "", false, &stats.sort);
+    		std::vector<size_t> duplicates(pieces.size(), 0);
+    		encodeParallel(threadParam, pieces.size(), [&](size_t piece, BgzfWriter& writer, BamIndexBuilder* piece_index) {
+    			Arena piece_arena;
+    			std::vector<SamRecord> samRecords;
+    			samRecords.reserve(pieces[piece].numLines);
+    			bamBlockLoad(piece_fnames[piece], *threadParam.ref_offsets, samRecords, piece_arena.reserve(pieces[piece].numBytes), pieces[piece].numBytes);
+    			remove(piece_fnames[piece].c_str());
+    			sortRecords(threadParam, samRecords);
+    			if(threadParam.markdup != nullptr) duplicates[piece] = threadParam.markdup->mark(samRecords, *threadParam.dup_zones, mark_zones);
+    			for(size_t i = 0; i < samRecords.size(); i++) {
+    				write_record(writer, samRecords[i].line, piece_index);
+    			}
+    		}, opt_memory_per_thread, compressed, index);
+    		for(size_t i = 0; i < duplicates.size(); i++) {
+    			stats.duplicates += duplicates[i];
     		}
-    		cmd = cmd + threadParam.fname_base + ".tmp.sorted." + std::to_string(cur_block);
-    		std::shared_ptr<FILE> pipe2(popen(cmd.c_str(), "w"), pclose);
+    		pieces.clear();
+    	}
+    	std::shared_ptr<FILE> pipe2;
+    	if(!native) {
+    		cmd = block_writer_cmd(out_fname);
+    		pipe2.reset(popen(cmd.c_str(), "w"), pclose);
     		if(!pipe2) throw std::runtime_error("popen() failed!");
     		for(size_t i = 0; i < headers.size(); i++) {
     			fputs(headers[i].c_str(), pipe2.get());
     		}
-    		for(size_t i = 0; i < samRecords.size(); i++) {
-    			const SamRecord& samRecord = samRecords[i];
-    			fputs(samRecord.line, pipe2.get());
-    		}
     	}
+    	for(size_t piece = 0; piece < pieces.size(); piece++) {
+    		if(pieces[piece].numBytes > sam_size) {
+    			sam_size = pieces[piece].numBytes;
+    			sam = arena.reserve(sam_size);
+    		}
+    		recycle_records(samRecords, pieces[piece].numLines);
+    		{
+    			Timer t(std::cerr, "\tThread #0 reading SAM", opt_verbose && thread_id == 0, &stats.load);
+
+    			// Read SAM file
+    		    if(native) {
+    		    	bamBlockLoad(piece_fnames[piece], *threadParam.ref_offsets, samRecords, sam, sam_size);
+    		    } else {
+    		    	textBlockLoad(piece_fnames[piece], contig2pos, samRecords, sam, sam_size);
+    		    }
+    		}
 
+    		remove(piece_fnames[piece].c_str()); // Remove the input file
+
+    		if(opt_verbose && thread_id == 0) {
+    			#if 0
+    			std::cout << "Number of sam records: " << samRecords.size() << std::endl;
+    			// Show the first 10 entries
+    			for(size_t i = 0; i < std::min<size_t>(10, samRecords.size()); i++) {
+    				const SamRecord& samRecord = samRecords[i];
+    				std::cout << "ReadID: " << samRecord.read_id << " Pos: " << samRecord.pos << "\t" << samRecord.line;
+    			}
+    			#endif
+    			}
+    		// Sort
+    		{
+    			Timer t(std::cerr, "\tThread #0 sorting", opt_verbose && thread_id == 0, &stats.sort);
+    			sortRecords(threadParam, samRecords);
+    			// Sets of duplicates are marked before the block is compressed
+    			if(threadParam.markdup != nullptr) stats.duplicates += threadParam.markdup->mark(samRecords, *threadParam.dup_zones, mark_zones);
+    		}
+    		if(opt_verbose && thread_id == 0) {
+    			#if 0
+    			// Show the first 10 entries
+    			std::cout << std::endl << std::endl;
+    			std::cout << "After sorting:" << std::endl;
+    			for(size_t i = 0; i < std::min<size_t>(10, samRecords.size()); i++) {
+    				const SamRecord& samRecord = samRecords[i];
+    				std::cout << "ReadID: " << samRecord.read_id << " Pos: " << samRecord.pos << "\t" << samRecord.line;
+    			}
+    			#endif
+    			}
+    		// Write BAM file aligned
+    		{
+    			Timer t(std::cerr, "\tThread #0 writing into BAM", opt_verbose && thread_id == 0, &stats.encode);
+    			if(native) {
+    				// Records are already binary; compress them in this thread
+    				//    and in idle ones
+    				encodeRecords(threadParam, samRecords, out, compressed, index);
+    			} else {
+    				for(size_t i = 0; i < samRecords.size(); i++) {
+    					const SamRecord& samRecord = samRecords[i];
+    					size_t length = text_line_length(samRecord.line);
+    					fwrite(samRecord.line, 1, length, pipe2.get());
+    					stats.bytes_out += length;
+    				}
+    			}
+    		}
+    	}
+    	// samtools finishes the text block once its pipe is closed
+    	Timer t(std::cerr, "", false, &stats.encode);
+    	if(native) {
+    		finish_block(out, compressed, index, true);
+    	} else {
+    		pipe2.reset();
+    	}
     } else if(arrFileLines[cur_block].bypass)
     // Write BAM file unaligned
     {
-    	{
+    	if(native) {
     		Timer t(std::cerr, "\tWriting unaligned reads: ", opt_verbose && thread_id == 0);
-    	    std::shared_ptr<FILE> pipe(popen(cmd.c_str(), "r"), pclose);
-    	    if(!pipe) throw std::runtime_error("popen() failed!");
-    	    char buffer[2048];
-
-    	    cmd = (opt_sambamba ? "sambamba" : "samtools");
-    		cmd += " view ";
-    		if(opt_sambamba) {
-    			cmd += " -f bam -S /dev/stdin -o ";
-    		} else {
-    			cmd += " -bS - > ";
+    		// Unaligned records stay in input order; only their ordinals are dropped
+    		size_t length;
+    		{
+    			Timer t(std::cerr, "", false, &stats.load);
+    			length = load_native_block_file(in_fname, sam, sam_size);
+    		}
+    		Timer t_encode(std::cerr, "", false, &stats.encode);
+    		for(size_t i = 0; i + sizeof(uint64_t) < length; i += block_record_size(sam + i + sizeof(uint64_t))) {
+    			write_record(out, sam + i + sizeof(uint64_t), index);
     		}
-    		cmd = cmd + threadParam.fname_base + ".tmp.sorted." + std::to_string(cur_block);
+    		finish_block(out, compressed, index, true);
+    	} else {
+    		Timer t(std::cerr, "\tWriting unaligned reads: ", opt_verbose && thread_id == 0);
+    		size_t length;
+    		{
+    			Timer t(std::cerr, "", false, &stats.load);
+    			length = load_block_file(in_fname, sam, sam_size);
+    		}
+    		Timer t_encode(std::cerr, "", false, &stats.encode);
+    		stats.bytes_out = length;
+
+    		cmd = block_writer_cmd(out_fname);
     		std::shared_ptr<FILE> pipe2(popen(cmd.c_str(), "w"), pclose);
     		if(!pipe2) throw std::runtime_error("popen() failed!");
     		for(size_t i = 0; i < headers.size(); i++) {
     			fputs(headers[i].c_str(), pipe2.get());
     		}
-    		while(!feof(pipe.get())) {
-    		   	buffer[0] = 0;
-    		   	if(fgets(buffer, sizeof(buffer), pipe.get()) == nullptr) break;
-    		   	if(strlen(buffer) == 0) continue;
-    			fputs(buffer, pipe2.get());
-    		}
+    		fwrite(sam, 1, length, pipe2.get());
     	}
     	remove(in_fname.c_str());
     }
+    hand_over();
   }
-  delete []sam;
 }
 
-int fast_samtools_sort(const std::string& in_fname, const std::string& out_fname) {
+// Entry of a worker thread: the first error stops the queue, and is rethrown
+//    once the workers are joined
+void thread_worker(void* vp) {
+  const ThreadParam& threadParam = *(ThreadParam*)vp;
+  try {
+    sort_blocks(threadParam);
+  } catch(...) {
+    threadParam.queue->stop(std::current_exception());
+  }
+}
+
+// Interleaving of the directories of the temporary files, each as often as its
+//    weight: one, or its free space in proportion to the others'.  Each slot
+//    goes to the directory that is most behind its share so far (smooth
+//    weighted round-robin), so that consecutive blocks change directories.
+static std::vector<size_t> tmp_dir_slots(const std::vector<std::string>& dirs, bool by_space) {
+  const size_t num_slots = (by_space ? 64 : std::max<size_t>(1, dirs.size()));
+  std::vector<double> weights(std::max<size_t>(1, dirs.size()), 1.0);
+  for(size_t i = 0; by_space && i < dirs.size(); i++) {
+    struct statvfs vfs;
+    if(statvfs(dirs[i].c_str(), &vfs) == 0) weights[i] = std::max(1.0, (double)vfs.f_bavail * vfs.f_frsize);
+    if(opt_verbose) {
+      std::cerr << "\t" << dirs[i] << ": " << (uint64_t)(weights[i] / (1 << 20)) << " MB free" << std::endl;
+    }
+  }
+  double total = 0;
+  for(size_t i = 0; i < weights.size(); i++) total += weights[i];
+  std::vector<double> credit(weights.size(), 0.0);
+  std::vector<size_t> slots;
+  for(size_t n = 0; n < num_slots; n++) {
+    size_t best = 0;
+    for(size_t i = 0; i < weights.size(); i++) {
+      credit[i] += weights[i];
+      if(credit[i] > credit[best]) best = i;
+    }
+    credit[best] -= total;
+    slots.push_back(best);
+  }
+  return slots;
+}
+
+// Copy the standard input into fname
+static void spool_stdin(const std::string& fname) {
+  FILE* fp = fopen(fname.c_str(), "wb");
+  if(fp == nullptr) throw std::runtime_error("cannot open " + fname);
+  char buffer[1 << 16];
+  size_t count;
+  bool ok = true;
+  while(ok && (count = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+    ok = (fwrite(buffer, 1, count, fp) == count);
+  }
+  ok = !ferror(stdin) && ok;
+  ok = (fclose(fp) == 0) && ok;
+  if(!ok) throw std::runtime_error("cannot copy the standard input into " + fname);
+}
+
+int fast_samtools_sort(std::string in_fname, const std::string& out_fname) {
   std::vector<std::string> headers;
   Contig2Pos contig2pos;
+  // BAM input is decoded natively unless a samtools/sambamba pipe is requested
+  bool native = !opt_sambamba && !opt_samtools_view && bgzf_is_bam(in_fname);
+  // The standard input is read once, by the native single pass; the other
+  //    plans read their input more than once, so they get a copy of it
+  bool stream = (in_fname == "-");
+  std::string spool_fname;
+  if(stream && !native) {
+    Timer t(std::cerr, "\tCopying the standard input", opt_verbose);
+    RunStats::Phase phase(run_stats, "spool");
+    spool_fname = tmp_fname("in.", 0);
+    spool_stdin(spool_fname);
+    in_fname = spool_fname;
+    stream = false;
+  }
+  BamHeader bam_header;
+  std::vector<size_t> ref_offsets;
   std::vector<table_records> table;
   size_t table_size = 0;
   size_t aligned_file_num = 0;
@@ -429,100 +2777,193 @@ int fast_samtools_sort(const std::string& in_fname, const std::string& out_fname
   cmd += std::to_string(opt_threads) + " ";
   cmd += in_fname;
 
-  int pass = 1;
-  // Read BAM file
-  // First pass
-  {
-    Timer t(std::cerr, "\t1st pass) Reading BAM/SAM file: " + cmd, opt_verbose);
-
-    fieldSplitter(pass,
-    		&table,
-    		&table_size,
-    		headers,
-    		contig2pos,
-    		cmd,
-    		&aligned_file_num
-    		);
-  }  
-
-  // Determine number of files and lines per file
-  size_t sam_size = 0, file_num = 1;
-  fileLines lines_per_file;
   std::vector<fileLines> arrFileLines;
-  assert(table_size != 0);
-  for(size_t itr = 0; itr < (table_size - 1); itr++) {
-    assert(sam_size <= opt_memory_per_thread);
-    if(sam_size + table[itr].num_char > opt_memory_per_thread) {
-      arrFileLines.push_back(lines_per_file);
-      file_num++;
-      sam_size = table[itr].num_char;
-      lines_per_file.numLines = table[itr].num_lines;
-    } else {
-      sam_size += table[itr].num_char;
-      lines_per_file.numLines += table[itr].num_lines;
-    }
-    table[itr].num_char = file_num - 1;
-  }
-  arrFileLines.push_back(lines_per_file);
-  aligned_file_num = file_num;
-  file_num += (table.size() - (table_size - 1));
-  for(size_t itr = (table_size - 1); itr < table.size(); itr++){
-	  lines_per_file.numLines = table[itr].num_lines;
-	  lines_per_file.bypass = 1;
-	  arrFileLines.push_back(lines_per_file);
-  }
-
-  // Second pass
-  {
-    Timer t(std::cerr, "\t2nd pass) Reading BAM/SAM file: " + cmd, opt_verbose);
-    std::ofstream vec_pipes[file_num];
-    for(size_t i = 0; i < file_num; i++) {
-      std::string fname = in_fname + ".tmp." + std::to_string(i);
-      vec_pipes[i].open(fname);
-    }
+  size_t file_num = 0;
 
-    pass = 2;
-    fieldSplitter(pass,
-    		&table,
-    		&table_size,
-    		headers,
-    		contig2pos,
-    		cmd,
-    		&aligned_file_num,
-    		vec_pipes);
+  // Native output is written in-process as blocks finish, in block order;
+  //    compressed blocks waiting for their turn take up to a quarter of the
+  //    memory budget, and spill to disk beyond that.  The header goes first.
+  BgzfOrderedWriter output(opt_memory / 4);
+  // The rest is for the blocks being sorted, which are planned so that each
+  //    thread can sort one at a time
+  size_t block_memory = (native ? opt_memory - opt_memory / 4 : opt_memory);
+  opt_memory_per_thread = block_memory / opt_threads;
+  MemoryBudget memory(block_memory);
 
+  // Workers sort blocks as they are queued, so they are started as soon as
+  //    the blocks are planned
+  BlockQueue queue;
+  std::vector<tthread::thread*> threads;
+  std::vector<ThreadParam> threadParams(opt_threads);
+  std::shared_ptr<Timer> sort_timer;
+  std::shared_ptr<RunStats::Phase> sort_phase; // overlaps the 2nd pass
+  // With --write-index, workers index their parts of the output as they
+  //    compress them, and the parts are merged once they are all written
+  std::vector<PartIndex> part_indexes;
+  uint64_t header_size = 0;
+  // With --markdup, the sets of duplicates that may cross the boundaries
+  //    between blocks are gathered by the second pass
+  DupMarker markdup;
+  DupZones dup_zones;
+  // Should the planning fail while the workers sort, they are stopped and
+  //    joined before what they work with goes away
+  struct WorkerGuard {
+    BlockQueue& queue;
+    std::vector<tthread::thread*>& threads;
+    ~WorkerGuard() {
+      if(threads.empty()) return;
+      queue.stop();
+      for(size_t i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+      }
+    }
+  } worker_guard = { queue, threads };
+  auto start_workers = [&]() {
+    if(native) {
+      if(!output.open(out_fname == "-" ? out_fname : part_fname(out_fname), [](size_t part) { return tmp_fname("sorted.", part); })) throw std::runtime_error("cannot open " + out_fname);
+      std::vector<char> compressed;
+      BgzfWriter header_out((int)opt_compression);
+      header_out.open(compressed);
+      if(opt_sort.order == SORT_QUERYNAME) {
+        bam_header.text = header_set_order(bam_header.text, "queryname", "queryname:natural");
+      } else if(opt_sort.order == SORT_TAG) {
+        bam_header.text = header_set_order(bam_header.text, "unknown", "");
+      }
+      std::string header_bytes = bam_header_bytes(bam_header);
+      header_out.write(header_bytes.data(), header_bytes.length());
+      header_out.close();
+      header_size = compressed.size();
+      output.put(0, compressed);
+      if(opt_write_index) part_indexes.assign(file_num, PartIndex(BamIndexBuilder::depth_for(bam_header.ref_lens)));
+    }
+    sort_timer.reset(new Timer(std::cerr, "\tSorting SAM blocks: ", opt_verbose));
+    sort_phase.reset(new RunStats::Phase(run_stats, "sort"));
+    std::vector<size_t> block_sizes(file_num);
     for(size_t i = 0; i < file_num; i++) {
-      vec_pipes[i].close();
+      block_sizes[i] = block_footprint(arrFileLines[i].numBytes, arrFileLines[i].numLines);
     }
-  }
-
-  // Sort blocks using multiple threads
-  size_t next_block = 0; // will need to change this number to reflect the new unaligned files
-  {
-    Timer t(std::cerr, "\tSorting SAM blocks: ", opt_verbose);
-    std::vector<tthread::thread*> threads(opt_threads);
-    std::vector<ThreadParam> threadParams(opt_threads);
+    queue.open(block_sizes, 2 * opt_threads);
+    std::vector<int> cpus;
+    if(opt_pin_threads) cpus = worker_cpus();
     for(size_t i = 0; i < opt_threads; i++) {
       threadParams[i].fname_base  = in_fname;
-      threadParams[i].next_block  = &next_block;
-      threadParams[i].num_block   = file_num; // Make this aligned_file_num
+      threadParams[i].queue       = &queue;
+      threadParams[i].memory      = &memory;
+      threadParams[i].num_block   = file_num;
       threadParams[i].contig2pos  = &contig2pos;
       threadParams[i].headers     = &headers;
       threadParams[i].thread_id   = i;
       threadParams[i].num_threads = opt_threads;
       threadParams[i].file_lines = &arrFileLines;
-      threads[i] = new tthread::thread(thread_worker, (void*)&threadParams[i]);
+      threadParams[i].bam_header  = native ? &bam_header : nullptr;
+      threadParams[i].ref_offsets = &ref_offsets;
+      threadParams[i].output      = native ? &output : nullptr;
+      threadParams[i].part_indexes = part_indexes.empty() ? nullptr : &part_indexes;
+      threadParams[i].markdup     = opt_markdup ? &markdup : nullptr;
+      threadParams[i].dup_zones   = &dup_zones;
+      threadParams[i].cpu         = (cpus.empty() ? -1 : cpus[i % cpus.size()]);
+      threads.push_back(new tthread::thread(thread_worker, (void*)&threadParams[i]));
     }
-    
-    for(size_t i = 0; i < opt_threads; i++) {
-      threads[i]->join();
+  };
+
+  if(opt_single_pass && !native && opt_verbose) {
+    std::cerr << "\tSingle-pass mode needs natively decoded BAM input; using two passes." << std::endl;
+  }
+  // Duplicate marking takes the reach of the records from the first pass
+  if(opt_single_pass && opt_markdup && opt_verbose) {
+    std::cerr << "\tDuplicate marking needs the first pass; using two passes." << std::endl;
+  }
+  // An index gives coordinate blocks only
+  bool keyed = (opt_sort.order != SORT_COORDINATE);
+  bool indexed = false;
+  if(native && opt_use_index && !keyed && !stream && !opt_markdup) {
+    RunStats::Phase phase(run_stats, "index plan");
+    indexed = bamIndexPlan(in_fname, bam_header, ref_offsets, arrFileLines);
+  }
+  if(indexed) {
+    file_num = arrFileLines.size();
+  } else if(((opt_single_pass && !opt_markdup) || stream) && native) {
+    Timer t(std::cerr, "\tSingle pass) Reading BAM file: " + in_fname, opt_verbose);
+    RunStats::Phase phase(run_stats, "single pass");
+    bamSinglePass(in_fname, bam_header, ref_offsets, arrFileLines);
+    file_num = arrFileLines.size();
+  } else if(native) {
+    // Sorting starts while the second pass is still splitting the input
+    bamParallelPasses(in_fname, bam_header, ref_offsets, arrFileLines, queue, opt_markdup ? &markdup : nullptr, dup_zones, [&]() {
+      file_num = arrFileLines.size();
+      start_workers();
+    });
+  } else {
+    int pass = 1;
+    // Read BAM file
+    // First pass
+    {
+      Timer t(std::cerr, "\t1st pass) Reading BAM/SAM file: " + cmd, opt_verbose);
+      RunStats::Phase phase(run_stats, "1st pass");
+      fieldSplitter(pass,
+    		  &table,
+    		  &table_size,
+    		  headers,
+    		  contig2pos,
+    		  cmd,
+    		  &aligned_file_num
+    		  );
+    }  
+
+    // Determine number of files and lines per file
+    assert(table_size != 0);
+    table_plan(table, 0, table_size - 1, arrFileLines);
+    aligned_file_num = arrFileLines.size();
+    for(size_t itr = (table_size - 1); itr < table.size(); itr++){
+      fileLines lines_per_file;
+      lines_per_file.numLines = table[itr].num_lines;
+      lines_per_file.numBytes = table[itr].num_char;
+      lines_per_file.bypass = 1;
+      arrFileLines.push_back(lines_per_file);
     }
-    
-    for(size_t i = 0; i < opt_threads; i++) {
-      delete threads[i];
+    file_num = arrFileLines.size();
+
+    // Second pass
+    {
+      Timer t(std::cerr, "\t2nd pass) Reading BAM/SAM file: " + cmd, opt_verbose);
+      RunStats::Phase phase(run_stats, "2nd pass");
+      // Lines are buffered per block within a sixteenth of the budget and
+      //    written out by a thread of their own
+      BucketWriter vec_pipes(file_num, [](size_t block) { return tmp_fname("", block); }, opt_memory / 16, opt_direct_io);
+
+      pass = 2;
+      fieldSplitter(pass,
+    		  &table,
+    		  &table_size,
+    		  headers,
+    		  contig2pos,
+    		  cmd,
+    		  &aligned_file_num,
+    		  &vec_pipes);
+      vec_pipes.close();
+    }
+
+  }
+
+  // Other plans have all their blocks ready at once
+  if(threads.empty()) {
+    start_workers();
+    for(size_t i = 0; i < file_num; i++) {
+      queue.push(i);
     }
   }
 
+  // Sort blocks using multiple threads
+  for(size_t i = 0; i < threads.size(); i++) {
+    threads[i]->join();
+    delete threads[i];
+  }
+  threads.clear();
+  if(queue.error()) std::rethrow_exception(queue.error());
+  sort_timer.reset();
+  sort_phase.reset();
+
   // DK -> CB
   // CB todo test implementation on large BAM
   // the number of unalined reads is usually very large, perhaps over hundreds of millions
@@ -531,26 +2972,53 @@ int fast_samtools_sort(const std::string& in_fname, const std::string& out_fname
   // CB: I think I got it. See Above in threadworker
 
 
+  if(native) {
+    RunStats::Phase phase(run_stats, "finish output");
+    output.close();
+    std::string index_fname;
+    if(opt_write_index) {
+      Timer t(std::cerr, "\tWriting the index: " + out_fname, opt_verbose);
+      BamIndexBuilder index(BamIndexBuilder::depth_for(bam_header.ref_lens));
+      uint64_t offset = header_size;
+      for(size_t i = 0; i < part_indexes.size(); i++) {
+        index.append(part_indexes[i].index, offset);
+        offset += part_indexes[i].size;
+        part_indexes[i].index = BamIndexBuilder(index.depth());
+      }
+      index_fname = out_fname + (index.csi() ? ".csi" : ".bai");
+      index.save(part_fname(index_fname), bam_header.ref_lens.size());
+    }
+    if(out_fname != "-") tmp_rename(part_fname(out_fname), out_fname);
+    if(index_fname != "") tmp_rename(part_fname(index_fname), index_fname);
+    return 0;
+  }
+
   // Use samtools's cat to concatenate BAM blocks
   //  Note: sambamba hasn't implemented "cat" function
   {
-    std::string cmd = "samtools cat -o " + out_fname;
+    std::string cat_fname = (out_fname == "-" ? out_fname : part_fname(out_fname));
+    std::string cmd = "samtools cat -o " + cat_fname;
     std::vector<std::string> block_fnames;
     for(size_t i = 0; i < file_num; i++) {
-      std::string block_fname = in_fname + ".tmp.sorted." + std::to_string(i);
+      std::string block_fname = tmp_fname("sorted.", i);
       block_fnames.push_back(block_fname);
       cmd += (" " + block_fname);
     }
     Timer t(std::cerr, "\tConcatenating BAM blocks: " + cmd, opt_verbose);
+    RunStats::Phase phase(run_stats, "concatenate");
     int return_value = system(cmd.c_str());
     if(return_value != 0) {
       std::cerr << "BAM concatenation failed." << "\n\t" << cmd << std::endl;
+      if(out_fname != "-") remove(cat_fname.c_str());
+    } else if(out_fname != "-") {
+      tmp_rename(cat_fname, out_fname);
     }
     // Remove block BAM files
     for(size_t i = 0; i < block_fnames.size(); i++) {
       remove(block_fnames[i].c_str());
     }
   }
+  if(spool_fname != "") remove(spool_fname.c_str());
 
   return 0;
 }
@@ -559,13 +3027,27 @@ void print_usage(std::ostream& out) {
   out << "fast-samtools-sort version " << FAST_SAMTOOLS_SORT_VERSION << " by Chris Bennett (Christopher.Bennett@UTSouthwestern.edu) and Daehwan Kim (infphilo@gmail.com)" << std::endl;
   std::string tool_name = "fast-samtools-sort";
   out << "Usage: " << std::endl
-      << "  " << tool_name << " [options] [in.bam]" << std::endl
+      << "  " << tool_name << " [options] [in.bam | -]" << std::endl
       << "Options:" << std::endl
-      << "  -l INT          Compression level from 0 (no compression, fastest) to 9 (highest compression, slowest) (Default: ?)" << std::endl
+      << "  -l INT          Compression level from 0 (no compression, fastest) to 9 (highest compression, slowest) (Default: 6)" << std::endl
       << "  -m INT[G/M/K]   Maximum memory in total, shared by threads (Default: ?G)" << std::endl
-      << "  -o STR          Output filename" << std::endl
+      << "  -o STR          Output filename, - for the standard output (Default: in.bam.sorted, or - for input -)" << std::endl
+      << "  -T/--tmpdir DIR[,DIR...]  Directories of the temporary files, taken in turn (Default: next to the input, or the current directory for input -)" << std::endl
+      << "  --tmpdir-by-space  Spread temporary files over the -T directories in proportion to their free space" << std::endl
+      << "  --direct-io     Write temporary blocks with O_DIRECT, past the page cache" << std::endl
       << "  -S/--SAM        Input File format is SAM (only needed if using Sambamba)" <<std::endl // CB Edit
       << "  -@/--threads    Number of threads (Default: 1)" << std::endl
+      << "  --samtools-view Decode BAM input through samtools view instead of natively" << std::endl
+      << "  --single-pass   Read BAM input once, bucketing by splitters sampled from the sort keys" << std::endl
+      << "  --no-index      Do not plan blocks from a .bai/.csi index of the input" << std::endl
+      << "  --tmp-compression INT  Compress native temporary blocks at zlib level INT (1 is fastest; Default: off)" << std::endl
+      << "  --histogram-interval INT  Resolution in bp of the position histogram blocks are planned from (Default: 1024)" << std::endl
+      << "  --pin-threads   Pin sorting threads to CPUs, spread over the NUMA nodes" << std::endl
+      << "  --stats-json STR  Write per-phase, per-thread and per-block counters of the run to STR as JSON" << std::endl
+      << "  -n              Sort by read name (natural order, as samtools sort -n) instead of coordinate" << std::endl
+      << "  -t TAG          Sort by the value of tag TAG, then by coordinate, or by name with -n" << std::endl
+      << "  --write-index   Index the output while sorting, into out.bam.bai (or .csi for long references)" << std::endl
+      << "  --markdup       Mark duplicates while sorting, as Picard MarkDuplicates or samtools markdup would" << std::endl
       << "  -v/--verbose    Verbose" << std::endl;
 }
 
@@ -576,17 +3058,20 @@ int main(int argc, char** argv) {
   }
 
   // Parse options
-  std::set<std::string> uint_options {"-l", "-@", "--threads"};
-  std::set<std::string> str_options  {"-m", "-o"};
+  std::set<std::string> uint_options {"-l", "-@", "--threads", "--tmp-compression", "--histogram-interval"};
+  std::set<std::string> str_options  {"-m", "-o", "-t", "-T", "--tmpdir", "--stats-json"};
   std::set<std::string> arg_needed_options = uint_options;
   arg_needed_options.insert(str_options.begin(), str_options.end());
   int curr_argc = 1;
   while(curr_argc < argc) {
-    if(curr_argc + 1 == argc) {
-      opt_infname = argv[curr_argc];
-      break;
-    }
     std::string option = argv[curr_argc];
+    // The input is the last argument, "-" for the standard input, or any
+    //    argument that is not an option
+    if(curr_argc + 1 == argc || option == "-" || option[0] != '-') {
+      opt_infname = option;
+      curr_argc++;
+      continue;
+    }
     std::string str_value = "";
     size_t uint_value = 0;
     if(arg_needed_options.find(option) != arg_needed_options.end()) {
@@ -626,6 +3111,49 @@ int main(int argc, char** argv) {
       opt_verbose = true;
     } else if(option == "--sambamba") {
       opt_sambamba = true;
+    } else if(option == "--samtools-view") {
+      opt_samtools_view = true;
+    } else if(option == "--single-pass") {
+      opt_single_pass = true;
+    } else if(option == "--no-index") {
+      opt_use_index = false;
+    } else if(option == "--tmp-compression") {
+      opt_tmp_compression = (int)std::min<size_t>(9, uint_value);
+    } else if(option == "--histogram-interval") {
+      opt_table_interval = std::max<size_t>(1, uint_value);
+    } else if(option == "-T" || option == "--tmpdir") {
+      for(size_t start = 0; start <= str_value.length(); ) {
+        size_t end = std::min(str_value.find(',', start), str_value.length());
+        if(end > start) opt_tmpdirs.push_back(str_value.substr(start, end - start));
+        start = end + 1;
+      }
+    } else if(option == "--tmpdir-by-space") {
+      opt_tmpdir_by_space = true;
+    } else if(option == "--direct-io") {
+      opt_direct_io = true;
+    } else if(option == "--stats-json") {
+      opt_stats_json = str_value;
+    } else if(option == "--pin-threads") {
+      opt_pin_threads = true;
+    } else if(option == "--write-index") {
+      opt_write_index = true;
+    } else if(option == "--markdup") {
+      opt_markdup = true;
+    } else if(option == "-n") {
+      if(opt_sort.order == SORT_TAG) {
+        opt_sort.then_name = true;
+      } else {
+        opt_sort.order = SORT_QUERYNAME;
+      }
+    } else if(option == "-t") {
+      if(str_value.length() != 2) {
+        std::cerr << "Error: option, -t, needs a two-character tag." << std::endl << std::endl;
+        return 0;
+      }
+      opt_sort.then_name = (opt_sort.order == SORT_QUERYNAME);
+      opt_sort.order = SORT_TAG;
+      opt_sort.tag[0] = str_value[0];
+      opt_sort.tag[1] = str_value[1];
     } else if(option == "-S" || option == "--SAM"){
     	opt_sam = true;
     } else {
@@ -638,17 +3166,74 @@ int main(int argc, char** argv) {
   opt_memory_per_thread = opt_memory / opt_threads;
 
   // Check if the input BAM file exists.
-  {
+  bool stream_in = (opt_infname == "-");
+  if(opt_infname == "") {
+    std::cerr << "Error: no input file; use - for the standard input." << std::endl;
+    return 0;
+  }
+  if(!stream_in) {
     std::ifstream f(opt_infname);
     if(!f.good()) {
       std::cerr << "Error: " << opt_infname << " does not exist." << std::endl;
       return 0;
     }
   }
-  // Update the output BAM file name if it is empty.
+  // Key orders are only read from BAM records decoded natively
+  if(opt_sort.order != SORT_COORDINATE) {
+    if(opt_sambamba || opt_samtools_view || !bgzf_is_bam(opt_infname)) {
+      std::cerr << "Error: -n and -t need BAM input decoded natively." << std::endl;
+      return 0;
+    }
+    record_overhead = keyed_record_overhead;
+  }
+  // The index is built from the virtual offsets of records compressed in-process
+  if(opt_write_index) {
+    if(opt_sort.order != SORT_COORDINATE) {
+      std::cerr << "Error: --write-index needs coordinate order." << std::endl;
+      return 0;
+    }
+    if(opt_sambamba || opt_samtools_view || !bgzf_is_bam(opt_infname)) {
+      std::cerr << "Error: --write-index needs BAM input decoded natively." << std::endl;
+      return 0;
+    }
+  }
+  // Duplicates are marked in native coordinate blocks, planned from two passes
+  if(opt_markdup) {
+    if(opt_sort.order != SORT_COORDINATE) {
+      std::cerr << "Error: --markdup needs coordinate order." << std::endl;
+      return 0;
+    }
+    if(opt_sambamba || opt_samtools_view || stream_in || !bgzf_is_bam(opt_infname)) {
+      std::cerr << "Error: --markdup needs a BAM input file decoded natively." << std::endl;
+      return 0;
+    }
+    record_overhead += 2 * sizeof(DupEntry);
+  }
+  // Update the output BAM file name if it is empty; a stream is sorted
+  //    into the standard output
   if(opt_outfname == "") {
-    opt_outfname = opt_infname + ".sorted";
+    opt_outfname = (stream_in ? "-" : opt_infname + ".sorted");
+  }
+  if(opt_write_index && opt_outfname == "-") {
+    std::cerr << "Error: --write-index needs an output file." << std::endl;
+    return 0;
+  }
+  // Temporary files go next to a named input, and otherwise into the --tmpdir
+  //    directories or the current directory, named after the process
+  if(opt_tmpdirs.empty() && !stream_in) {
+    tmp_prefixes.push_back(opt_infname + ".tmp.");
+  } else {
+    if(opt_tmpdirs.empty()) opt_tmpdirs.push_back(".");
+    for(size_t i = 0; i < opt_tmpdirs.size(); i++) {
+      struct stat st;
+      if(stat(opt_tmpdirs[i].c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        std::cerr << "Error: " << opt_tmpdirs[i] << " is not a directory." << std::endl;
+        return 0;
+      }
+      tmp_prefixes.push_back(opt_tmpdirs[i] + "/fast-samtools-sort." + std::to_string(getpid()) + ".tmp.");
+    }
   }
+  tmp_slots = tmp_dir_slots(opt_tmpdirs, opt_tmpdir_by_space);
   
   if(opt_verbose) {
     size_t out_memory = opt_memory;
@@ -677,10 +3262,48 @@ int main(int argc, char** argv) {
 	      << " -o " << opt_outfname << std::endl;
   }
 
+  // A failed sort leaves neither its temporary files nor a partial output,
+  //    and an earlier output of the name is kept
   {
     Timer t(std::cerr, "Overall:", opt_verbose);
-    fast_samtools_sort(opt_infname,
+    try {
+      fast_samtools_sort(opt_infname,
 		       opt_outfname);
+    } catch(const std::exception& e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      remove_tmp_files();
+      if(opt_outfname != "-") {
+        remove(part_fname(opt_outfname).c_str());
+        remove(part_fname(opt_outfname + ".bai").c_str());
+        remove(part_fname(opt_outfname + ".csi").c_str());
+      }
+      return 1;
+    }
+  }
+
+  if(opt_stats_json != "") {
+    std::vector<std::pair<std::string, std::string> > settings;
+    settings.push_back(std::make_pair("version", json_string(FAST_SAMTOOLS_SORT_VERSION)));
+    settings.push_back(std::make_pair("input", json_string(opt_infname)));
+    settings.push_back(std::make_pair("output", json_string(opt_outfname)));
+    settings.push_back(std::make_pair("threads", std::to_string(opt_threads)));
+    settings.push_back(std::make_pair("memory", std::to_string(opt_memory)));
+    settings.push_back(std::make_pair("memory_per_thread", std::to_string(opt_memory_per_thread)));
+    settings.push_back(std::make_pair("compression", std::to_string(opt_compression)));
+    std::string order = (opt_sort.order == SORT_COORDINATE ? "coordinate" : (opt_sort.order == SORT_QUERYNAME ? "queryname" : "tag"));
+    if(opt_sort.order == SORT_TAG) order += ":" + std::string(opt_sort.tag, 2) + (opt_sort.then_name ? ":queryname" : ":coordinate");
+    settings.push_back(std::make_pair("order", json_string(order)));
+    settings.push_back(std::make_pair("write_index", opt_write_index ? "true" : "false"));
+    settings.push_back(std::make_pair("markdup", opt_markdup ? "true" : "false"));
+    std::string tmpdirs;
+    for(size_t i = 0; i < tmp_prefixes.size(); i++) {
+      tmpdirs += (i > 0 ? ", " : "") + json_string(tmp_prefixes[i]);
+    }
+    settings.push_back(std::make_pair("tmp_prefixes", "[" + tmpdirs + "]"));
+    settings.push_back(std::make_pair("direct_io", opt_direct_io ? "true" : "false"));
+    if(!run_stats.write_json(opt_stats_json, settings)) {
+      std::cerr << "Error: cannot write " << opt_stats_json << "." << std::endl;
+    }
   }
 
   return 0;
@@ -0,0 +1,345 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include "sort_key.h"
+#include "markdup.h"
+
+static const uint16_t BAM_FDUP = 0x400;
+
+// Reference length of a CIGAR, and the clipping at its start and its end
+struct CigarSpan {
+  int64_t ref_len = 0;
+  int64_t lead = 0;
+  int64_t trail = 0;
+};
+
+static inline void cigar_span_add(CigarSpan& span, int op, int64_t len, bool& aligned) {
+  if(op == 4 || op == 5) { // S, H
+    (aligned ? span.trail : span.lead) += len;
+    return;
+  }
+  aligned = true;
+  span.trail = 0;
+  if(op == 0 || op == 2 || op == 3 || op == 7 || op == 8) span.ref_len += len; // M, D, N, =, X
+}
+
+static void cigar_span_bam(const char* cigar, size_t n_cigar, CigarSpan& span) {
+  bool aligned = false;
+  for(size_t i = 0; i < n_cigar; i++) {
+    uint32_t v;
+    memcpy(&v, cigar + 4 * i, sizeof(v));
+    cigar_span_add(span, v & 0xf, v >> 4, aligned);
+  }
+}
+
+// A CIGAR string of an MC tag; false if it is "*" or cannot be parsed
+static bool cigar_span_text(const char* cigar, CigarSpan& span) {
+  static const char ops[] = "MIDNSHP=X";
+  bool aligned = false;
+  if(*cigar == 0) return false;
+  while(*cigar != 0) {
+    int64_t len = 0;
+    const char* digits = cigar;
+    while((unsigned)(*cigar - '0') < 10) len = len * 10 + (*cigar++ - '0');
+    const char* op = (*cigar != 0 ? strchr(ops, *cigar) : nullptr);
+    if(cigar == digits || op == nullptr) return false;
+    cigar_span_add(span, (int)(op - ops), len, aligned);
+    cigar++;
+  }
+  return true;
+}
+
+static inline int64_t five_prime(int64_t pos, bool reverse, const CigarSpan& span) {
+  return reverse ? pos + std::max<int64_t>(span.ref_len, 1) - 1 + span.trail : pos - span.lead;
+}
+
+// An end as (refID, 5' position, strand), ordered by reference and position
+static inline uint64_t dup_end(int32_t refid, int64_t pos, bool reverse) {
+  return ((uint64_t)(uint32_t)refid << 34) | ((uint64_t)(pos + (int64_t(1) << 32)) << 1) | (reverse ? 1 : 0);
+}
+
+static inline bool dup_better(uint32_t score, const char* name, uint32_t best_score, const char* best_name) {
+  return score > best_score || (score == best_score && strcmp(name, best_name) < 0);
+}
+
+static inline void bam_set_flag(char* rec, uint16_t flag) {
+  memcpy(rec + 18, &flag, sizeof(flag));
+}
+
+void DupMarker::init(const BamHeader& header, const std::vector<size_t>& ref_offsets) {
+  _ref_offsets = &ref_offsets;
+  _libraries.clear();
+  std::map<std::string, uint32_t> names;
+  std::set<uint32_t> used;
+  const std::string& text = header.text;
+  for(size_t start = 0; start < text.length(); ) {
+    size_t end = std::min(text.find('\n', start), text.length());
+    if(text.compare(start, 4, "@RG\t") == 0) {
+      std::string id, lb;
+      for(size_t f = start + 4; f < end; ) {
+        size_t f_end = std::min(text.find('\t', f), end);
+        if(text.compare(f, 3, "ID:") == 0) id = text.substr(f + 3, f_end - f - 3);
+        if(text.compare(f, 3, "LB:") == 0) lb = text.substr(f + 3, f_end - f - 3);
+        f = f_end + 1;
+      }
+      // Read groups without a library share one, as in Picard
+      uint32_t library = 0;
+      if(!lb.empty()) library = names.insert(std::make_pair(lb, (uint32_t)names.size() + 1)).first->second;
+      _libraries[id] = library;
+      used.insert(library);
+    }
+    start = end + 1;
+  }
+  _several_libraries = (used.size() > 1);
+}
+
+bool DupMarker::keyed(const char* rec) {
+  return bam_refid(rec) >= 0 && (bam_flag(rec) & 0x904) == 0; // unmapped, secondary, supplementary
+}
+
+int64_t DupMarker::reach(const char* rec) {
+  if(!keyed(rec)) return 0;
+  uint16_t n_cigar;
+  memcpy(&n_cigar, rec + 16, sizeof(n_cigar));
+  const char* cigar = rec + 36 + bam_name_len(rec);
+  if(cigar + 4 * (size_t)n_cigar > rec + bam_rec_size(rec)) return 0;
+  CigarSpan span;
+  cigar_span_bam(cigar, n_cigar, span);
+  int64_t pos = bam_pos(rec);
+  int64_t d = five_prime(pos, (bam_flag(rec) & 0x10) != 0, span) - pos;
+  return d < 0 ? -d : d;
+}
+
+void DupMarker::entries(const char* rec, size_t record, std::vector<DupEntry>& entries) const {
+  if(!keyed(rec)) return;
+  const char* end = rec + bam_rec_size(rec);
+  uint16_t flag = bam_flag(rec);
+  uint16_t n_cigar;
+  memcpy(&n_cigar, rec + 16, sizeof(n_cigar));
+  int64_t l_seq = bam_get_i32(rec + 20);
+  const char* cigar = rec + 36 + bam_name_len(rec);
+  const char* qual = cigar + 4 * (size_t)n_cigar + (l_seq + 1) / 2;
+  if(l_seq < 0 || qual + l_seq > end) return;
+
+  CigarSpan span;
+  cigar_span_bam(cigar, n_cigar, span);
+  int32_t refid = bam_refid(rec);
+  int64_t pos = bam_pos(rec);
+  bool reverse = (flag & 0x10) != 0;
+  int64_t end5 = five_prime(pos, reverse, span);
+  int64_t offset = (int64_t)(*_ref_offsets)[refid];
+  uint32_t score = 0;
+  for(int64_t i = 0; i < l_seq; i++) {
+    uint8_t q = (uint8_t)qual[i];
+    if(q >= 15 && q != 0xff) score += q;
+  }
+
+  // The tags of the mate's CIGAR and score, and the read group
+  const char* mc = nullptr;
+  const char* rg = nullptr;
+  bool has_ms = false;
+  int64_t ms = 0;
+  for(const char* p = qual + l_seq; p + 3 <= end; ) {
+    size_t size = bam_aux_size(p[2], p + 3, end);
+    if(size == 0 || p + 3 + size > end) break;
+    const char* v = p + 3;
+    if(p[0] == 'M' && p[1] == 'C' && p[2] == 'Z') mc = v;
+    if(p[0] == 'R' && p[1] == 'G' && p[2] == 'Z') rg = v;
+    if(p[0] == 'm' && p[1] == 's') {
+      has_ms = true;
+      switch(p[2]) {
+      case 'c': ms = (int8_t)v[0]; break;
+      case 'C': ms = (uint8_t)v[0]; break;
+      case 's': { int16_t x; memcpy(&x, v, 2); ms = x; break; }
+      case 'S': { uint16_t x; memcpy(&x, v, 2); ms = x; break; }
+      case 'i': { int32_t x; memcpy(&x, v, 4); ms = x; break; }
+      case 'I': { uint32_t x; memcpy(&x, v, 4); ms = x; break; }
+      default: has_ms = false;
+      }
+    }
+    p += 3 + size;
+  }
+  uint32_t library = 0;
+  if(_several_libraries && rg != nullptr) {
+    std::unordered_map<std::string, uint32_t>::const_iterator itr = _libraries.find(rg);
+    if(itr != _libraries.end()) library = itr->second;
+  }
+
+  DupEntry entry;
+  entry.rec = rec;
+  entry.record = record;
+  entry.pair_end = false;
+  entry.scored = true;
+  int32_t mate_refid = bam_get_i32(rec + 24);
+  if((flag & 0x9) == 0x1 && mate_refid >= 0 && mate_refid < (int32_t)_ref_offsets->size()) {
+    // Without the mate's CIGAR, both records key the pair by positions alone
+    int64_t mate_pos = bam_get_i32(rec + 28);
+    bool mate_reverse = (flag & 0x20) != 0;
+    int64_t own = pos, mate = mate_pos;
+    CigarSpan mate_span;
+    if(mc != nullptr && cigar_span_text(mc, mate_span)) {
+      own = end5;
+      mate = five_prime(mate_pos, mate_reverse, mate_span);
+    }
+    uint64_t a = dup_end(refid, own, reverse), b = dup_end(mate_refid, mate, mate_reverse);
+    entry.key.end1 = std::min(a, b);
+    entry.key.end2 = std::max(a, b);
+    entry.key.library = library;
+    entry.key.kind = DUP_PAIR;
+    entry.anchor = offset + own;
+    entry.mate_anchor = (int64_t)(*_ref_offsets)[mate_refid] + mate;
+    // Without the mate's score, pairs only compare by name.  Ends in the
+    //    same place leave the score to the first read
+    entry.score = (has_ms ? score + (uint32_t)std::max<int64_t>(0, ms) : 0);
+    entry.scored = (a < b || (a == b && (flag & 0x40) != 0));
+    entries.push_back(entry);
+    entry.pair_end = true;
+    entry.scored = true;
+  }
+  entry.key.end1 = dup_end(refid, end5, reverse);
+  entry.key.end2 = 0;
+  entry.key.library = library;
+  entry.key.kind = DUP_FRAGMENT;
+  entry.anchor = offset + end5;
+  entry.mate_anchor = entry.anchor;
+  entry.score = score;
+  entries.push_back(entry);
+}
+
+void DupMarker::offer(const char* rec, DupZones& zones) const {
+  // Keys are anchored within reach of the positions of the record and its mate
+  if(!keyed(rec)) return;
+  int64_t pos = (int64_t)(*_ref_offsets)[bam_refid(rec)] + bam_pos(rec);
+  int64_t lo = pos, hi = pos;
+  int32_t mate_refid = bam_get_i32(rec + 24);
+  if((bam_flag(rec) & 0x9) == 0x1 && mate_refid >= 0 && mate_refid < (int32_t)_ref_offsets->size()) {
+    int64_t mate_pos = (int64_t)(*_ref_offsets)[mate_refid] + bam_get_i32(rec + 28);
+    lo = std::min(lo, mate_pos);
+    hi = std::max(hi, mate_pos);
+  }
+  if(!zones.spans(lo, hi, _reach)) return;
+  std::vector<DupEntry> list;
+  entries(rec, 0, list);
+  for(size_t i = 0; i < list.size(); i++) {
+    if(zones.near(list[i])) zones.add(list[i]);
+  }
+}
+
+size_t DupMarker::mark(std::vector<SamRecord>& records, const DupZones& zones, const DupZones* piece_zones) const {
+  std::vector<DupEntry> list;
+  list.reserve(2 * records.size());
+  for(size_t i = 0; i < records.size(); i++) {
+    char* rec = records[i].line;
+    if(!keyed(rec)) continue;
+    bam_set_flag(rec, bam_flag(rec) & ~BAM_FDUP);
+    entries(rec, i, list);
+  }
+  std::sort(list.begin(), list.end(), [](const DupEntry& a, const DupEntry& b) { return a.key < b.key; });
+
+  size_t marked = 0;
+  DupBest zone_best;
+  for(size_t i = 0; i < list.size(); ) {
+    size_t j = i + 1;
+    while(j < list.size() && list[j].key == list[i].key) j++;
+    bool in_zone = false;
+    for(size_t k = i; k < j && !in_zone; k++) {
+      in_zone = zones.near(list[k]) || (piece_zones != nullptr && piece_zones->near(list[k]));
+    }
+    if(j - i == 1 && !in_zone) {
+      i = j;
+      continue;
+    }
+    // Sets that may cross a boundary have their best record from all blocks
+    bool found = false, paired = false;
+    uint32_t best_score = 0;
+    const char* best_name = nullptr;
+    if(in_zone && (zones.find(list[i].key, zone_best) || (piece_zones != nullptr && piece_zones->find(list[i].key, zone_best)))) {
+      found = zone_best.found;
+      best_score = zone_best.score;
+      best_name = zone_best.name.c_str();
+      paired = zone_best.paired;
+    }
+    // Pairs are scored by their records at the first end; should none be
+    //    in the input, by the others
+    for(int all = 0; all < 2 && !found; all++) {
+      for(size_t k = i; k < j; k++) {
+        const DupEntry& e = list[k];
+        if(e.pair_end) {
+          paired = true;
+        } else if((e.scored || all) && (!found || dup_better(e.score, bam_name(e.rec), best_score, best_name))) {
+          found = true;
+          best_score = e.score;
+          best_name = bam_name(e.rec);
+        }
+      }
+    }
+    for(size_t k = i; k < j; k++) {
+      const DupEntry& e = list[k];
+      if(e.pair_end) continue;
+      // The other record of the best pair has its own score
+      bool best = (found && (e.key.kind == DUP_PAIR || e.score == best_score) && strcmp(bam_name(e.rec), best_name) == 0);
+      if(best && !(e.key.kind == DUP_FRAGMENT && paired)) continue;
+      char* rec = records[e.record].line;
+      bam_set_flag(rec, bam_flag(rec) | BAM_FDUP);
+      marked++;
+    }
+    i = j;
+  }
+  return marked;
+}
+
+void DupZones::plan(int64_t reach, const std::vector<int64_t>& boundaries) {
+  _reach = reach;
+  _boundaries = boundaries;
+  std::sort(_boundaries.begin(), _boundaries.end());
+}
+
+bool DupZones::spans(int64_t lo, int64_t hi, int64_t slack) const {
+  int64_t margin = _reach + slack + 1;
+  std::vector<int64_t>::const_iterator itr = std::lower_bound(_boundaries.begin(), _boundaries.end(), lo - margin);
+  return itr != _boundaries.end() && *itr <= hi + margin;
+}
+
+void DupZones::add(const DupEntry& entry) {
+  // A pair's set is scored by its record at the first end only
+  if(!entry.scored) return;
+  Shard& shard = _shards[DupKey_hash()(entry.key) % num_shards];
+  tthread::lock_guard<tthread::mutex> lock(shard.mutex);
+  DupBest& best = shard.sets[entry.key];
+  if(entry.pair_end) {
+    best.paired = true;
+  } else if(!best.found || dup_better(entry.score, bam_name(entry.rec), best.score, best.name.c_str())) {
+    best.found = true;
+    best.score = entry.score;
+    best.name = bam_name(entry.rec);
+  }
+}
+
+bool DupZones::find(const DupKey& key, DupBest& best) const {
+  const Shard& shard = _shards[DupKey_hash()(key) % num_shards];
+  tthread::lock_guard<tthread::mutex> lock(shard.mutex);
+  std::unordered_map<DupKey, DupBest, DupKey_hash>::const_iterator itr = shard.sets.find(key);
+  if(itr == shard.sets.end()) return false;
+  best = itr->second;
+  return true;
+}
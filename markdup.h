@@ -0,0 +1,186 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MARKDUP_H_
+#define MARKDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bgzf.h"
+#include "block_sort.h"
+#include "tinythread.h"
+
+// Duplicate marking of coordinate-sorted blocks, with the criteria of Picard
+//    MarkDuplicates and samtools markdup.  A primary, mapped record is keyed
+//    by its library, the unclipped 5' end of each of its ends (reference,
+//    position and strand) and whether it is a pair or a fragment; pairs
+//    take the mate's end from its MC tag.  Of each set of equal keys, the
+//    record with the highest score, the sum of its base qualities of at
+//    least 15 plus the ms tag of its mate for pairs, is kept and the others
+//    are marked, ties going to the smallest read name.  Fragments are also
+//    marked when a pair has an end at their key.  The two records of a pair
+//    need not score alike, as the ms tag may be missing on one or disagree
+//    with the other's qualities, so a pair is scored by its record at the
+//    first end of its key only, and its other record follows that choice.
+//
+//    All the records of a set are at their own key's 5' end, so they lie
+//    within the reach of the input, the largest distance between a record's
+//    position and its 5' end, from that end.  A set can thus only cross the
+//    boundary between blocks if its end is within reach of it, and the
+//    best record of each such set is found while the input is routed into
+//    the blocks; every other set is decided within its block alone.  A pair
+//    set is decided at its first end, so one with a boundary between its
+//    two ends is found while routing as well, for the blocks of both ends.
+
+enum DupKind { DUP_PAIR, DUP_FRAGMENT };
+
+struct DupKey {
+  uint64_t end1;      // ends as (refID, 5' position, strand); a pair's in order
+  uint64_t end2;      // a fragment has none
+  uint32_t library;
+  uint32_t kind;
+
+  bool operator==(const DupKey& o) const {
+    return end1 == o.end1 && end2 == o.end2 && library == o.library && kind == o.kind;
+  }
+  bool operator<(const DupKey& o) const {
+    if(end1 != o.end1) return end1 < o.end1;
+    if(end2 != o.end2) return end2 < o.end2;
+    if(library != o.library) return library < o.library;
+    return kind < o.kind;
+  }
+};
+
+struct DupKey_hash {
+  size_t operator()(const DupKey& k) const {
+    uint64_t h = k.end1 * 0x9e3779b97f4a7c15ULL;
+    h ^= (k.end2 + ((uint64_t)k.library << 1 | k.kind)) * 0xc2b2ae3d27d4eb4fULL;
+    return (size_t)(h ^ (h >> 29));
+  }
+};
+
+/// One of the keys of a record: a pair's records have their pair key and the
+///    fragment key of their own end, which only tells fragments that a pair
+///    is there
+struct DupEntry {
+  DupKey   key;
+  int64_t  anchor;    // linear position of the record's own end in the key
+  int64_t  mate_anchor; // of the other end of a pair key, or anchor
+  uint32_t score;
+  bool     pair_end;  // the fragment key of a pair's record
+  bool     scored;    // a fragment, or the record at the first end of a pair
+  const char* rec;
+  size_t   record;    // index of rec among the records being marked
+};
+
+/// The best record of a set, and whether a pair has an end at a fragment key
+struct DupBest {
+  bool        found = false;
+  uint32_t    score = 0;
+  std::string name;
+  bool        paired = false;
+};
+
+class DupZones;
+
+/**
+ * Keys records and marks the duplicates among the sorted records of a block.
+ */
+class DupMarker {
+public:
+  DupMarker() : _ref_offsets(nullptr), _several_libraries(false), _reach(0) { }
+
+  /// Libraries of the read groups of header, by their LB fields
+  void init(const BamHeader& header, const std::vector<size_t>& ref_offsets);
+
+  /// Distance between the position of rec and its 5' end, or 0 if it is not
+  ///    keyed; the reach of an input is the largest of them
+  static int64_t reach(const char* rec);
+  void set_reach(int64_t reach) { _reach = reach; }
+  int64_t reach() const { return _reach; }
+
+  /// Whether rec is keyed, without its clipping: unmapped, secondary and
+  ///    supplementary records are not
+  static bool keyed(const char* rec);
+
+  /// Append the keys of rec, none, one or two, to entries
+  void entries(const char* rec, size_t record, std::vector<DupEntry>& entries) const;
+
+  /// Add the keys of rec within reach of a boundary of zones to them
+  void offer(const char* rec, DupZones& zones) const;
+
+  /// Mark the duplicates among records, which hold all the records of their
+  ///    blocks but those of sets in zones or piece_zones, to whose best
+  ///    records they defer; clear the flag of the other keyed records.
+  ///    Return the number of records marked.
+  size_t mark(std::vector<SamRecord>& records, const DupZones& zones, const DupZones* piece_zones) const;
+
+private:
+  const std::vector<size_t>*                 _ref_offsets;
+  std::unordered_map<std::string, uint32_t>  _libraries;  // @RG ID to library
+  bool                                       _several_libraries;
+  int64_t                                    _reach;
+};
+
+/**
+ * Sets of keys whose end lies within reach of a boundary between blocks, with
+ * their best records so far.  Sets are added to by several threads while
+ * others look them up.
+ */
+class DupZones {
+public:
+  DupZones() : _reach(0), _shards(num_shards) { }
+
+  /// Keep the sets within reach of the sorted linear positions boundaries
+  void plan(int64_t reach, const std::vector<int64_t>& boundaries);
+
+  /// Whether anchor is within reach, plus slack, of a boundary
+  bool near(int64_t anchor, int64_t slack = 0) const { return spans(anchor, anchor, slack); }
+  /// Whether a boundary lies between the linear positions lo and hi, or
+  ///    within reach, plus slack, of them
+  bool spans(int64_t lo, int64_t hi, int64_t slack = 0) const;
+  /// Whether the set of entry may have records in several blocks
+  bool near(const DupEntry& entry) const {
+    return spans(std::min(entry.anchor, entry.mate_anchor), std::max(entry.anchor, entry.mate_anchor));
+  }
+  void add(const DupEntry& entry);
+  /// Copy the set of key into best, if it is kept
+  bool find(const DupKey& key, DupBest& best) const;
+
+private:
+  static const size_t num_shards = 64;
+
+  struct Shard {
+    std::unordered_map<DupKey, DupBest, DupKey_hash> sets;
+    mutable tthread::mutex                           mutex;
+  };
+
+  int64_t              _reach;
+  std::vector<int64_t> _boundaries;
+  std::vector<Shard>   _shards;
+
+  DupZones(const DupZones&);
+  DupZones& operator=(const DupZones&);
+};
+
+#endif /* MARKDUP_H_ */
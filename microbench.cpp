@@ -0,0 +1,276 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Micro-benchmarks of the kernels fast-samtools-sort spends its time in,
+//    run on in-memory data so that pipes and disks stay out of the numbers:
+//    splitting SAM lines into the fields sorting needs, looking contigs up,
+//    and sorting the records of a block.  Each kernel runs a number of times
+//    on the same input and the fastest and median runs are reported.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "tinythread.h"
+#include "block_sort.h"
+#include "contig2pos.h"
+#include "sam_scan.h"
+
+static size_t opt_records = 1000000;
+static size_t opt_repeat = 7;
+static size_t opt_threads = 4;
+static size_t opt_contigs = 25;
+static size_t opt_read_length = 100;
+static size_t opt_block_span = 1 << 20; // bp of genome a sorted block covers
+
+static const size_t contig_length = 100000000;
+
+/// In-memory SAM text and the contig table of its header
+struct SamText {
+  std::string              text;
+  std::vector<std::string> contigs;
+  Contig2Pos               contig2pos;
+};
+
+// Reads in runs on one contig, as in the blocks of a sorted input, with a
+//    fraction of them unaligned
+static void make_sam(SamText& sam, std::mt19937_64& rng) {
+  for(size_t i = 0; i < opt_contigs; i++) {
+    sam.contigs.push_back("chr" + std::to_string(i + 1));
+    sam.contig2pos.add(sam.contigs.back().c_str(), i * contig_length);
+  }
+  std::string seq(opt_read_length, 'A'), qual(opt_read_length, 'I');
+  size_t contig = 0;
+  for(size_t i = 0; i < opt_records; i++) {
+    if(rng() % 64 == 0) contig = rng() % opt_contigs;
+    bool unaligned = (rng() % 50 == 0);
+    sam.text += "read" + std::to_string(i) + (unaligned ? "\t4\t*\t0\t0\t*" : "\t0\t" + sam.contigs[contig] + "\t" + std::to_string(rng() % contig_length + 1) + "\t60\t" + std::to_string(opt_read_length) + "M");
+    sam.text += "\t*\t0\t0\t" + seq + "\t" + qual + "\n";
+  }
+}
+
+/// Time run over opt_repeat runs, each after prepare; print the fastest and
+///    median runs in ms and millions of items per second
+static void bench(const std::string& name, size_t items, const std::function<void()>& prepare, const std::function<uint64_t()>& run) {
+  std::vector<double> times;
+  uint64_t check = 0;
+  for(size_t r = 0; r < opt_repeat; r++) {
+    prepare();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    check += run();
+    times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  double best = times.front(), median = times[times.size() / 2];
+  std::cout << std::left << std::setw(22) << name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << best << " ms" << std::setw(10) << median << " ms"
+            << std::setw(10) << (best > 0 ? items / best / 1000.0 : 0) << " M/s"
+            << "  (check " << std::hex << (check & 0xffff) << std::dec << ")" << std::endl;
+}
+
+// SAM line tokenization: the fields sorting needs, as fieldSplitter and
+//    textBlockLoad find them, and the strtok_r splitting they replaced
+static void bench_tokenize(SamText& sam) {
+  const char* begin = sam.text.data();
+  const char* end = begin + sam.text.size();
+  bench("tokenize/scan", opt_records, []() { }, [&]() {
+    uint64_t sum = 0;
+    size_t last = sam.contigs.size(), length;
+    for(const char* line = begin; line < end; line += length) {
+      const char* tabs[SAM_SCAN_TABS];
+      if(sam_scan_line(line, end, tabs, length) < SAM_SCAN_TABS) continue;
+      const char* contig_name = tabs[1] + 1;
+      if(contig_name[0] == '*') continue;
+      sum += sam.contig2pos.find(contig_name, tabs[2] - contig_name, last) + sam_parse_pos(tabs[2] + 1);
+    }
+    return sum;
+  });
+  bench("tokenize/reader", opt_records, []() { }, [&]() {
+    uint64_t sum = 0;
+    FILE* fp = fmemopen((void*)begin, end - begin, "r");
+    SamLineReader reader(fp);
+    size_t last = sam.contigs.size(), length;
+    const char* line;
+    while((line = reader.next(length)) != nullptr) {
+      const char* tabs[SAM_SCAN_TABS];
+      if(sam_scan_line(line, line + length, tabs, length) < SAM_SCAN_TABS) continue;
+      const char* contig_name = tabs[1] + 1;
+      if(contig_name[0] == '*') continue;
+      sum += sam.contig2pos.find(contig_name, tabs[2] - contig_name, last) + sam_parse_pos(tabs[2] + 1);
+    }
+    fclose(fp);
+    return sum;
+  });
+  std::vector<char> copy;
+  bench("tokenize/strtok", opt_records, [&]() { copy.assign(begin, end); copy.push_back(0); }, [&]() {
+    uint64_t sum = 0;
+    char* next_line = nullptr;
+    for(char* line = strtok_r(copy.data(), "\n", &next_line); line != nullptr; line = strtok_r(nullptr, "\n", &next_line)) {
+      char* next_field = nullptr;
+      char* field = strtok_r(line, "\t", &next_field);
+      const char* contig_name = nullptr;
+      for(int f = 0; field != nullptr && f < 4; f++, field = strtok_r(nullptr, "\t", &next_field)) {
+        if(f == 2) contig_name = field;
+        if(f == 3 && contig_name[0] != '*') sum += sam.contig2pos[contig_name] + strtoul(field, nullptr, 10);
+      }
+    }
+    return sum;
+  });
+}
+
+// Contig lookups, in runs as in SAM input and at random, and with the
+//    std::map the hash table replaced
+static void bench_contig(SamText& sam, std::mt19937_64& rng) {
+  std::vector<const std::string*> runs(opt_records), shuffled(opt_records);
+  for(size_t i = 0, contig = 0; i < opt_records; i++) {
+    if(rng() % 64 == 0) contig = rng() % opt_contigs;
+    runs[i] = &sam.contigs[contig];
+    shuffled[i] = &sam.contigs[rng() % opt_contigs];
+  }
+  std::map<std::string, size_t> contig_map;
+  for(size_t i = 0; i < sam.contigs.size(); i++) {
+    contig_map[sam.contigs[i]] = sam.contig2pos[sam.contigs[i].c_str()];
+  }
+  const std::vector<const std::string*>* orders[2] = {&runs, &shuffled};
+  const char* order_names[2] = {"runs", "random"};
+  for(size_t o = 0; o < 2; o++) {
+    const std::vector<const std::string*>& names = *orders[o];
+    bench(std::string("contig/hash/") + order_names[o], opt_records, []() { }, [&]() {
+      uint64_t sum = 0;
+      size_t last = sam.contigs.size();
+      for(size_t i = 0; i < names.size(); i++) {
+        sum += sam.contig2pos.find(names[i]->data(), names[i]->length(), last);
+      }
+      return sum;
+    });
+    bench(std::string("contig/map/") + order_names[o], opt_records, []() { }, [&]() {
+      uint64_t sum = 0;
+      for(size_t i = 0; i < names.size(); i++) {
+        sum += contig_map.find(*names[i])->second;
+      }
+      return sum;
+    });
+  }
+}
+
+// Run tasks on opt_threads threads, as idle workers would
+static void run_tasks(size_t num_tasks, const std::function<void(size_t)>& task) {
+  std::atomic<size_t> next(0);
+  struct Helper {
+    std::atomic<size_t>*               next;
+    size_t                             num_tasks;
+    const std::function<void(size_t)>* task;
+    static void run(void* vp) {
+      Helper* h = (Helper*)vp;
+      for(size_t i; (i = h->next->fetch_add(1)) < h->num_tasks; ) (*h->task)(i);
+    }
+  } helper = {&next, num_tasks, &task};
+  std::vector<tthread::thread*> threads;
+  for(size_t t = 1; t < opt_threads; t++) threads.push_back(new tthread::thread(Helper::run, &helper));
+  Helper::run(&helper);
+  for(size_t t = 0; t < threads.size(); t++) {
+    threads[t]->join();
+    delete threads[t];
+  }
+}
+
+// Sorting the records of a block that spans opt_block_span bp, in input order
+static void bench_sort(std::mt19937_64& rng) {
+  std::vector<SamRecord> input(opt_records), records;
+  for(size_t i = 0; i < opt_records; i++) {
+    input[i].read_id = i;
+    input[i].pos = rng() % opt_block_span;
+    input[i].line = nullptr;
+  }
+  auto prepare = [&]() { records = input; };
+  auto check = [&]() { return (uint64_t)(records[records.size() / 3].read_id + records.back().pos); };
+  bench("sort/std::sort", opt_records, prepare, [&]() {
+    std::sort(records.begin(), records.end(), SamRecord_cmp());
+    return check();
+  });
+  bench("sort/radix", opt_records, prepare, [&]() {
+    block_sort(records);
+    return check();
+  });
+  bench("sort/radix-parallel", opt_records, prepare, [&]() {
+    block_sort(records, run_tasks, opt_threads);
+    return check();
+  });
+}
+
+static void print_usage(std::ostream& out) {
+  out << "Usage: fast-samtools-sort-microbench [options] [tokenize] [contig] [sort]" << std::endl
+      << "Options:" << std::endl
+      << "  -n INT        Records per kernel run (Default: 1000000)" << std::endl
+      << "  --repeat INT  Runs per kernel (Default: 7)" << std::endl
+      << "  -@ INT        Threads of the parallel sort (Default: 4)" << std::endl
+      << "  -c INT        Number of contigs (Default: 25)" << std::endl
+      << "  -r INT        Read length of the SAM lines (Default: 100)" << std::endl
+      << "  --span INT    bp a sorted block covers (Default: 1048576)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::set<std::string> uint_options {"-n", "--repeat", "-@", "-c", "-r", "--span"};
+  std::set<std::string> kernels;
+  for(int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if(uint_options.count(option) > 0) {
+      if(i + 1 >= argc) {
+        std::cerr << "Error: option, " << option << ", needs an argument." << std::endl;
+        return 1;
+      }
+      size_t value = strtoull(argv[++i], nullptr, 10);
+      if(option == "-n") opt_records = std::max<size_t>(1, value);
+      else if(option == "--repeat") opt_repeat = std::max<size_t>(1, value);
+      else if(option == "-@") opt_threads = std::max<size_t>(1, value);
+      else if(option == "-c") opt_contigs = std::max<size_t>(1, value);
+      else if(option == "-r") opt_read_length = std::max<size_t>(1, value);
+      else if(option == "--span") opt_block_span = std::max<size_t>(1, value);
+    } else if(option == "tokenize" || option == "contig" || option == "sort") {
+      kernels.insert(option);
+    } else {
+      std::cerr << "Error: unrecognized option, " << option << std::endl << std::endl;
+      print_usage(std::cerr);
+      return 1;
+    }
+  }
+  if(kernels.empty()) kernels = {"tokenize", "contig", "sort"};
+
+  std::mt19937_64 rng(1);
+  std::cout << std::left << std::setw(22) << "kernel" << std::right << std::setw(13) << "best" << std::setw(13) << "median"
+            << std::setw(14) << "best rate" << std::endl;
+  if(kernels.count("tokenize") || kernels.count("contig")) {
+    SamText sam;
+    make_sam(sam, rng);
+    if(kernels.count("tokenize")) bench_tokenize(sam);
+    if(kernels.count("contig")) bench_contig(sam, rng);
+  }
+  if(kernels.count("sort")) bench_sort(rng);
+  return 0;
+}
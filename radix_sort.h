@@ -0,0 +1,163 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RADIX_SORT_H_
+#define RADIX_SORT_H_
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+static const unsigned RADIX_DIGIT_BITS    = 11;
+static const size_t   RADIX_BUCKETS       = size_t(1) << RADIX_DIGIT_BITS;
+static const size_t   RADIX_INSERTION_MAX = 32; // shorter runs are sorted by insertion
+
+/// Stable LSD radix sort of n keys, and of the items that go with them, by the
+///    low key_bits bits of the keys, using scratch arrays of n entries.  The
+///    counts of every digit are taken in a single scan, and digits all keys
+///    share are skipped.  Return true if the result was left in the scratch
+///    arrays rather than in keys and items.
+template<typename T>
+bool radix_sort_keys(uint64_t* keys, T* items, uint64_t* keys_tmp, T* items_tmp, size_t n, unsigned key_bits) {
+  if(n < 2 || key_bits == 0) return false;
+  const uint64_t mask = (key_bits < 64 ? (uint64_t(1) << key_bits) - 1 : ~uint64_t(0));
+  if(n <= RADIX_INSERTION_MAX) {
+    for(size_t i = 1; i < n; i++) {
+      uint64_t k = keys[i];
+      T item = items[i];
+      size_t j = i;
+      for(; j > 0 && (keys[j - 1] & mask) > (k & mask); j--) {
+        keys[j] = keys[j - 1];
+        items[j] = items[j - 1];
+      }
+      keys[j] = k;
+      items[j] = item;
+    }
+    return false;
+  }
+  const unsigned num_digits = (key_bits + RADIX_DIGIT_BITS - 1) / RADIX_DIGIT_BITS;
+
+  std::vector<size_t> counts(num_digits * RADIX_BUCKETS, 0);
+  for(size_t i = 0; i < n; i++) {
+    for(unsigned d = 0; d < num_digits; d++) {
+      counts[d * RADIX_BUCKETS + ((keys[i] >> (d * RADIX_DIGIT_BITS)) & (RADIX_BUCKETS - 1))]++;
+    }
+  }
+
+  bool swapped = false;
+  for(unsigned d = 0; d < num_digits; d++) {
+    size_t* count = &counts[d * RADIX_BUCKETS];
+    const unsigned shift = d * RADIX_DIGIT_BITS;
+    if(count[(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == n) continue;
+    size_t sum = 0;
+    for(size_t b = 0; b < RADIX_BUCKETS; b++) {
+      size_t c = count[b];
+      count[b] = sum;
+      sum += c;
+    }
+    for(size_t i = 0; i < n; i++) {
+      size_t& dst = count[(keys[i] >> shift) & (RADIX_BUCKETS - 1)];
+      keys_tmp[dst] = keys[i];
+      items_tmp[dst] = items[i];
+      dst++;
+    }
+    std::swap(keys, keys_tmp);
+    std::swap(items, items_tmp);
+    swapped = !swapped;
+  }
+  return swapped;
+}
+
+/**
+ * Stable LSD radix sort of items by the low key_bits bits of key(item).
+ * Keys are computed once and sorted along with the items.
+ */
+template<typename T, typename KeyFn>
+void radix_sort(std::vector<T>& items, KeyFn key, unsigned key_bits) {
+  const size_t n = items.size();
+  if(n < 2 || key_bits == 0) return;
+
+  std::vector<uint64_t> keys(n), keys_tmp(n);
+  for(size_t i = 0; i < n; i++) {
+    keys[i] = key(items[i]);
+  }
+  std::vector<T> items_tmp(n);
+  if(radix_sort_keys(keys.data(), items.data(), keys_tmp.data(), items_tmp.data(), n, key_bits)) {
+    items.swap(items_tmp);
+  }
+}
+
+/**
+ * radix_sort on several threads: run(num_tasks, task) must call task(i) for
+ * every i below num_tasks, in any order and on any number of threads.  Items
+ * are scattered by the top digit of their keys, num_chunks slices of them at a
+ * time, and every bucket is then sorted on the remaining digits as a task of
+ * its own.  The scatter keeps the order of the slices, so the sort is stable.
+ */
+template<typename T, typename KeyFn, typename Run>
+void radix_sort_parallel(std::vector<T>& items, KeyFn key, unsigned key_bits, size_t num_chunks, Run run) {
+  const size_t n = items.size();
+  if(n < 2 || key_bits == 0) return;
+  num_chunks = std::max<size_t>(1, std::min(num_chunks, n));
+  const unsigned shift = key_bits - std::min(key_bits, RADIX_DIGIT_BITS);
+  const size_t num_buckets = size_t(1) << (key_bits - shift);
+
+  std::vector<uint64_t> keys(n), keys_tmp(n);
+  std::vector<T> items_tmp(n);
+  std::vector<size_t> counts(num_chunks * num_buckets, 0);
+  run(num_chunks, [&](size_t chunk) {
+    size_t* count = &counts[chunk * num_buckets];
+    for(size_t i = n * chunk / num_chunks; i < n * (chunk + 1) / num_chunks; i++) {
+      keys[i] = key(items[i]);
+      count[(keys[i] >> shift) & (num_buckets - 1)]++;
+    }
+  });
+
+  // In every bucket, each slice's items follow those of the slices before it
+  std::vector<size_t> bucket_starts(num_buckets + 1, n);
+  size_t sum = 0;
+  for(size_t b = 0; b < num_buckets; b++) {
+    bucket_starts[b] = sum;
+    for(size_t chunk = 0; chunk < num_chunks; chunk++) {
+      size_t c = counts[chunk * num_buckets + b];
+      counts[chunk * num_buckets + b] = sum;
+      sum += c;
+    }
+  }
+  run(num_chunks, [&](size_t chunk) {
+    size_t* count = &counts[chunk * num_buckets];
+    for(size_t i = n * chunk / num_chunks; i < n * (chunk + 1) / num_chunks; i++) {
+      size_t& dst = count[(keys[i] >> shift) & (num_buckets - 1)];
+      keys_tmp[dst] = keys[i];
+      items_tmp[dst] = items[i];
+      dst++;
+    }
+  });
+
+  run(num_buckets, [&](size_t b) {
+    const size_t begin = bucket_starts[b], length = bucket_starts[b + 1] - begin;
+    if(length == 0) return;
+    if(radix_sort_keys(&keys_tmp[begin], &items_tmp[begin], &keys[begin], &items[begin], length, shift)) {
+      std::copy(items.begin() + begin, items.begin() + begin + length, items_tmp.begin() + begin);
+    }
+  });
+  items.swap(items_tmp);
+}
+
+#endif /* RADIX_SORT_H_ */
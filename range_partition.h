@@ -0,0 +1,131 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RANGE_PARTITION_H_
+#define RANGE_PARTITION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+// Range partitioning of records by sort keys that compare as byte strings
+//    (see sort_key.h), whatever the sort order: splitters are picked from a
+//    sample of the keys, and records are routed by binary search over them.
+//    Keys are made unique by the ordinals of their records, appended as 8
+//    big-endian bytes, so that a run of equal keys, such as a pileup at one
+//    position, can be spread over several blocks.
+
+/// A sampled record: its key, its ordinal in the input, which may be an
+///    estimate, its footprint once loaded for sorting, and the number of
+///    records of the input it stands for
+struct KeySample {
+  std::string key;
+  uint64_t ordinal;
+  size_t footprint;
+  double weight;
+};
+
+/**
+ * Uniform sample of up to a given number of the records offered to it
+ * (Vitter's algorithm R), for a caller that only builds the keys of the
+ * records that make it into the sample.
+ */
+class KeyReservoir {
+public:
+  KeyReservoir() : _capacity(0), _seen(0) { }
+
+  void reset(size_t capacity, uint64_t seed) {
+    _capacity = capacity;
+    _seen = 0;
+    _rng.seed(seed);
+    _samples.clear();
+  }
+
+  /// Count a record; return the slot its sample goes into, or nullptr if
+  ///    it is left out
+  KeySample* offer() {
+    _seen++;
+    size_t slot = _samples.size();
+    if(slot < _capacity) {
+      _samples.push_back(KeySample());
+    } else {
+      slot = _rng() % _seen;
+      if(slot >= _capacity) return nullptr;
+    }
+    return &_samples[slot];
+  }
+
+  size_t seen() const { return _seen; }
+  std::vector<KeySample>& samples() { return _samples; }
+
+private:
+  size_t                  _capacity;
+  size_t                  _seen;
+  std::mt19937_64         _rng;
+  std::vector<KeySample>  _samples;
+};
+
+inline void key_append_ordinal(std::string& key, uint64_t ordinal) {
+  for(int shift = 56; shift >= 0; shift -= 8) key.push_back((char)(ordinal >> shift));
+}
+
+/**
+ * Splitters cutting the key space into blocks: block b gets the keys from
+ * splitters[b - 1] up to splitters[b].
+ */
+class RangePartition {
+public:
+  /// Pick splitters from sample, whose keys get their ordinals appended, so
+  ///    that the estimated footprint of each block is about the same and at
+  ///    most max_footprint, with at least min_blocks blocks if there is
+  ///    enough for blocks of min_footprint
+  void plan(std::vector<KeySample>& sample, size_t max_footprint, size_t min_blocks, size_t min_footprint) {
+    _splitters.clear();
+    double total = 0;
+    for(size_t i = 0; i < sample.size(); i++) {
+      key_append_ordinal(sample[i].key, sample[i].ordinal);
+      total += sample[i].weight * sample[i].footprint;
+    }
+    std::sort(sample.begin(), sample.end(), [](const KeySample& a, const KeySample& b) { return a.key < b.key; });
+    size_t num_blocks = std::max((size_t)(total / std::max<size_t>(1, max_footprint)) + 1,
+                                 std::min(min_blocks, (size_t)(total / std::max<size_t>(1, min_footprint))));
+    double sofar = 0;
+    for(size_t i = 0; i < sample.size(); i++) {
+      if(i > 0 && sofar >= total * (_splitters.size() + 1) / num_blocks) {
+        _splitters.push_back(sample[i].key);
+      }
+      sofar += sample[i].weight * sample[i].footprint;
+    }
+  }
+
+  size_t num_blocks() const { return _splitters.size() + 1; }
+
+  /// Block of a key that ends with its record's ordinal
+  size_t block(const std::string& key) const {
+    return std::upper_bound(_splitters.begin(), _splitters.end(), key) - _splitters.begin();
+  }
+
+private:
+  std::vector<std::string> _splitters;
+};
+
+#endif /* RANGE_PARTITION_H_ */
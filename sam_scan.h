@@ -0,0 +1,135 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAM_SCAN_H_
+#define SAM_SCAN_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Locating the fields of a SAM line that sorting needs, RNAME and POS,
+//    in one pass over the line that also finds its end
+
+static const size_t SAM_SCAN_TABS = 4; // tabs up to the one ending POS
+
+/// Scan the line at [line, end) up to its newline, a NUL or end.  Fill tabs
+///    with the positions of its first SAM_SCAN_TABS tabs, and return the number
+///    of them found; length is set to the length of the line, newline included.
+inline size_t sam_scan_line(const char* line, const char* end, const char* tabs[SAM_SCAN_TABS], size_t& length) {
+  size_t num_tabs = 0;
+  const char* p = line;
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i nul = _mm_setzero_si128();
+  for(; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    unsigned nl_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, nul)));
+    unsigned tab_mask = (num_tabs < SAM_SCAN_TABS ? _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)) : 0);
+    if(nl_mask != 0) {
+      // Only tabs before the newline belong to the line
+      tab_mask &= (nl_mask & -nl_mask) - 1;
+    }
+    while(tab_mask != 0 && num_tabs < SAM_SCAN_TABS) {
+      tabs[num_tabs++] = p + __builtin_ctz(tab_mask);
+      tab_mask &= tab_mask - 1;
+    }
+    if(nl_mask != 0) {
+      const char* stop = p + __builtin_ctz(nl_mask);
+      length = stop + (*stop == '\n') - line;
+      return num_tabs;
+    }
+  }
+#endif
+  for(; p < end; p++) {
+    if(*p == '\n' || *p == 0) {
+      length = p + (*p == '\n') - line;
+      return num_tabs;
+    }
+    if(*p == '\t' && num_tabs < SAM_SCAN_TABS) tabs[num_tabs++] = p;
+  }
+  length = end - line;
+  return num_tabs;
+}
+
+/// Parse the decimal POS field
+inline size_t sam_parse_pos(const char* p) {
+  size_t v = 0;
+  for(; (unsigned)(*p - '0') < 10; p++) {
+    v = v * 10 + (*p - '0');
+  }
+  return v;
+}
+
+/**
+ * Reader of the lines of a SAM stream, whatever their length.  Input is read in
+ * large chunks into a buffer that is reused for every line and only grows when
+ * a single line does not fit in it, so lines cost no allocation of their own.
+ */
+class SamLineReader {
+public:
+  SamLineReader(FILE* fp, size_t capacity = 1 << 20) :
+    _fp(fp), _buffer(capacity), _begin(0), _scan(0), _end(0), _eof(false) {}
+
+  /// Return the next line and set length to its length, newline included if
+  ///    present, or return nullptr at the end of input.  The line is not NUL
+  ///    terminated and stays valid until the next call.
+  const char* next(size_t& length) {
+    while(true) {
+      char* data = _buffer.data();
+      const char* newline = (const char*)memchr(data + _scan, '\n', _end - _scan);
+      if(newline != nullptr || (_eof && _begin < _end)) {
+        const char* line = data + _begin;
+        length = (newline != nullptr ? newline + 1 : data + _end) - line;
+        _begin = _scan = (line + length) - data;
+        return line;
+      }
+      if(_eof) return nullptr;
+      // Only the part of the line after _scan is left to search for a newline
+      _scan = _end;
+      if(_begin > 0) {
+        memmove(data, data + _begin, _end - _begin);
+        _end -= _begin;
+        _scan -= _begin;
+        _begin = 0;
+      }
+      if(_end == _buffer.size()) {
+        _buffer.resize(_buffer.size() * 2);
+      }
+      size_t count = fread(_buffer.data() + _end, 1, _buffer.size() - _end, _fp);
+      if(count == 0) _eof = true;
+      _end += count;
+    }
+  }
+
+private:
+  FILE*             _fp;
+  std::vector<char> _buffer;
+  size_t            _begin;  // start of the next line
+  size_t            _scan;   // how far the next line has been searched for a newline
+  size_t            _end;    // end of the data read
+  bool              _eof;
+};
+
+#endif /* SAM_SCAN_H_ */
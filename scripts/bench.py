@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+#
+# Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+#
+# This file is part of fast-samtools-sort.
+#
+# fast-samtools-sort is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# fast-samtools-sort is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Benchmark fast-samtools-sort on synthetic BAM files made by
+fast-samtools-sort-gen, against samtools sort and sambamba sort with the
+equivalent flags where they are installed.  Each run reports wall time, peak
+RSS and records per second, and for fast-samtools-sort the time of each
+phase from --stats-json.  Results can be saved with --save and compared with
+those of another revision with --baseline.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+# Synthetic inputs: generator arguments, scaled by --reads
+CONFIGS = {
+    "uniform":      lambda n: ["-n", n, "-r", 100, "-u", 0.02],
+    "long-reads":   lambda n: ["-n", max(1, n // 10), "-r", 1000, "-u", 0.02],
+    "hotspots":     lambda n: ["-n", n, "-r", 100, "-u", 0.02, "--hotspots", 4, "--hotspot-reads", 0.3],
+    "unmapped":     lambda n: ["-n", n, "-r", 100, "-u", 0.4],
+    "many-contigs": lambda n: ["-n", n, "-r", 100, "-u", 0.02, "-c", 3000, "-L", 1000000],
+    "sorted":       lambda n: ["-n", n, "-r", 100, "-u", 0.1, "--sorted"],
+}
+
+
+def parse_memory(text):
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    text = text.strip()
+    if text[-1:].upper() in units:
+        return int(text[:-1]) * units[text[-1:].upper()]
+    return int(text)
+
+
+def run(cmd):
+    """Run cmd; return wall seconds and peak RSS in bytes of its process"""
+    start = time.monotonic()
+    proc = subprocess.Popen([str(c) for c in cmd], stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        raise RuntimeError("failed: " + " ".join(str(c) for c in cmd))
+    rss = usage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+    return wall, rss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sorter", default="./fast-samtools-sort")
+    parser.add_argument("--generator", default="./fast-samtools-sort-gen")
+    parser.add_argument("--samtools", default=shutil.which("samtools"), help="samtools binary (Default: from PATH)")
+    parser.add_argument("--sambamba", default=shutil.which("sambamba"), help="sambamba binary (Default: from PATH)")
+    parser.add_argument("--no-others", action="store_true", help="Only run fast-samtools-sort")
+    parser.add_argument("--configs", default=",".join(CONFIGS), help="Comma-separated inputs (Default: all of " + ", ".join(CONFIGS) + ")")
+    parser.add_argument("--reads", type=int, default=2000000, help="Reads per input (Default: 2000000)")
+    parser.add_argument("--threads", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--memory", default="2G", help="Total memory, as for -m (Default: 2G)")
+    parser.add_argument("--compression", type=int, default=6)
+    parser.add_argument("--repeat", type=int, default=1, help="Runs per tool and input; the fastest is kept")
+    parser.add_argument("--workdir", default="bench.tmp", help="Where inputs are generated and kept (Default: bench.tmp)")
+    parser.add_argument("--save", help="Write the results to this JSON file")
+    parser.add_argument("--baseline", help="Compare with results saved by --save")
+    parser.add_argument("--sorter-args", default="", help="Extra arguments for fast-samtools-sort")
+    args = parser.parse_args()
+
+    memory = parse_memory(args.memory)
+    memory_k = "%dK" % max(1, memory // 1024)
+    memory_per_thread_k = "%dK" % max(1, memory // args.threads // 1024)
+    os.makedirs(args.workdir, exist_ok=True)
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = {(r["config"], r["tool"]): r for r in json.load(f)["results"]}
+
+    results = []
+    for config in args.configs.split(","):
+        if config not in CONFIGS:
+            sys.exit("unknown input: " + config)
+        gen_args = CONFIGS[config](args.reads)
+        in_fname = os.path.join(args.workdir, "%s.%d.bam" % (config, args.reads))
+        if not os.path.exists(in_fname):
+            print("Generating %s ..." % in_fname, file=sys.stderr)
+            run([args.generator] + gen_args + ["-o", in_fname])
+            # A sorted input is indexed, so that blocks are planned from the index
+            if "--sorted" in gen_args and args.samtools:
+                try:
+                    run([args.samtools, "index", in_fname])
+                except RuntimeError as e:
+                    print("%s; %s is not indexed" % (e, in_fname), file=sys.stderr)
+        out_fname = os.path.join(args.workdir, "out.bam")
+        stats_fname = os.path.join(args.workdir, "stats.json")
+
+        tools = [("fast-samtools-sort",
+                  [args.sorter, "-@", args.threads, "-m", memory_k, "-l", args.compression,
+                   "--stats-json", stats_fname] + args.sorter_args.split() + ["-o", out_fname, in_fname])]
+        if not args.no_others and args.samtools:
+            tools.append(("samtools", [args.samtools, "sort", "--threads", args.threads, "-m", memory_per_thread_k,
+                                       "-l", args.compression, "-o", out_fname, in_fname]))
+        if not args.no_others and args.sambamba:
+            tools.append(("sambamba", [args.sambamba, "sort", "--nthreads", args.threads, "-m", memory_k,
+                                       "-l", args.compression, "-o", out_fname, in_fname]))
+        for tool, cmd in tools:
+            best = None
+            for _ in range(args.repeat):
+                wall, rss = run(cmd)
+                if best is None or wall < best["wall_seconds"]:
+                    best = {"config": config, "tool": tool, "wall_seconds": wall, "peak_rss_bytes": rss}
+                    if tool == "fast-samtools-sort":
+                        with open(stats_fname) as f:
+                            stats = json.load(f)
+                        best["records"] = stats["records"]
+                        best["phases"] = {p["name"]: p["seconds"] for p in stats["phases"]}
+            results.append(best)
+            os.remove(out_fname)
+
+    # Report
+    print("%-13s %-19s %9s %9s %12s %9s" % ("input", "tool", "wall (s)", "RSS (MB)", "records/s", "vs base"))
+    for r in results:
+        records = r.get("records") or next((o.get("records") for o in results if o["config"] == r["config"] and o.get("records")), 0)
+        base = baseline.get((r["config"], r["tool"]))
+        ratio = "%8.2fx" % (base["wall_seconds"] / r["wall_seconds"]) if base and r["wall_seconds"] > 0 else ""
+        print("%-13s %-19s %9.2f %9.1f %12.0f %9s" % (r["config"], r["tool"], r["wall_seconds"],
+                                                     r["peak_rss_bytes"] / float(1 << 20),
+                                                     records / r["wall_seconds"] if r["wall_seconds"] > 0 else 0, ratio))
+        if "phases" in r:
+            print("%-13s   " % "" + ", ".join("%s %.2f s" % (name, seconds) for name, seconds in r["phases"].items()))
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump({"threads": args.threads, "memory": memory, "reads": args.reads, "results": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+# Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+#
+# This file is part of fast-samtools-sort.
+#
+# fast-samtools-sort is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# fast-samtools-sort is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Regression checks of fast-samtools-sort on small synthetic BAM files, made by
+fast-samtools-sort-gen or written here for what it cannot make.  Each check
+prints OK or FAIL with what went wrong, and the script exits with 1 when any
+check fails.
+"""
+
+import argparse
+import gzip
+import os
+import random
+import struct
+import subprocess
+import sys
+import zlib
+
+
+def run(cmd):
+    """Run cmd; return its exit code"""
+    return subprocess.call([str(c) for c in cmd], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def write_bam(fname, refs, records):
+    """Write records, the encoded BAM records, as a BGZF file"""
+    text = "@HD\tVN:1.6\tSO:unsorted\n" + "".join("@SQ\tSN:%s\tLN:%d\n" % r for r in refs)
+    data = b"BAM\1" + struct.pack("<i", len(text)) + text.encode() + struct.pack("<i", len(refs))
+    for name, length in refs:
+        data += struct.pack("<i", len(name) + 1) + name.encode() + b"\0" + struct.pack("<i", length)
+    data += b"".join(records)
+    with open(fname, "wb") as f:
+        for i in range(0, len(data) + 1, 0xff00):
+            chunk = data[i:i + 0xff00]
+            c = zlib.compressobj(6, zlib.DEFLATED, -15)
+            deflated = c.compress(chunk) + c.flush()
+            f.write(struct.pack("<BBBBIBBHBBHH", 31, 139, 8, 4, 0, 0, 255, 6, 66, 67, 2, len(deflated) + 25))
+            f.write(deflated + struct.pack("<II", zlib.crc32(chunk), len(chunk)))
+            if not chunk:
+                break
+
+
+def bam_record(name, flag, refid, pos, mate_refid, mate_pos, length, qual, tags):
+    """A record aligned as lengthM, with base qualities qual and tags"""
+    read_name = name.encode() + b"\0"
+    body = struct.pack("<iiBBHHHiiii", refid, pos, len(read_name), 60, 4680, 1, flag, length,
+                       mate_refid, mate_pos, 0)
+    body += read_name + struct.pack("<I", length << 4) + bytes((length + 1) // 2) + bytes([qual] * length) + tags
+    return struct.pack("<i", len(body)) + body
+
+
+def read_flags(fname):
+    """The flags of the records of a BAM file, by read name and first/second read"""
+    data = gzip.open(fname).read()
+    offset = 12 + struct.unpack_from("<i", data, 4)[0]
+    for _ in range(struct.unpack_from("<i", data, offset - 4)[0]):
+        offset += 8 + struct.unpack_from("<i", data, offset)[0]
+    flags = {}
+    while offset < len(data):
+        size = struct.unpack_from("<i", data, offset)[0]
+        name_len, flag = data[offset + 12], struct.unpack_from("<H", data, offset + 18)[0]
+        flags[(data[offset + 36:offset + 35 + name_len], flag & 0xc0)] = flag
+        offset += 4 + size
+    return flags
+
+
+def check_markdup_mates_agree(args):
+    """Both records of a pair have the same duplicate flag, whatever the mates'
+    ms tags and the blocks they are sorted in"""
+    in_fname = os.path.join(args.workdir, "pairs.bam")
+    rng = random.Random(1)
+    length, records = 100, []
+    for group in range(3000):
+        refid, pos = rng.randint(0, 1), rng.randint(1000, 1990000)
+        mate_pos = pos + rng.randint(150, 600)
+        for i in range(rng.choice([1, 2, 3, 5])):
+            name = "p%d.%d" % (group, i)
+            quals = [rng.randint(15, 40), rng.randint(15, 40)]
+            # The ms tag is missing on one mate, or disagrees with the other's qualities
+            ms = [quals[1] * length, quals[0] * length]
+            kind = rng.random()
+            if kind < 0.3:
+                ms[rng.randint(0, 1)] = None
+            elif kind < 0.5:
+                ms[0] += rng.randint(-500, 500)
+            for mate in range(2):
+                flag = 0x1 | (0x40, 0x80)[mate] | (0x20, 0x10)[mate]
+                tags = b"MCZ%dM\0" % length
+                if ms[mate] is not None:
+                    tags += b"msi" + struct.pack("<i", max(0, ms[mate]))
+                records.append(bam_record(name, flag, refid, (pos, mate_pos)[mate], refid, (mate_pos, pos)[mate],
+                                          length, quals[mate], tags))
+    rng.shuffle(records)
+    write_bam(in_fname, [("chr1", 2000000), ("chr2", 2000000)], records)
+
+    layouts = []
+    for memory in ["1G", "1M", "600K"]:
+        out_fname = os.path.join(args.workdir, "pairs.%s.bam" % memory)
+        if run([args.sorter, "--markdup", "-@", 4, "-m", memory, "-o", out_fname, in_fname]) != 0:
+            return "the sort with -m %s failed" % memory
+        flags = read_flags(out_fname)
+        for (name, order), flag in flags.items():
+            if order == 0x40 and (flag ^ flags[(name, 0x80)]) & 0x400:
+                return "the mates of %s differ with -m %s" % (name.decode(), memory)
+        layouts.append(flags)
+    if any(flags != layouts[0] for flags in layouts[1:]):
+        return "the flags depend on the blocks"
+    return None
+
+
+def check_failed_sort_keeps_output(args):
+    """A sort that fails on a truncated input keeps an earlier output and index"""
+    in_fname = os.path.join(args.workdir, "truncated.bam")
+    out_fname = os.path.join(args.workdir, "out.bam")
+    full_fname = os.path.join(args.workdir, "full.bam")
+    if run([args.generator, "-n", 200000, "-r", 100, "-s", 1, "-o", full_fname]) != 0:
+        return "cannot generate " + full_fname
+    with open(full_fname, "rb") as f:
+        data = f.read()
+    with open(in_fname, "wb") as f:
+        f.write(data[:len(data) // 2])
+    kept = {out_fname: b"earlier output\n", out_fname + ".bai": b"earlier index\n"}
+    for fname, text in kept.items():
+        with open(fname, "wb") as f:
+            f.write(text)
+    if run([args.sorter, "--write-index", "-o", out_fname, in_fname]) == 0:
+        return "the sort of a truncated input succeeded"
+    for fname, text in kept.items():
+        if not os.path.exists(fname):
+            return fname + " was removed"
+        with open(fname, "rb") as f:
+            if f.read() != text:
+                return fname + " was changed"
+    left = [name for name in os.listdir(args.workdir) if ".part." in name or ".tmp." in name]
+    if left:
+        return "left " + ", ".join(left)
+    return None
+
+
+CHECKS = [
+    ("failed sort keeps output", check_failed_sort_keeps_output),
+    ("markdup mates agree", check_markdup_mates_agree),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sorter", default="./fast-samtools-sort")
+    parser.add_argument("--generator", default="./fast-samtools-sort-gen")
+    parser.add_argument("--workdir", default="check.tmp", help="Where inputs and outputs are written (Default: check.tmp)")
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    failed = 0
+    for name, check in CHECKS:
+        error = check(args)
+        print("%-32s %s" % (name, "OK" if error is None else "FAIL: " + error))
+        failed += (error is not None)
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
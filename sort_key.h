@@ -0,0 +1,290 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SORT_KEY_H_
+#define SORT_KEY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include "bgzf.h"
+#include "block_sort.h"
+
+// Sort orders other than coordinate, on raw BAM records.  Every record gets a
+//    byte string whose memcmp order is the sort order, so that keys can be cut
+//    into fixed-width prefixes, sampled and compared as splitters alike:
+//
+//    queryname   the read name, with each run of digits compared by value as
+//                in samtools' natural order, then READ1 before READ2
+//    tag         the value of a tag, missing first, then numbers by value,
+//                then strings; ties go by coordinate, or by name with -n
+//
+//    Numbers are coded as their leading-zero-free digit count followed by
+//    the digits; the count byte stays within '0'..'9' as it stands in for a
+//    digit against other characters.  In names, the number of leading zeros
+//    follows, as samtools orders equal numbers by the length of their runs,
+//    "a1" before "a01".  Records with equal keys keep their input order.
+
+enum SortOrder { SORT_COORDINATE, SORT_QUERYNAME, SORT_TAG };
+
+struct SortSpec {
+  SortOrder order;
+  char tag[2];        // SORT_TAG: the tag sorted by
+  bool then_name;     // SORT_TAG: ties go by name rather than coordinate
+};
+
+// Fields of a raw alignment record (starting at its block_size field)
+inline size_t bam_name_len(const char* rec)   { return (unsigned char)rec[12]; } // NUL included
+inline const char* bam_name(const char* rec)  { return rec + 36; }
+inline uint16_t bam_flag(const char* rec)     { uint16_t v; memcpy(&v, rec + 18, sizeof(v)); return v; }
+
+/// First byte of the aux data of a record
+inline const char* bam_aux_begin(const char* rec) {
+  uint16_t n_cigar;
+  memcpy(&n_cigar, rec + 16, sizeof(n_cigar));
+  int64_t l_seq = bam_get_i32(rec + 20);
+  return rec + 36 + bam_name_len(rec) + n_cigar * 4 + (l_seq + 1) / 2 + l_seq;
+}
+
+/// Size of an aux value of the given type at p, or 0 if it cannot be parsed
+inline size_t bam_aux_size(char type, const char* p, const char* end) {
+  switch(type) {
+  case 'A': case 'c': case 'C': return 1;
+  case 's': case 'S': return 2;
+  case 'i': case 'I': case 'f': return 4;
+  case 'Z': case 'H': {
+    const char* nul = (const char*)memchr(p, 0, end - p);
+    return nul == nullptr ? 0 : nul - p + 1;
+  }
+  case 'B': {
+    if(end - p < 5) return 0;
+    size_t elem = bam_aux_size(p[0], p, end);
+    if(elem == 0 || p[0] == 'Z' || p[0] == 'H' || p[0] == 'A') return 0;
+    return 5 + elem * (uint32_t)bam_get_i32(p + 1);
+  }
+  }
+  return 0;
+}
+
+/// Find aux tag in a record; set type and return its value, or nullptr
+inline const char* bam_aux_find(const char* rec, const char tag[2], char& type) {
+  const char* end = rec + bam_rec_size(rec);
+  const char* p = bam_aux_begin(rec);
+  if(p < rec + 36) return nullptr;
+  while(p + 3 <= end) {
+    size_t size = bam_aux_size(p[2], p + 3, end);
+    if(size == 0 || p + 3 + size > end) return nullptr;
+    if(p[0] == tag[0] && p[1] == tag[1]) {
+      type = p[2];
+      return p + 3;
+    }
+    p += 3 + size;
+  }
+  return nullptr;
+}
+
+inline void key_append_u32(std::string& key, uint32_t v) {
+  for(int shift = 24; shift >= 0; shift -= 8) key.push_back((char)(v >> shift));
+}
+
+inline void key_append_u64(std::string& key, uint64_t v) {
+  key_append_u32(key, (uint32_t)(v >> 32));
+  key_append_u32(key, (uint32_t)v);
+}
+
+/// Append a read name in natural order, then its NUL terminator
+inline void key_append_name(std::string& key, const char* name, size_t len) {
+  for(size_t i = 0; i < len; ) {
+    if((unsigned)(name[i] - '0') >= 10) {
+      key.push_back(name[i++]);
+      continue;
+    }
+    size_t first = i;
+    while(i < len && name[i] == '0') i++;
+    size_t begin = i;
+    while(i < len && (unsigned)(name[i] - '0') < 10) i++;
+    size_t digits = i - begin;
+    key.push_back((char)('0' + std::min<size_t>(digits, 9)));
+    if(digits >= 9) key.push_back((char)std::min<size_t>(digits - 9, 255));
+    key.append(name + begin, digits);
+    // Names are at most 254 characters, and their zeros as many
+    key.push_back((char)std::min<size_t>(begin - first, 255));
+  }
+  key.push_back(0);
+}
+
+/// Sort key of the record rec, replacing the contents of key
+inline void bam_sort_key(const char* rec, const SortSpec& spec, std::string& key) {
+  key.clear();
+  bool by_name = (spec.order == SORT_QUERYNAME);
+  if(spec.order == SORT_TAG) {
+    char type = 0;
+    const char* value = bam_aux_find(rec, spec.tag, type);
+    if(value == nullptr) {
+      key.push_back(0);
+    } else if(type == 'Z' || type == 'H' || type == 'A') {
+      key.push_back(2);
+      key.append(value, type == 'A' ? 1 : strlen(value));
+      key.push_back(0);
+    } else if(type == 'B') {
+      key.push_back(3); // arrays are not compared
+    } else {
+      double v = 0;
+      switch(type) {
+      case 'c': v = (int8_t)value[0]; break;
+      case 'C': v = (uint8_t)value[0]; break;
+      case 's': { int16_t x; memcpy(&x, value, 2); v = x; break; }
+      case 'S': { uint16_t x; memcpy(&x, value, 2); v = x; break; }
+      case 'i': { int32_t x; memcpy(&x, value, 4); v = x; break; }
+      case 'I': { uint32_t x; memcpy(&x, value, 4); v = x; break; }
+      case 'f': { float x; memcpy(&x, value, 4); v = x; break; }
+      }
+      // IEEE doubles order as integers once negative ones are flipped
+      uint64_t bits;
+      memcpy(&bits, &v, sizeof(bits));
+      bits = (bits >> 63) ? ~bits : (bits | (uint64_t(1) << 63));
+      key.push_back(1);
+      key_append_u64(key, bits);
+    }
+    by_name = spec.then_name;
+    if(!by_name) {
+      // Unmapped records, refID -1, come last
+      key_append_u32(key, (uint32_t)bam_refid(rec));
+      key_append_u32(key, (uint32_t)(bam_pos(rec) + 1));
+    }
+  }
+  if(by_name) {
+    // Records come from the input unchecked; names stay within them
+    size_t len = std::min(bam_name_len(rec), bam_rec_size(rec) - 36);
+    key_append_name(key, bam_name(rec), len > 0 ? len - 1 : 0);
+    key.push_back((char)(bam_flag(rec) & 0xc0));
+  }
+}
+
+/// Compare two keys as unsigned bytes, a key sorting before its extensions
+inline int key_cmp(const char* a, size_t a_len, const char* b, size_t b_len) {
+  int c = memcmp(a, b, std::min(a_len, b_len));
+  if(c != 0) return c;
+  return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+/**
+ * The 16 bytes of a record's key after the prefix that all keys of a block
+ * share, as two big-endian words, and the record itself.  Records are
+ * compared by these words, which decide most comparisons without touching
+ * the records, then by their whole keys and their read_ids.
+ */
+struct KeyedRecord {
+  uint64_t key[2];
+  const SamRecord* rec;
+};
+
+inline uint64_t key_word(const std::string& key, size_t offset) {
+  uint64_t v = 0;
+  for(size_t i = offset; i < offset + 8; i++) {
+    v = (v << 8) | (i < key.length() ? (unsigned char)key[i] : 0);
+  }
+  return v;
+}
+
+struct KeyedRecord_cmp {
+  const SortSpec* spec;
+
+  bool operator() (const KeyedRecord& a, const KeyedRecord& b) const {
+    if(a.key[0] != b.key[0]) return a.key[0] < b.key[0];
+    if(a.key[1] != b.key[1]) return a.key[1] < b.key[1];
+    static thread_local std::string a_key, b_key;
+    bam_sort_key(a.rec->line, *spec, a_key);
+    bam_sort_key(b.rec->line, *spec, b_key);
+    int c = key_cmp(a_key.data(), a_key.length(), b_key.data(), b_key.length());
+    if(c != 0) return c < 0;
+    return a.rec->read_id < b.rec->read_id;
+  }
+};
+
+// Sort a block of BAM records in a key order.  Given a runner of tasks,
+//    large blocks have their keys built and their slices sorted on several
+//    threads, and the sorted slices are merged in rounds of parallel merges.
+inline void block_sort_by_key(std::vector<SamRecord>& samRecords, const SortSpec& spec, const TaskRunner& run = TaskRunner(), size_t num_chunks = 1) {
+  const size_t n = samRecords.size();
+  if(n < 2) return;
+  if(!run || n < parallel_sort_min) num_chunks = 1;
+  num_chunks = std::max<size_t>(1, std::min(num_chunks, n));
+  auto bound = [n, num_chunks](size_t chunk) { return n * chunk / num_chunks; };
+  auto for_chunks = [&](const std::function<void(size_t)>& task) {
+    if(num_chunks == 1) {
+      task(0);
+    } else {
+      run(num_chunks, task);
+    }
+  };
+
+  // Skip the prefix all keys share, e.g. the instrument and run of read names
+  std::string first;
+  bam_sort_key(samRecords[0].line, spec, first);
+  std::vector<size_t> shared(num_chunks, first.length());
+  for_chunks([&](size_t chunk) {
+    std::string key;
+    size_t& lcp = shared[chunk];
+    for(size_t i = bound(chunk); i < bound(chunk + 1) && lcp > 0; i++) {
+      bam_sort_key(samRecords[i].line, spec, key);
+      size_t j = 0;
+      while(j < lcp && j < key.length() && key[j] == first[j]) j++;
+      lcp = j;
+    }
+  });
+  const size_t skip = *std::min_element(shared.begin(), shared.end());
+
+  std::vector<KeyedRecord> keyed(n);
+  KeyedRecord_cmp cmp;
+  cmp.spec = &spec;
+  for_chunks([&](size_t chunk) {
+    std::string key;
+    for(size_t i = bound(chunk); i < bound(chunk + 1); i++) {
+      bam_sort_key(samRecords[i].line, spec, key);
+      keyed[i].key[0] = key_word(key, skip);
+      keyed[i].key[1] = key_word(key, skip + 8);
+      keyed[i].rec = &samRecords[i];
+    }
+    std::sort(keyed.begin() + bound(chunk), keyed.begin() + bound(chunk + 1), cmp);
+  });
+  if(num_chunks > 1) {
+    std::vector<KeyedRecord> merged(n);
+    for(size_t width = 1; width < num_chunks; width *= 2) {
+      run((num_chunks + 2 * width - 1) / (2 * width), [&](size_t m) {
+        size_t lo = bound(2 * m * width);
+        size_t mid = bound(std::min(2 * m * width + width, num_chunks));
+        size_t hi = bound(std::min(2 * m * width + 2 * width, num_chunks));
+        std::merge(keyed.begin() + lo, keyed.begin() + mid, keyed.begin() + mid, keyed.begin() + hi, merged.begin() + lo, cmp);
+      });
+      keyed.swap(merged);
+    }
+  }
+  std::vector<SamRecord> sorted(n);
+  for(size_t i = 0; i < n; i++) {
+    sorted[i] = *keyed[i].rec;
+  }
+  samRecords.swap(sorted);
+}
+
+#endif /* SORT_KEY_H_ */
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <sys/resource.h>
+#include "stats.h"
+
+RunStats::RunStats() : _start(now()) { }
+
+RunStats::Phase::Phase(RunStats& stats, const std::string& name) :
+  _stats(stats), _name(name), _start(std::chrono::steady_clock::now()) { }
+
+RunStats::Phase::~Phase() {
+  _stats.add_phase(_name, std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count());
+}
+
+double RunStats::now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RunStats::add_phase(const std::string& name, double seconds) {
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  for(size_t i = 0; i < _phases.size(); i++) {
+    if(_phases[i].name == name) {
+      _phases[i].seconds += seconds;
+      return;
+    }
+  }
+  PhaseStats phase;
+  phase.name = name;
+  phase.seconds = seconds;
+  _phases.push_back(phase);
+}
+
+void RunStats::add_block(const BlockStats& block) {
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  _blocks.push_back(block);
+}
+
+void RunStats::add_wait(size_t thread, double seconds) {
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+  if(_waits.size() <= thread) _waits.resize(thread + 1, 0);
+  _waits[thread] += seconds;
+}
+
+std::string json_string(const std::string& str) {
+  std::string quoted = "\"";
+  for(size_t i = 0; i < str.length(); i++) {
+    unsigned char c = str[i];
+    if(c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if(c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+size_t peak_rss_bytes() {
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+// Per-thread totals of the blocks a thread sorted
+struct ThreadTotals {
+  size_t blocks = 0, records = 0, bytes_in = 0, bytes_out = 0, duplicates = 0;
+  double wait = 0, load = 0, sort = 0, encode = 0, write = 0;
+};
+
+static void write_times(FILE* fp, double wait, double load, double sort, double encode, double write) {
+  fprintf(fp, "\"wait\": %.6f, \"load\": %.6f, \"sort\": %.6f, \"encode\": %.6f, \"write\": %.6f",
+          wait, load, sort, encode, write);
+}
+
+bool RunStats::write_json(const std::string& fname,
+                          const std::vector<std::pair<std::string, std::string> >& settings) const {
+  FILE* fp = fopen(fname.c_str(), "w");
+  if(fp == nullptr) return false;
+  tthread::lock_guard<tthread::mutex> lock(_mutex);
+
+  double wall = now() - _start;
+  std::map<size_t, ThreadTotals> threads;
+  ThreadTotals total;
+  for(size_t i = 0; i < _waits.size(); i++) {
+    threads[i].wait += _waits[i];
+  }
+  for(size_t i = 0; i < _blocks.size(); i++) {
+    const BlockStats& b = _blocks[i];
+    ThreadTotals* sums[2] = {&threads[b.thread], &total};
+    for(size_t s = 0; s < 2; s++) {
+      sums[s]->blocks++;
+      sums[s]->records   += b.records;
+      sums[s]->bytes_in  += b.bytes_in;
+      sums[s]->bytes_out += b.bytes_out;
+      sums[s]->duplicates += b.duplicates;
+      sums[s]->wait      += b.wait;
+      sums[s]->load      += b.load;
+      sums[s]->sort      += b.sort;
+      sums[s]->encode    += b.encode;
+      sums[s]->write     += b.write;
+    }
+  }
+
+  fprintf(fp, "{\n");
+  for(size_t i = 0; i < settings.size(); i++) {
+    fprintf(fp, "  %s: %s,\n", json_string(settings[i].first).c_str(), settings[i].second.c_str());
+  }
+  fprintf(fp, "  \"wall_seconds\": %.6f,\n", wall);
+  fprintf(fp, "  \"peak_rss_bytes\": %zu,\n", peak_rss_bytes());
+  fprintf(fp, "  \"blocks\": %zu,\n", total.blocks);
+  fprintf(fp, "  \"records\": %zu,\n", total.records);
+  fprintf(fp, "  \"bytes_in\": %zu,\n", total.bytes_in);
+  fprintf(fp, "  \"bytes_out\": %zu,\n", total.bytes_out);
+  fprintf(fp, "  \"duplicates\": %zu,\n", total.duplicates);
+  fprintf(fp, "  \"records_per_second\": %.1f,\n", wall > 0 ? total.records / wall : 0.0);
+  fprintf(fp, "  \"phases\": [");
+  for(size_t i = 0; i < _phases.size(); i++) {
+    fprintf(fp, "%s\n    {\"name\": %s, \"seconds\": %.6f}", i == 0 ? "" : ",",
+            json_string(_phases[i].name).c_str(), _phases[i].seconds);
+  }
+  fprintf(fp, "\n  ],\n");
+  fprintf(fp, "  \"thread_stats\": [");
+  for(std::map<size_t, ThreadTotals>::const_iterator itr = threads.begin(); itr != threads.end(); itr++) {
+    const ThreadTotals& t = itr->second;
+    fprintf(fp, "%s\n    {\"thread\": %zu, \"blocks\": %zu, \"records\": %zu, \"bytes_in\": %zu, \"bytes_out\": %zu, ",
+            itr == threads.begin() ? "" : ",", itr->first, t.blocks, t.records, t.bytes_in, t.bytes_out);
+    write_times(fp, t.wait, t.load, t.sort, t.encode, t.write);
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  ],\n");
+  std::vector<BlockStats> blocks = _blocks;
+  std::sort(blocks.begin(), blocks.end(), [](const BlockStats& a, const BlockStats& b) { return a.block < b.block; });
+  fprintf(fp, "  \"block_stats\": [");
+  for(size_t i = 0; i < blocks.size(); i++) {
+    const BlockStats& b = blocks[i];
+    fprintf(fp, "%s\n    {\"block\": %zu, \"thread\": %zu, \"kind\": %s, \"records\": %zu, \"pieces\": %zu, \"duplicates\": %zu, \"bytes_in\": %zu, \"bytes_out\": %zu, ",
+            i == 0 ? "" : ",", b.block, b.thread, json_string(b.kind).c_str(), b.records, b.pieces, b.duplicates, b.bytes_in, b.bytes_out);
+    write_times(fp, b.wait, b.load, b.sort, b.encode, b.write);
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  bool ok = (ferror(fp) == 0);
+  return fclose(fp) == 0 && ok;
+}
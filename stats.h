@@ -0,0 +1,100 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stddef.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "tinythread.h"
+
+// Counters of a run for --stats-json: the time of each phase, and for every
+//    block the thread that sorted it, its records and bytes, and the time it
+//    took to load, sort, encode and hand over
+
+struct BlockStats {
+  size_t      block     = 0;
+  size_t      thread    = 0;
+  std::string kind;            // aligned, region, unaligned or copy
+  size_t      records   = 0;   // not counted in copy blocks, which are not decoded
+  size_t      pieces    = 1;   // files or reads an aligned block was sorted in
+  size_t      duplicates = 0;  // records marked with --markdup
+  size_t      bytes_in  = 0;   // records as loaded, or compressed bytes copied
+  size_t      bytes_out = 0;   // compressed output, or SAM text piped to samtools
+  double      wait      = 0;   // seconds waiting for the block, helping others included
+  double      load      = 0;
+  double      sort      = 0;
+  double      encode    = 0;   // compression, or piping to samtools
+  double      write     = 0;   // handing the output over to the ordered writer
+};
+
+/**
+ * Thread-safe collection of the counters of a run, written out as JSON.
+ */
+class RunStats {
+public:
+  RunStats();
+
+  /// Adds the time from its construction to its destruction to a phase
+  class Phase {
+  public:
+    Phase(RunStats& stats, const std::string& name);
+    ~Phase();
+  private:
+    RunStats&                             _stats;
+    std::string                           _name;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  void add_phase(const std::string& name, double seconds);
+  void add_block(const BlockStats& block);
+  /// Time a thread spent waiting after its last block
+  void add_wait(size_t thread, double seconds);
+
+  /// Write a JSON object with the settings given as name/value pairs of JSON
+  ///    text, the totals, the phases, the threads and the blocks;
+  ///    return false if fname cannot be written
+  bool write_json(const std::string& fname,
+                  const std::vector<std::pair<std::string, std::string> >& settings) const;
+
+  /// Seconds since an arbitrary start, for timing spans
+  static double now();
+
+private:
+  struct PhaseStats {
+    std::string name;
+    double      seconds;
+  };
+
+  double                   _start;
+  std::vector<PhaseStats>  _phases;
+  std::vector<BlockStats>  _blocks;
+  std::vector<double>      _waits;   // per thread
+  mutable tthread::mutex   _mutex;
+};
+
+/// Quote str as a JSON string
+std::string json_string(const std::string& str);
+
+/// Peak resident set size of the process in bytes, or 0 if unknown
+size_t peak_rss_bytes();
+
+#endif /* STATS_H_ */
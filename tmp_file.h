@@ -0,0 +1,128 @@
+/*
+ * Copyright 2018, Christopher Bennett <Christopher.Bennett@UTSouthwestern.edu> and Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of fast-samtools-sort.
+ *
+ * fast-samtools-sort is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * fast-samtools-sort is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with fast-samtools-sort.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TMP_FILE_H_
+#define TMP_FILE_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <string>
+
+static const size_t TMP_FILE_ALIGN = 4096; // O_DIRECT alignment of buffers, offsets and lengths
+
+/**
+ * Sequential writer of a temporary file through a buffer of its own, aligned
+ * and a multiple of TMP_FILE_ALIGN long, so that the file is written in large
+ * aligned writes.  With direct I/O, these bypass the page cache (O_DIRECT, on
+ * file systems that support it), which keeps the cache for the blocks that
+ * are read back; the unaligned tail of the file is written last, without it.
+ */
+class TmpFileWriter {
+public:
+  TmpFileWriter() : _fd(-1), _buffer(nullptr), _capacity(0), _length(0), _direct(false), _failed(false) { }
+  ~TmpFileWriter() {
+    if(_fd >= 0) ::close(_fd);
+    free(_buffer);
+  }
+
+  bool open(const std::string& fname, size_t buffer_size, bool direct) {
+    buffer_size = std::max(TMP_FILE_ALIGN, buffer_size / TMP_FILE_ALIGN * TMP_FILE_ALIGN);
+    if(_buffer == nullptr || _capacity != buffer_size) {
+      free(_buffer);
+      _buffer = nullptr;
+      if(posix_memalign((void**)&_buffer, TMP_FILE_ALIGN, buffer_size) != 0) throw std::bad_alloc();
+      _capacity = buffer_size;
+    }
+    _length = 0;
+    _failed = false;
+    _direct = false;
+#ifdef O_DIRECT
+    if(direct) {
+      _fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+      _direct = (_fd >= 0);
+    }
+#endif
+    if(_fd < 0) _fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return _fd >= 0;
+  }
+
+  bool is_open() const { return _fd >= 0; }
+
+  void write(const void* data, size_t length) {
+    const char* p = (const char*)data;
+    while(length > 0) {
+      size_t count = std::min(length, _capacity - _length);
+      memcpy(_buffer + _length, p, count);
+      _length += count;
+      p += count;
+      length -= count;
+      if(_length == _capacity) flush();
+    }
+  }
+
+  /// Write the rest of the buffer and close the file; return false if any
+  ///    write failed
+  bool close() {
+    if(_fd < 0) return !_failed;
+#ifdef O_DIRECT
+    if(_direct && _length % TMP_FILE_ALIGN != 0) {
+      int flags = fcntl(_fd, F_GETFL);
+      _failed = (flags < 0 || fcntl(_fd, F_SETFL, flags & ~O_DIRECT) != 0) || _failed;
+    }
+#endif
+    flush();
+    _failed = (::close(_fd) != 0) || _failed;
+    _fd = -1;
+    return !_failed;
+  }
+
+private:
+  void flush() {
+    for(size_t done = 0; done < _length && !_failed; ) {
+      ssize_t count = ::write(_fd, _buffer + done, _length - done);
+      if(count < 0 && errno == EINTR) continue;
+      if(count <= 0) {
+        _failed = true;
+        break;
+      }
+      done += count;
+    }
+    _length = 0;
+  }
+
+private:
+  int     _fd;
+  char*   _buffer;
+  size_t  _capacity;
+  size_t  _length;
+  bool    _direct;
+  bool    _failed;
+
+  TmpFileWriter(const TmpFileWriter&);
+  TmpFileWriter& operator=(const TmpFileWriter&);
+};
+
+#endif /* TMP_FILE_H_ */